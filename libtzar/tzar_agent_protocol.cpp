@@ -0,0 +1,72 @@
+// === libtzar/tzar_agent_protocol.cpp ===
+#include "tzar_agent_protocol.h"
+
+#include <cerrno>    // For errno
+#include <cstring>   // For std::memcpy, std::strerror
+#include <stdexcept> // For std::runtime_error
+#include <sys/socket.h>
+#include <sys/un.h>  // For sockaddr_un
+#include <unistd.h>  // For close()
+
+#include "tzar_crypto.h" // For KDF_MIN_ITERATIONS
+
+std::string agentRequest(const std::string& socket_path, const std::string& request, size_t response_size) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Key agent socket path is too long: " + socket_path);
+    }
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::string reason = std::strerror(errno);
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("Could not connect to key agent at " + socket_path + ": " + reason);
+    }
+    std::string response(1 + response_size, '\0');
+    bool ok = send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size());
+    for (size_t done = 0; ok && done < response.size();) {
+        ssize_t n = recv(fd, &response[done], response.size() - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        done += ok ? n : 0;
+    }
+    close(fd);
+    if (!ok && response[0] == AGENT_OK) {
+        throw std::runtime_error("Key agent closed the connection early.");
+    }
+    if (response[0] != AGENT_OK) {
+        throw std::runtime_error("Key agent refused the request.");
+    }
+    return response.substr(1);
+}
+
+std::vector<uint8_t> agentNewKey(const std::string& socket_path, KdfParams& params) {
+    std::string response = agentRequest(socket_path, std::string(1, static_cast<char>(AGENT_NEW_KEY)),
+                                        1 + 4 + KDF_SALT_SIZE + AGENT_KEY_SIZE);
+    params.kdf = static_cast<KdfId>(response[0]);
+    std::memcpy(&params.iterations, &response[1], 4);
+    std::memcpy(params.salt, &response[5], KDF_SALT_SIZE);
+    return std::vector<uint8_t>(response.begin() + 5 + KDF_SALT_SIZE, response.end());
+}
+
+bool agentServesKdf(const KdfParams& params) {
+    return params.kdf == KDF_PBKDF2_HMAC_SHA256 && params.iterations >= KDF_MIN_ITERATIONS;
+}
+
+std::vector<uint8_t> agentDeriveKey(const std::string& socket_path, const KdfParams& params) {
+    if (!agentServesKdf(params)) {
+        std::string kdf = kdfName(params.kdf);
+        if (params.kdf == KDF_PBKDF2_HMAC_SHA256) {
+            kdf += " with " + std::to_string(params.iterations) + " iterations";
+        }
+        throw std::runtime_error("The key agent does not derive keys for this archive (" + kdf +
+                                 "); give the password on the command line.");
+    }
+    std::string request(1, static_cast<char>(AGENT_DERIVE));
+    request += static_cast<char>(params.kdf);
+    request.append(reinterpret_cast<const char*>(&params.iterations), 4);
+    request.append(reinterpret_cast<const char*>(params.salt), KDF_SALT_SIZE);
+    std::string key = agentRequest(socket_path, request, AGENT_KEY_SIZE);
+    return std::vector<uint8_t>(key.begin(), key.end());
+}
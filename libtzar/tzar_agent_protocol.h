@@ -0,0 +1,43 @@
+// === libtzar/tzar_agent_protocol.h ===
+// Wire protocol between tzar_agent and its clients, and the client side of it.
+// Without a password on the command line, a running tzar_agent named by TZAR_AGENT_SOCK
+// supplies the master key instead: it derives each key once and keeps it in locked
+// memory, so a batch of archives pays for the KDF only once.
+#ifndef TZAR_AGENT_PROTOCOL_H
+#define TZAR_AGENT_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tzar_format.h"
+
+const char* const AGENT_SOCKET_ENV = "TZAR_AGENT_SOCK";
+enum AgentOp : uint8_t {
+    AGENT_NEW_KEY = 'N', // -> status, KdfId, u32 iterations, salt, key (the agent's key for new archives)
+    AGENT_DERIVE = 'D'   // KdfId, u32 iterations, salt -> status, key
+};
+const uint8_t AGENT_OK = 0;
+const uint8_t AGENT_ERROR = 1;
+const size_t AGENT_KEY_SIZE = 32;
+const size_t AGENT_DERIVE_REQUEST_SIZE = 1 + 1 + 4 + KDF_SALT_SIZE;
+
+// Sends 'request' to the agent and reads a status byte plus 'response_size' bytes.
+// Throws std::runtime_error if the agent cannot be reached or refuses.
+std::string agentRequest(const std::string& socket_path, const std::string& request, size_t response_size);
+
+// Asks the agent for its key for new archives and the KDF parameters to store with it.
+std::vector<uint8_t> agentNewKey(const std::string& socket_path, KdfParams& params);
+
+// True if the agent derives keys for these KDF parameters: PBKDF2 with at least
+// KDF_MIN_ITERATIONS. Anything cheaper would let a client of the socket test password
+// guesses against the agent's password, so archives using the legacy hash (versions 0-5)
+// need the password itself.
+bool agentServesKdf(const KdfParams& params);
+
+// Asks the agent for the master key of an archive with the given KDF parameters.
+// Throws std::runtime_error without contacting it if !agentServesKdf(params).
+std::vector<uint8_t> agentDeriveKey(const std::string& socket_path, const KdfParams& params);
+
+#endif // TZAR_AGENT_PROTOCOL_H
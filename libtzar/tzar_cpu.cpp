@@ -0,0 +1,88 @@
+// === libtzar/tzar_cpu.cpp ===
+#include "tzar_cpu.h"
+
+#include <cstdlib>  // For std::getenv
+#include <iostream> // For std::cerr
+
+struct CpuFeatureName {
+    CpuFeature feature;
+    const char* name; // As understood by __builtin_cpu_supports()
+};
+
+static const CpuFeatureName CPU_FEATURE_NAMES[] = {
+    {CPU_SSE2, "sse2"}, {CPU_SSSE3, "ssse3"}, {CPU_SSE41, "sse4.1"}, {CPU_SSE42, "sse4.2"}, {CPU_AVX2, "avx2"},
+    {CPU_AVX512F, "avx512f"}, {CPU_AES, "aes"}, {CPU_PCLMUL, "pclmul"}, {CPU_SHA, "sha"},
+};
+
+// __builtin_cpu_supports() takes only string literals, hence the explicit list.
+static uint32_t probeFeatures() {
+    uint32_t features = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) features |= CPU_SSE2;
+    if (__builtin_cpu_supports("ssse3")) features |= CPU_SSSE3;
+    if (__builtin_cpu_supports("sse4.1")) features |= CPU_SSE41;
+    if (__builtin_cpu_supports("sse4.2")) features |= CPU_SSE42;
+    if (__builtin_cpu_supports("avx2")) features |= CPU_AVX2;
+    if (__builtin_cpu_supports("avx512f")) features |= CPU_AVX512F;
+    if (__builtin_cpu_supports("aes")) features |= CPU_AES;
+    if (__builtin_cpu_supports("pclmul")) features |= CPU_PCLMUL;
+    if (__builtin_cpu_supports("sha")) features |= CPU_SHA;
+#endif
+    return features;
+}
+
+static uint32_t disabledFeatures() {
+    const char* list = std::getenv(CPU_DISABLE_ENV);
+    if (list == nullptr) return 0;
+    uint32_t disabled = 0;
+    std::string names(list);
+    size_t start = 0;
+    while (start <= names.size()) {
+        size_t end = names.find(',', start);
+        if (end == std::string::npos) end = names.size();
+        std::string name = names.substr(start, end - start);
+        start = end + 1;
+        if (name.empty()) continue;
+        if (name == "all") {
+            disabled = ~0u;
+            continue;
+        }
+        bool known = false;
+        for (const CpuFeatureName& entry : CPU_FEATURE_NAMES) {
+            if (name == entry.name) {
+                disabled |= entry.feature;
+                known = true;
+            }
+        }
+        if (!known) {
+            std::cerr << "Warning: Unknown CPU feature in " << CPU_DISABLE_ENV << ": " << name << std::endl;
+        }
+    }
+    return disabled;
+}
+
+uint32_t cpuDetectedFeatures() {
+    static const uint32_t features = probeFeatures();
+    return features;
+}
+
+uint32_t cpuFeatures() {
+    static const uint32_t features = cpuDetectedFeatures() & ~disabledFeatures();
+    return features;
+}
+
+bool cpuHas(uint32_t features) {
+    return (cpuFeatures() & features) == features;
+}
+
+std::string cpuFeatureNames(uint32_t features) {
+    std::string names;
+    for (const CpuFeatureName& entry : CPU_FEATURE_NAMES) {
+        if (features & entry.feature) {
+            if (!names.empty()) names += ' ';
+            names += entry.name;
+        }
+    }
+    return names.empty() ? "none" : names;
+}
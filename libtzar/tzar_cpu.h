@@ -0,0 +1,41 @@
+// === libtzar/tzar_cpu.h ===
+// The one place that asks the CPU what it supports. Every kernel family (SHA256, the XOR
+// cipher, ChaCha20, AES-GCM, CRC-32C, zero-block detection) picks its variant from
+// cpuHas() once, on first use, and keeps a function pointer to it. Setting TZAR_CPU_DISABLE
+// hides features from that choice, so every variant can be exercised on a single machine,
+// e.g. TZAR_CPU_DISABLE=avx512f,avx2 tzar_encrypt --bench.
+#ifndef TZAR_CPU_H
+#define TZAR_CPU_H
+
+#include <cstdint>
+#include <string>
+
+// Comma-separated feature names (as in cpuFeatureNames()) to treat as missing, or "all".
+const char* const CPU_DISABLE_ENV = "TZAR_CPU_DISABLE";
+
+enum CpuFeature : uint32_t {
+    CPU_SSE2 = 1u << 0,
+    CPU_SSSE3 = 1u << 1,
+    CPU_SSE41 = 1u << 2,
+    CPU_SSE42 = 1u << 3,
+    CPU_AVX2 = 1u << 4,
+    CPU_AVX512F = 1u << 5,
+    CPU_AES = 1u << 6,
+    CPU_PCLMUL = 1u << 7,
+    CPU_SHA = 1u << 8
+};
+
+// Features the CPU (and OS) support, probed once. Always 0 off x86.
+uint32_t cpuDetectedFeatures();
+
+// cpuDetectedFeatures() minus those named by CPU_DISABLE_ENV. Read once; unknown names
+// are reported on stderr and ignored.
+uint32_t cpuFeatures();
+
+// True if every feature in the 'features' mask is available.
+bool cpuHas(uint32_t features);
+
+// Space-separated names of the features in 'features', e.g. "sse2 avx2"; "none" if empty.
+std::string cpuFeatureNames(uint32_t features);
+
+#endif // TZAR_CPU_H
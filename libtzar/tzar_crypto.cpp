@@ -0,0 +1,1286 @@
+// === libtzar/tzar_crypto.cpp ===
+#include "tzar_crypto.h"
+
+#include <algorithm> // For std::min
+#include <cstring>   // For std::memcpy, std::memset
+#include <stdexcept> // For std::runtime_error
+
+#include "tzar_cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // For the SHA-NI, AVX2/AVX-512 and AES-NI kernels
+#endif
+
+// --- SHA256 (FIPS 180-4) ---
+// Self-contained SHA256 with an incremental API (sha256_init / sha256_update /
+// sha256_final). Blocks are compressed with the SHA extensions where the CPU has them;
+// sha256_many() hashes independent messages, eight at a time with AVX2 on CPUs without
+// SHA-NI.
+
+// Rotate right
+#define ROTR(x, n) ((x >> n) | (x << (32 - n)))
+
+// SHA256 functions
+#define CH(x, y, z) ((x & y) ^ (~x & z))
+#define MAJ(x, y, z) ((x & y) ^ (x & z) ^ (y & z))
+#define SIG0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define SIG1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define CAP_SIG0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ (x >> 3))
+#define CAP_SIG1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ (x >> 10))
+
+// SHA256 K constants
+alignas(16) static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Format versions 0-5 derived their keys while K[54] above still read 0x5b94ca4f, a
+// transcription error. legacy_sha256() reproduces that function so those archives stay
+// readable; everything else uses the real SHA256.
+static const uint32_t K54_LEGACY = 0x5b94ca4f;
+
+// Initial hash values H0-H7
+extern const uint32_t SHA256_INIT[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// SHA256 compression function; Legacy selects the K54_LEGACY round constant.
+template <bool Legacy>
+static void sha256_compress(uint32_t state[8], const uint8_t block[64]) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    uint32_t W[64];
+
+    for (int i = 0; i < 16; ++i) {
+        W[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 64; ++i) {
+        W[i] = CAP_SIG1(W[i - 2]) + W[i - 7] + CAP_SIG0(W[i - 15]) + W[i - 16];
+    }
+
+    for (int i = 0; i < 64; ++i) {
+        uint32_t k = (Legacy && i == 54) ? K54_LEGACY : K[i];
+        uint32_t T1 = h + SIG1(e) + CH(e, f, g) + k + W[i];
+        uint32_t T2 = SIG0(a) + MAJ(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + T1;
+        d = c;
+        c = b;
+        b = a;
+        a = T1 + T2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256_blocks_scalar(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    for (; blocks > 0; --blocks, data += 64) {
+        sha256_compress<false>(state, data);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SHA extensions: sha256rnds2 runs two rounds on the state split as ABEF / CDGH,
+// sha256msg1 / sha256msg2 extend the message schedule four words at a time.
+__attribute__((target("sha,sse4.1")))
+void sha256_blocks_shani(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i dcba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+    __m128i hgfe = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; blocks > 0; --blocks, data += 64) {
+        const __m128i abef_saved = abef;
+        const __m128i cdgh_saved = cdgh;
+        __m128i msg[4];
+#pragma GCC unroll 16
+        for (int j = 0; j < 16; ++j) {
+            if (j < 4) {
+                msg[j] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * j)), byte_swap);
+            }
+            __m128i words = _mm_add_epi32(msg[j % 4], _mm_load_si128(reinterpret_cast<const __m128i*>(K + 4 * j)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, words);
+            if (j >= 3 && j < 15) {
+                __m128i next = _mm_add_epi32(msg[(j + 1) % 4], _mm_alignr_epi8(msg[j % 4], msg[(j + 3) % 4], 4));
+                msg[(j + 1) % 4] = _mm_sha256msg2_epu32(next, msg[j % 4]);
+            }
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(words, 0x0E));
+            if (j >= 1 && j < 13) {
+                msg[(j + 3) % 4] = _mm_sha256msg1_epu32(msg[(j + 3) % 4], msg[j % 4]);
+            }
+        }
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+bool sha256_shani_supported() {
+#if defined(__x86_64__) || defined(__i386__)
+    return cpuHas(CPU_SHA | CPU_SSE41);
+#else
+    return false;
+#endif
+}
+
+Sha256Blocks selectSha256Blocks() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (sha256_shani_supported()) return sha256_blocks_shani;
+#endif
+    return sha256_blocks_scalar;
+}
+
+void sha256_transform(uint32_t state[8], const uint8_t block[64], bool legacy) {
+    static const Sha256Blocks compress = selectSha256Blocks();
+    if (legacy) {
+        sha256_compress<true>(state, block);
+    } else {
+        compress(state, block, 1);
+    }
+}
+
+void sha256_init(Sha256Context& ctx, bool legacy) {
+    std::memcpy(ctx.state, SHA256_INIT, sizeof(ctx.state));
+    ctx.buffered = 0;
+    ctx.length = 0;
+    ctx.legacy = legacy;
+}
+
+static void sha256_process(Sha256Context& ctx, const uint8_t* data, size_t blocks) {
+    static const Sha256Blocks compress = selectSha256Blocks();
+    if (ctx.legacy) {
+        for (; blocks > 0; --blocks, data += 64) sha256_compress<true>(ctx.state, data);
+    } else {
+        compress(ctx.state, data, blocks);
+    }
+}
+
+void sha256_update(Sha256Context& ctx, const void* data, size_t len) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    ctx.length += len;
+    if (ctx.buffered > 0) {
+        size_t take = std::min(len, sizeof(ctx.buffer) - ctx.buffered);
+        std::memcpy(ctx.buffer + ctx.buffered, bytes, take);
+        ctx.buffered += take;
+        bytes += take;
+        len -= take;
+        if (ctx.buffered < sizeof(ctx.buffer)) return;
+        sha256_process(ctx, ctx.buffer, 1);
+        ctx.buffered = 0;
+    }
+    sha256_process(ctx, bytes, len / 64);
+    bytes += len / 64 * 64;
+    ctx.buffered = len % 64;
+    std::memcpy(ctx.buffer, bytes, ctx.buffered);
+}
+
+void sha256_final(Sha256Context& ctx, uint8_t digest[32]) {
+    uint64_t bit_len = ctx.length * 8;
+    // Pad with a '1' bit, zeros up to 56 mod 64 bytes, then the 64-bit message length
+    uint8_t padding[72] = {0x80};
+    size_t pad_len = (ctx.buffered < 56 ? 56 : 120) - ctx.buffered;
+    for (int i = 0; i < 8; ++i) {
+        padding[pad_len + i] = static_cast<uint8_t>(bit_len >> (56 - 8 * i));
+    }
+    sha256_update(ctx, padding, pad_len + 8);
+    for (int i = 0; i < 8; ++i) {
+        digest[i * 4] = (ctx.state[i] >> 24) & 0xFF;
+        digest[i * 4 + 1] = (ctx.state[i] >> 16) & 0xFF;
+        digest[i * 4 + 2] = (ctx.state[i] >> 8) & 0xFF;
+        digest[i * 4 + 3] = ctx.state[i] & 0xFF;
+    }
+}
+
+std::vector<uint8_t> sha256(const std::vector<uint8_t>& data, bool legacy) {
+    Sha256Context ctx;
+    sha256_init(ctx, legacy);
+    sha256_update(ctx, data.data(), data.size());
+    std::vector<uint8_t> hash(32);
+    sha256_final(ctx, hash.data());
+    return hash;
+}
+
+std::vector<uint8_t> legacy_sha256(const std::vector<uint8_t>& data) {
+    return sha256(data, true);
+}
+
+// --- Multi-message SHA256 ---
+void sha256_many_serial(const uint8_t* const* messages, const size_t* lengths, size_t count, uint8_t* digests) {
+    for (size_t i = 0; i < count; ++i) {
+        Sha256Context ctx;
+        sha256_init(ctx);
+        sha256_update(ctx, messages[i], lengths[i]);
+        sha256_final(ctx, digests + 32 * i);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Eight messages at once, one per 32-bit AVX2 lane. A lane that finishes its message
+// is refilled with the next one, so messages of different lengths keep every lane busy.
+#define SHA256_X8_TARGET __attribute__((target("avx2")))
+
+SHA256_X8_TARGET static inline __m256i sha256x8_rotr(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+// Loads word i of eight 32-byte rows into out[i] (an 8x8 transpose), byte-swapped.
+SHA256_X8_TARGET static inline void sha256x8_load_words(const uint8_t* const rows[8], size_t offset, __m256i out[8]) {
+    const __m256i byte_swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                               3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i r[8], t[8];
+    for (int i = 0; i < 8; ++i) {
+        r[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[i] + offset));
+    }
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        r[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        r[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        r[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        r[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; ++i) {
+        out[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r[i], r[i + 4], 0x20), byte_swap);
+        out[i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(r[i], r[i + 4], 0x31), byte_swap);
+    }
+}
+
+SHA256_X8_TARGET static void sha256x8_compress(__m256i state[8], const uint8_t* const blocks[8]) {
+    __m256i w[16];
+    sha256x8_load_words(blocks, 0, w);
+    sha256x8_load_words(blocks, 32, w + 8);
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+#pragma GCC unroll 16
+    for (int i = 0; i < 64; ++i) {
+        if (i >= 16) {
+            __m256i w15 = w[(i - 15) & 15];
+            __m256i w2 = w[(i - 2) & 15];
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(sha256x8_rotr(w15, 7), sha256x8_rotr(w15, 18)),
+                                          _mm256_srli_epi32(w15, 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(sha256x8_rotr(w2, 17), sha256x8_rotr(w2, 19)),
+                                          _mm256_srli_epi32(w2, 10));
+            w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+        }
+        __m256i sig1 = _mm256_xor_si256(_mm256_xor_si256(sha256x8_rotr(e, 6), sha256x8_rotr(e, 11)),
+                                        sha256x8_rotr(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, sig1),
+                                      _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32(K[i]), w[i & 15])));
+        __m256i sig0 = _mm256_xor_si256(_mm256_xor_si256(sha256x8_rotr(a, 2), sha256x8_rotr(a, 13)),
+                                        sha256x8_rotr(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(t1, _mm256_add_epi32(sig0, maj));
+    }
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e);
+    state[5] = _mm256_add_epi32(state[5], f);
+    state[6] = _mm256_add_epi32(state[6], g);
+    state[7] = _mm256_add_epi32(state[7], h);
+}
+
+SHA256_X8_TARGET void sha256_many_avx2(const uint8_t* const* messages, const size_t* lengths, size_t count,
+                                       uint8_t* digests) {
+    struct Lane {
+        size_t message;       // Index of the message in this lane; count if idle
+        uint64_t block;       // Next block
+        uint64_t full_blocks; // Blocks read straight from the message
+        uint64_t blocks;      // Including the one or two padded tail blocks
+        uint8_t tail[128];
+    };
+    static const uint8_t idle_block[64] = {};
+    Lane lanes[8];
+    alignas(32) uint32_t words[8][8]; // words[i][lane]: state word i of every lane
+    size_t next = 0;
+    int active = 0;
+
+    auto start = [&](int l) {
+        Lane& lane = lanes[l];
+        lane.message = next;
+        if (next == count) return;
+        next++;
+        active++;
+        uint64_t length = lengths[lane.message];
+        size_t rest = length % 64;
+        lane.block = 0;
+        lane.full_blocks = length / 64;
+        lane.blocks = lane.full_blocks + (rest < 56 ? 1 : 2);
+        size_t tail_size = rest < 56 ? 64 : 128;
+        std::memset(lane.tail, 0, sizeof(lane.tail));
+        std::memcpy(lane.tail, messages[lane.message] + lane.full_blocks * 64, rest);
+        lane.tail[rest] = 0x80;
+        for (int i = 0; i < 8; ++i) {
+            lane.tail[tail_size - 1 - i] = static_cast<uint8_t>((length * 8) >> (8 * i));
+        }
+        for (int i = 0; i < 8; ++i) words[i][l] = SHA256_INIT[i];
+    };
+    for (int l = 0; l < 8; ++l) start(l);
+
+    while (active > 0) {
+        const uint8_t* blocks[8];
+        for (int l = 0; l < 8; ++l) {
+            const Lane& lane = lanes[l];
+            if (lane.message == count) {
+                blocks[l] = idle_block;
+            } else if (lane.block < lane.full_blocks) {
+                blocks[l] = messages[lane.message] + lane.block * 64;
+            } else {
+                blocks[l] = lane.tail + (lane.block - lane.full_blocks) * 64;
+            }
+        }
+        __m256i state[8];
+        for (int i = 0; i < 8; ++i) state[i] = _mm256_load_si256(reinterpret_cast<const __m256i*>(words[i]));
+        sha256x8_compress(state, blocks);
+        for (int i = 0; i < 8; ++i) _mm256_store_si256(reinterpret_cast<__m256i*>(words[i]), state[i]);
+
+        for (int l = 0; l < 8; ++l) {
+            Lane& lane = lanes[l];
+            if (lane.message == count || ++lane.block < lane.blocks) continue;
+            uint8_t* digest = digests + 32 * lane.message;
+            for (int i = 0; i < 8; ++i) {
+                digest[i * 4] = (words[i][l] >> 24) & 0xFF;
+                digest[i * 4 + 1] = (words[i][l] >> 16) & 0xFF;
+                digest[i * 4 + 2] = (words[i][l] >> 8) & 0xFF;
+                digest[i * 4 + 3] = words[i][l] & 0xFF;
+            }
+            active--;
+            start(l);
+        }
+    }
+}
+#endif
+
+// "serial" hashes one message after another with the block function this CPU prefers.
+std::vector<Sha256ManyInfo> sha256ManyBackends() {
+    std::vector<Sha256ManyInfo> backends = {{"serial", sha256_many_serial, true}};
+#if defined(__x86_64__) || defined(__i386__)
+    backends.push_back({"avx2-x8", sha256_many_avx2, cpuHas(CPU_AVX2)});
+#endif
+    return backends;
+}
+
+// SHA-NI hashes one stream faster than eight AVX2 lanes, so AVX2 is only chosen without it.
+Sha256Many selectSha256Many() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (!sha256_shani_supported() && cpuHas(CPU_AVX2)) return sha256_many_avx2;
+#endif
+    return sha256_many_serial;
+}
+
+void sha256_many(const uint8_t* const* messages, const size_t* lengths, size_t count, uint8_t* digests) {
+    static const Sha256Many hash = selectSha256Many();
+    hash(messages, lengths, count, digests);
+}
+
+// --- Password key derivation (PBKDF2-HMAC-SHA256, format version 6) ---
+// Version 6 stores a KdfId, an iteration count and a random salt in the header and
+// stretches the password with PBKDF2 (RFC 8018) so that guessing costs 'iterations'
+// HMACs per try.
+const char* kdfName(KdfId kdf) {
+    return kdf == KDF_PBKDF2_HMAC_SHA256 ? "PBKDF2-HMAC-SHA256" : "SHA256 (unsalted)";
+}
+
+static void sha256_state_bytes(const uint32_t state[8], uint8_t out[32]) {
+    for (int i = 0; i < 8; ++i) {
+        out[i * 4] = (state[i] >> 24) & 0xFF;
+        out[i * 4 + 1] = (state[i] >> 16) & 0xFF;
+        out[i * 4 + 2] = (state[i] >> 8) & 0xFF;
+        out[i * 4 + 3] = state[i] & 0xFF;
+    }
+}
+
+// Padded final block for a 32-byte message that follows one already absorbed block
+// (the HMAC key block): the digest goes in bytes 0-31, the bit length is 768.
+static void sha256_digest_block(uint8_t block[64]) {
+    std::memset(block, 0, 64);
+    block[32] = 0x80;
+    block[62] = 0x03;
+}
+
+// Every further HMAC with the precomputed key states costs two compressions for short
+// messages.
+HmacSha256Key hmac_sha256_key(const uint8_t* key, size_t len) {
+    uint8_t block[64] = {};
+    if (len > sizeof(block)) {
+        std::vector<uint8_t> digest = sha256(std::vector<uint8_t>(key, key + len));
+        std::memcpy(block, digest.data(), digest.size());
+    } else if (len > 0) {
+        std::memcpy(block, key, len);
+    }
+    HmacSha256Key hmac;
+    uint8_t pad[64];
+    for (int i = 0; i < 8; ++i) {
+        hmac.inner[i] = SHA256_INIT[i];
+        hmac.outer[i] = SHA256_INIT[i];
+    }
+    for (size_t i = 0; i < sizeof(pad); ++i) pad[i] = block[i] ^ 0x36;
+    sha256_transform(hmac.inner, pad);
+    for (size_t i = 0; i < sizeof(pad); ++i) pad[i] = block[i] ^ 0x5c;
+    sha256_transform(hmac.outer, pad);
+    return hmac;
+}
+
+void hmac_sha256(const uint8_t* key, size_t key_len, const void* data, size_t len, uint8_t mac[32]) {
+    const HmacSha256Key hmac = hmac_sha256_key(key, key_len);
+    // Both hashes continue from the absorbed key block.
+    Sha256Context ctx;
+    sha256_init(ctx);
+    std::memcpy(ctx.state, hmac.inner, sizeof(ctx.state));
+    ctx.length = 64;
+    sha256_update(ctx, data, len);
+    uint8_t inner[32];
+    sha256_final(ctx, inner);
+    sha256_init(ctx);
+    std::memcpy(ctx.state, hmac.outer, sizeof(ctx.state));
+    ctx.length = 64;
+    sha256_update(ctx, inner, sizeof(inner));
+    sha256_final(ctx, mac);
+}
+
+std::vector<uint8_t> pbkdf2_hmac_sha256(const std::string& password, const uint8_t* salt, size_t salt_len,
+                                        uint32_t iterations) {
+    if (salt_len > 51 || iterations == 0) {
+        throw std::runtime_error("Invalid PBKDF2 parameters.");
+    }
+    const HmacSha256Key hmac =
+        hmac_sha256_key(reinterpret_cast<const uint8_t*>(password.data()), password.size());
+
+    // U1 = HMAC(password, salt || INT(1))
+    uint8_t block[64] = {};
+    std::memcpy(block, salt, salt_len);
+    block[salt_len + 3] = 1;
+    block[salt_len + 4] = 0x80;
+    uint64_t bits = (64 + salt_len + 4) * 8;
+    block[62] = static_cast<uint8_t>(bits >> 8);
+    block[63] = static_cast<uint8_t>(bits);
+    uint32_t state[8];
+    std::memcpy(state, hmac.inner, sizeof(state));
+    sha256_transform(state, block);
+
+    uint8_t inner_block[64];
+    uint8_t outer_block[64];
+    sha256_digest_block(inner_block);
+    sha256_digest_block(outer_block);
+    sha256_state_bytes(state, outer_block);
+    std::memcpy(state, hmac.outer, sizeof(state));
+    sha256_transform(state, outer_block);
+
+    uint32_t result[8];
+    std::memcpy(result, state, sizeof(result));
+    // U(i) = HMAC(password, U(i-1)); the result is the XOR of all of them.
+    for (uint32_t i = 1; i < iterations; ++i) {
+        sha256_state_bytes(state, inner_block);
+        std::memcpy(state, hmac.inner, sizeof(state));
+        sha256_transform(state, inner_block);
+        sha256_state_bytes(state, outer_block);
+        std::memcpy(state, hmac.outer, sizeof(state));
+        sha256_transform(state, outer_block);
+        for (int j = 0; j < 8; ++j) result[j] ^= state[j];
+    }
+
+    std::vector<uint8_t> key(32);
+    sha256_state_bytes(result, key.data());
+    return key;
+}
+
+std::vector<uint8_t> deriveMasterKey(const std::string& password, const KdfParams& params) {
+    if (params.kdf == KDF_PBKDF2_HMAC_SHA256) {
+        return pbkdf2_hmac_sha256(password, params.salt, sizeof(params.salt), params.iterations);
+    }
+    return legacy_sha256(std::vector<uint8_t>(password.begin(), password.end()));
+}
+
+// HMAC-SHA256 of 'label' followed by the archive nonce under the master key.
+static void archiveKeyMac(const std::vector<uint8_t>& master_key, const std::string& label,
+                          const uint8_t nonce[AEAD_NONCE_SIZE], uint8_t mac[32]) {
+    std::string message = label;
+    message.append(reinterpret_cast<const char*>(nonce), AEAD_NONCE_SIZE);
+    hmac_sha256(master_key.data(), master_key.size(), message.data(), message.size(), mac);
+}
+
+void keyCheckValue(const std::vector<uint8_t>& master_key, const uint8_t nonce[AEAD_NONCE_SIZE],
+                   uint8_t check[KEY_CHECK_SIZE]) {
+    uint8_t mac[32];
+    archiveKeyMac(master_key, "tzar2 key check", nonce, mac);
+    std::memcpy(check, mac, KEY_CHECK_SIZE);
+}
+
+bool keyCheckMatches(const EncryptedArchiveHeader& header, const std::vector<uint8_t>& master_key) {
+    if (!header.hasKeyCheck()) {
+        return true;
+    }
+    uint8_t expected[KEY_CHECK_SIZE];
+    keyCheckValue(master_key, header.nonce, expected);
+    uint8_t diff = 0;
+    for (size_t i = 0; i < KEY_CHECK_SIZE; ++i) diff |= expected[i] ^ header.key_check[i];
+    return diff == 0;
+}
+
+// The key-encryption key and associated data of a wrapped data key.
+static ChaChaKey keyWrapKey(const std::vector<uint8_t>& master_key, const EncryptedArchiveHeader& header,
+                            std::string& aad) {
+    uint8_t mac[32];
+    archiveKeyMac(master_key, "tzar2 key wrap", header.nonce, mac);
+    ChaChaKey kek;
+    std::memcpy(kek.words, mac, sizeof(kek.words));
+    aad.assign(1, static_cast<char>(header.cipher));
+    aad.append(reinterpret_cast<const char*>(header.nonce), AEAD_NONCE_SIZE);
+    return kek;
+}
+
+void wrapDataKey(const std::vector<uint8_t>& master_key, const EncryptedArchiveHeader& header,
+                 const std::vector<uint8_t>& data_key, uint8_t wrapped[WRAPPED_KEY_SIZE]) {
+    std::string aad;
+    const ChaChaKey kek = keyWrapKey(master_key, header, aad);
+    // Each key-encryption key only ever wraps this one data key, so a fixed nonce is safe.
+    xchacha_seal_chunk(kek, 0, 0, aad, reinterpret_cast<const char*>(data_key.data()),
+                       reinterpret_cast<char*>(wrapped), DATA_KEY_SIZE);
+}
+
+bool unwrapDataKey(const std::vector<uint8_t>& master_key, const EncryptedArchiveHeader& header,
+                   std::vector<uint8_t>& data_key) {
+    std::string aad;
+    const ChaChaKey kek = keyWrapKey(master_key, header, aad);
+    std::vector<uint8_t> key(DATA_KEY_SIZE);
+    if (!xchacha_open_chunk(kek, 0, 0, aad, reinterpret_cast<const char*>(header.wrapped_key),
+                            reinterpret_cast<char*>(key.data()), DATA_KEY_SIZE)) {
+        return false;
+    }
+    data_key = key;
+    return true;
+}
+
+// --- XOR Encryption/Decryption Function ---
+// The key repeats over the payload. For the usual 32-byte key (the SHA-256 of the
+// password) it is laid out once as a 64-byte pattern starting at the right key
+// position, and the pattern is XORed in with the widest vector unit the CPU has,
+// chosen at runtime. Works in place on a slice of a payload that starts 'offset'
+// bytes into the entry, so payloads can be processed in chunks.
+
+void xor_kernel_scalar(char* data, size_t len, const uint8_t* pattern) {
+    uint64_t words[4];
+    std::memcpy(words, pattern, sizeof(words));
+    size_t i = 0;
+    for (; i + XOR_KEY_PERIOD <= len; i += XOR_KEY_PERIOD) {
+        for (int k = 0; k < 4; ++k) {
+            uint64_t word;
+            std::memcpy(&word, data + i + k * 8, sizeof(word));
+            word ^= words[k];
+            std::memcpy(data + i + k * 8, &word, sizeof(word));
+        }
+    }
+    for (; i < len; ++i) {
+        data[i] ^= pattern[i % XOR_KEY_PERIOD];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void xor_kernel_sse2(char* data, size_t len, const uint8_t* pattern) {
+    const __m128i k0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern));
+    const __m128i k1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pattern + 16));
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i* p = reinterpret_cast<__m128i*>(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), k0));
+        _mm_storeu_si128(p + 1, _mm_xor_si128(_mm_loadu_si128(p + 1), k1));
+        _mm_storeu_si128(p + 2, _mm_xor_si128(_mm_loadu_si128(p + 2), k0));
+        _mm_storeu_si128(p + 3, _mm_xor_si128(_mm_loadu_si128(p + 3), k1));
+    }
+    for (; i < len; ++i) {
+        data[i] ^= pattern[i % XOR_KEY_PERIOD];
+    }
+}
+
+__attribute__((target("avx2")))
+void xor_kernel_avx2(char* data, size_t len, const uint8_t* pattern) {
+    const __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern));
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i* p = reinterpret_cast<__m256i*>(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), k));
+        _mm256_storeu_si256(p + 1, _mm256_xor_si256(_mm256_loadu_si256(p + 1), k));
+        _mm256_storeu_si256(p + 2, _mm256_xor_si256(_mm256_loadu_si256(p + 2), k));
+        _mm256_storeu_si256(p + 3, _mm256_xor_si256(_mm256_loadu_si256(p + 3), k));
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i* p = reinterpret_cast<__m256i*>(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), k));
+    }
+    for (; i < len; ++i) {
+        data[i] ^= pattern[i % XOR_KEY_PERIOD];
+    }
+}
+
+__attribute__((target("avx512f")))
+void xor_kernel_avx512(char* data, size_t len, const uint8_t* pattern) {
+    const __m512i k = _mm512_loadu_si512(pattern); // Two key periods
+    size_t i = 0;
+    for (; i + 256 <= len; i += 256) {
+        char* p = data + i;
+        _mm512_storeu_si512(p, _mm512_xor_si512(_mm512_loadu_si512(p), k));
+        _mm512_storeu_si512(p + 64, _mm512_xor_si512(_mm512_loadu_si512(p + 64), k));
+        _mm512_storeu_si512(p + 128, _mm512_xor_si512(_mm512_loadu_si512(p + 128), k));
+        _mm512_storeu_si512(p + 192, _mm512_xor_si512(_mm512_loadu_si512(p + 192), k));
+    }
+    for (; i + 64 <= len; i += 64) {
+        _mm512_storeu_si512(data + i, _mm512_xor_si512(_mm512_loadu_si512(data + i), k));
+    }
+    for (; i < len; ++i) {
+        data[i] ^= pattern[i % XOR_KEY_PERIOD];
+    }
+}
+#endif
+
+std::vector<XorKernelInfo> xorKernels() {
+    std::vector<XorKernelInfo> kernels = {{"scalar", xor_kernel_scalar, true}};
+#if defined(__x86_64__) || defined(__i386__)
+    kernels.push_back({"sse2", xor_kernel_sse2, cpuHas(CPU_SSE2)});
+    kernels.push_back({"avx2", xor_kernel_avx2, cpuHas(CPU_AVX2)});
+    kernels.push_back({"avx512", xor_kernel_avx512, cpuHas(CPU_AVX512F)});
+#endif
+    return kernels;
+}
+
+XorKernel selectXorKernel() {
+    XorKernel best = xor_kernel_scalar;
+    for (const XorKernelInfo& info : xorKernels()) {
+        if (info.supported) best = info.kernel;
+    }
+    return best;
+}
+
+void xor_pattern(uint8_t* pattern, const std::vector<uint8_t>& key, uint64_t offset) {
+    for (size_t i = 0; i < 2 * XOR_KEY_PERIOD; ++i) {
+        pattern[i] = key[(offset + i) % XOR_KEY_PERIOD];
+    }
+}
+
+void xor_cipher_inplace(char* data, size_t len, const std::vector<uint8_t>& key, uint64_t offset) {
+    if (key.empty()) return;
+    if (key.size() != XOR_KEY_PERIOD) {
+        for (size_t i = 0; i < len; ++i) {
+            data[i] ^= key[(offset + i) % key.size()];
+        }
+        return;
+    }
+    static const XorKernel kernel = selectXorKernel();
+    uint8_t pattern[2 * XOR_KEY_PERIOD];
+    xor_pattern(pattern, key, offset);
+    kernel(data, len, pattern);
+}
+
+// --- XChaCha20-Poly1305 (format version 4, or 5 with cipher CIPHER_XCHACHA20_POLY1305) ---
+// Self-contained implementation of the RFC 8439 AEAD with an extended nonce
+// (draft-irtf-cfrg-xchacha). Each payload is sealed in AEAD_CHUNK_SIZE chunks, every
+// chunk with its own tag, so chunks can be encrypted and verified independently and in
+// parallel. The 24-byte nonce of a chunk is the archive's random 16-byte nonce, the
+// entry index and the chunk index; the first part only has to go through HChaCha20
+// once per archive. The entry header is the associated data of every chunk, so
+// renaming or otherwise altering an entry breaks its tags.
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static const uint32_t CHACHA_CONSTANTS[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+static void chacha20_rounds(uint32_t x[16]) {
+    for (int i = 0; i < 10; ++i) {
+        CHACHA_QR(x[0], x[4], x[8], x[12]);
+        CHACHA_QR(x[1], x[5], x[9], x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8], x[13]);
+        CHACHA_QR(x[3], x[4], x[9], x[14]);
+    }
+}
+
+void chacha20_block(const ChaChaKey& key, uint32_t counter, const uint32_t nonce[3], uint32_t out[16]) {
+    uint32_t state[16];
+    std::memcpy(state, CHACHA_CONSTANTS, sizeof(CHACHA_CONSTANTS));
+    std::memcpy(state + 4, key.words, sizeof(key.words));
+    state[12] = counter;
+    state[13] = nonce[0];
+    state[14] = nonce[1];
+    state[15] = nonce[2];
+    std::memcpy(out, state, sizeof(state));
+    chacha20_rounds(out);
+    for (int i = 0; i < 16; ++i) {
+        out[i] += state[i];
+    }
+}
+
+ChaChaKey hchacha20(const std::vector<uint8_t>& key, const uint8_t nonce[AEAD_NONCE_SIZE]) {
+    uint32_t x[16];
+    std::memcpy(x, CHACHA_CONSTANTS, sizeof(CHACHA_CONSTANTS));
+    std::memcpy(x + 4, key.data(), 32);
+    std::memcpy(x + 12, nonce, AEAD_NONCE_SIZE);
+    chacha20_rounds(x);
+    ChaChaKey subkey;
+    std::memcpy(subkey.words, x, 16);
+    std::memcpy(subkey.words + 4, x + 12, 16);
+    return subkey;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHACHA_QR_AVX2(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); \
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 12), _mm256_srli_epi32(b, 20)); \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); \
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 7), _mm256_srli_epi32(b, 25));
+
+// Transposes eight vectors holding one state word of eight blocks each into eight
+// 32-byte rows (words 0-7 or 8-15 of each block) and XORs them into 'out'.
+__attribute__((target("avx2")))
+static void chacha20_store_avx2(const __m256i v[8], const char* in, char* out) {
+    __m256i t[8], u[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(v[i], v[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(v[i], v[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int block = 0; block < 4; ++block) {
+        __m256i lo = _mm256_permute2x128_si256(u[block], u[block + 4], 0x20);
+        __m256i hi = _mm256_permute2x128_si256(u[block], u[block + 4], 0x31);
+        const __m256i* src_lo = reinterpret_cast<const __m256i*>(in + block * 64);
+        const __m256i* src_hi = reinterpret_cast<const __m256i*>(in + (block + 4) * 64);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + block * 64),
+                            _mm256_xor_si256(_mm256_loadu_si256(src_lo), lo));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + (block + 4) * 64),
+                            _mm256_xor_si256(_mm256_loadu_si256(src_hi), hi));
+    }
+}
+
+// Eight blocks (512 bytes) per iteration. Returns the number of bytes processed.
+__attribute__((target("avx2")))
+static size_t chacha20_xor_avx2(const ChaChaKey& key, uint32_t counter, const uint32_t nonce[3],
+                                const char* in, char* out, size_t len) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    __m256i s[16];
+    for (int i = 0; i < 4; ++i) s[i] = _mm256_set1_epi32(CHACHA_CONSTANTS[i]);
+    for (int i = 0; i < 8; ++i) s[4 + i] = _mm256_set1_epi32(key.words[i]);
+    for (int i = 0; i < 3; ++i) s[13 + i] = _mm256_set1_epi32(nonce[i]);
+
+    size_t done = 0;
+    for (; done + 512 <= len; done += 512, counter += 8) {
+        s[12] = _mm256_add_epi32(_mm256_set1_epi32(counter), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i x[16];
+        for (int i = 0; i < 16; ++i) x[i] = s[i];
+        for (int i = 0; i < 10; ++i) {
+            CHACHA_QR_AVX2(x[0], x[4], x[8], x[12]);
+            CHACHA_QR_AVX2(x[1], x[5], x[9], x[13]);
+            CHACHA_QR_AVX2(x[2], x[6], x[10], x[14]);
+            CHACHA_QR_AVX2(x[3], x[7], x[11], x[15]);
+            CHACHA_QR_AVX2(x[0], x[5], x[10], x[15]);
+            CHACHA_QR_AVX2(x[1], x[6], x[11], x[12]);
+            CHACHA_QR_AVX2(x[2], x[7], x[8], x[13]);
+            CHACHA_QR_AVX2(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; ++i) x[i] = _mm256_add_epi32(x[i], s[i]);
+        chacha20_store_avx2(x, in + done, out + done);           // Words 0-7 of each block
+        chacha20_store_avx2(x + 8, in + done + 32, out + done + 32); // Words 8-15
+    }
+    return done;
+}
+#endif
+
+void chacha20_xor(const ChaChaKey& key, uint32_t counter, const uint32_t nonce[3],
+                  const char* in, char* out, size_t len) {
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool use_avx2 = cpuHas(CPU_AVX2);
+    if (use_avx2) {
+        done = chacha20_xor_avx2(key, counter, nonce, in, out, len);
+        counter += done / 64;
+    }
+#endif
+    uint32_t block[16];
+    for (; done < len; done += 64, ++counter) {
+        chacha20_block(key, counter, nonce, block);
+        const uint8_t* keystream = reinterpret_cast<const uint8_t*>(block);
+        size_t n = std::min<size_t>(64, len - done);
+        for (size_t i = 0; i < n; ++i) {
+            out[done + i] = in[done + i] ^ keystream[i];
+        }
+    }
+}
+
+// Poly1305 with 44/44/42-bit limbs and 128-bit products.
+struct Poly1305 {
+    uint64_t r[3], h[3], pad[2];
+    uint8_t buffer[16];
+    size_t buffered = 0;
+};
+
+static const uint64_t POLY_MASK44 = 0xfffffffffff;
+static const uint64_t POLY_MASK42 = 0x3ffffffffff;
+
+static void poly1305_init(Poly1305& st, const uint8_t key[32]) {
+    uint64_t t0, t1;
+    std::memcpy(&t0, key, 8);
+    std::memcpy(&t1, key + 8, 8);
+    st.r[0] = t0 & 0xffc0fffffff;
+    st.r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+    st.r[2] = (t1 >> 24) & 0x00ffffffc0f;
+    st.h[0] = st.h[1] = st.h[2] = 0;
+    std::memcpy(&st.pad[0], key + 16, 8);
+    std::memcpy(&st.pad[1], key + 24, 8);
+    st.buffered = 0;
+}
+
+static void poly1305_blocks(Poly1305& st, const uint8_t* m, size_t len, uint64_t hibit) {
+    typedef unsigned __int128 u128;
+    const uint64_t r0 = st.r[0], r1 = st.r[1], r2 = st.r[2];
+    const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = st.h[0], h1 = st.h[1], h2 = st.h[2];
+    for (; len >= 16; m += 16, len -= 16) {
+        uint64_t t0, t1;
+        std::memcpy(&t0, m, 8);
+        std::memcpy(&t1, m + 8, 8);
+        h0 += t0 & POLY_MASK44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & POLY_MASK44;
+        h2 += ((t1 >> 24) & POLY_MASK42) | hibit;
+        u128 d0 = (u128)h0 * r0 + (u128)h1 * s2 + (u128)h2 * s1;
+        u128 d1 = (u128)h0 * r1 + (u128)h1 * r0 + (u128)h2 * s2;
+        u128 d2 = (u128)h0 * r2 + (u128)h1 * r1 + (u128)h2 * r0;
+        uint64_t c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & POLY_MASK44;
+        d1 += c;
+        c = (uint64_t)(d1 >> 44);
+        h1 = (uint64_t)d1 & POLY_MASK44;
+        d2 += c;
+        c = (uint64_t)(d2 >> 42);
+        h2 = (uint64_t)d2 & POLY_MASK42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= POLY_MASK44;
+        h1 += c;
+    }
+    st.h[0] = h0;
+    st.h[1] = h1;
+    st.h[2] = h2;
+}
+
+static void poly1305_update(Poly1305& st, const uint8_t* m, size_t len) {
+    if (st.buffered > 0) {
+        size_t n = std::min(len, 16 - st.buffered);
+        std::memcpy(st.buffer + st.buffered, m, n);
+        st.buffered += n;
+        m += n;
+        len -= n;
+        if (st.buffered < 16) return;
+        poly1305_blocks(st, st.buffer, 16, 1ULL << 40);
+        st.buffered = 0;
+    }
+    size_t whole = len & ~size_t(15);
+    poly1305_blocks(st, m, whole, 1ULL << 40);
+    std::memcpy(st.buffer, m + whole, len - whole);
+    st.buffered = len - whole;
+}
+
+// Pads the input so far to a 16-byte boundary with zeros, as the AEAD construction requires.
+static void poly1305_pad16(Poly1305& st) {
+    if (st.buffered > 0) {
+        std::memset(st.buffer + st.buffered, 0, 16 - st.buffered);
+        poly1305_blocks(st, st.buffer, 16, 1ULL << 40);
+        st.buffered = 0;
+    }
+}
+
+static void poly1305_finish(Poly1305& st, uint8_t tag[16]) {
+    if (st.buffered > 0) {
+        st.buffer[st.buffered] = 1;
+        std::memset(st.buffer + st.buffered + 1, 0, 15 - st.buffered);
+        poly1305_blocks(st, st.buffer, 16, 0);
+    }
+    uint64_t h0 = st.h[0], h1 = st.h[1], h2 = st.h[2], c;
+    c = h1 >> 44; h1 &= POLY_MASK44;
+    h2 += c; c = h2 >> 42; h2 &= POLY_MASK42;
+    h0 += c * 5; c = h0 >> 44; h0 &= POLY_MASK44;
+    h1 += c; c = h1 >> 44; h1 &= POLY_MASK44;
+    h2 += c; c = h2 >> 42; h2 &= POLY_MASK42;
+    h0 += c * 5; c = h0 >> 44; h0 &= POLY_MASK44;
+    h1 += c;
+
+    // Subtract p = 2^130 - 5 if h >= p, without branching.
+    uint64_t g0 = h0 + 5; c = g0 >> 44; g0 &= POLY_MASK44;
+    uint64_t g1 = h1 + c; c = g1 >> 44; g1 &= POLY_MASK44;
+    uint64_t g2 = h2 + c - (1ULL << 42);
+    c = (g2 >> 63) - 1;
+    g0 &= c; g1 &= c; g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    uint64_t t0 = st.pad[0], t1 = st.pad[1];
+    h0 += t0 & POLY_MASK44; c = h0 >> 44; h0 &= POLY_MASK44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & POLY_MASK44) + c; c = h1 >> 44; h1 &= POLY_MASK44;
+    h2 += ((t1 >> 24) & POLY_MASK42) + c; h2 &= POLY_MASK42;
+    h0 = h0 | (h1 << 44);
+    h1 = (h1 >> 20) | (h2 << 24);
+    std::memcpy(tag, &h0, 8);
+    std::memcpy(tag + 8, &h1, 8);
+}
+
+void chacha20_poly1305_tag(const ChaChaKey& key, const uint32_t nonce[3], const std::string& aad,
+                           const char* ciphertext, size_t len, uint8_t tag[AEAD_TAG_SIZE]) {
+    uint32_t block[16];
+    chacha20_block(key, 0, nonce, block); // First 32 bytes of block 0 are the one-time Poly1305 key
+    Poly1305 mac;
+    poly1305_init(mac, reinterpret_cast<const uint8_t*>(block));
+    poly1305_update(mac, reinterpret_cast<const uint8_t*>(aad.data()), aad.size());
+    poly1305_pad16(mac);
+    poly1305_update(mac, reinterpret_cast<const uint8_t*>(ciphertext), len);
+    poly1305_pad16(mac);
+    uint64_t lengths[2] = {aad.size(), len};
+    poly1305_update(mac, reinterpret_cast<const uint8_t*>(lengths), sizeof(lengths));
+    poly1305_finish(mac, tag);
+}
+
+// Nonce of one chunk (the part after the HChaCha20 input).
+static void aead_nonce(uint32_t entry_index, uint32_t chunk_index, uint32_t nonce[3]) {
+    nonce[0] = 0;
+    nonce[1] = entry_index;
+    nonce[2] = chunk_index;
+}
+
+// Encrypts one chunk from 'in' to 'out' and appends its tag at out + len.
+void xchacha_seal_chunk(const ChaChaKey& key, uint32_t entry_index, uint32_t chunk_index,
+                     const std::string& aad, const char* in, char* out, size_t len) {
+    uint32_t nonce[3];
+    aead_nonce(entry_index, chunk_index, nonce);
+    chacha20_xor(key, 1, nonce, in, out, len);
+    chacha20_poly1305_tag(key, nonce, aad, out, len, reinterpret_cast<uint8_t*>(out + len));
+}
+
+// Verifies the tag stored at in + len, then decrypts the chunk into 'out'.
+// Returns false (leaving 'out' untouched) if the chunk is not authentic.
+bool xchacha_open_chunk(const ChaChaKey& key, uint32_t entry_index, uint32_t chunk_index,
+                     const std::string& aad, const char* in, char* out, size_t len) {
+    uint32_t nonce[3];
+    aead_nonce(entry_index, chunk_index, nonce);
+    uint8_t tag[AEAD_TAG_SIZE];
+    chacha20_poly1305_tag(key, nonce, aad, in, len, tag);
+    uint8_t diff = 0;
+    for (size_t i = 0; i < AEAD_TAG_SIZE; ++i) {
+        diff |= tag[i] ^ static_cast<uint8_t>(in[len + i]);
+    }
+    if (diff != 0) {
+        return false;
+    }
+    chacha20_xor(key, 1, nonce, in, out, len);
+    return true;
+}
+
+// --- AES-256-GCM (format version 5, cipher CIPHER_AES_256_GCM) ---
+// Same chunking, nonce layout and associated data as the ChaCha20 backend, on AES-NI
+// and PCLMULQDQ. Per-archive key: SHA-256 of the password key followed by the archive
+// nonce. The 96-bit IV of a chunk is 4 zero bytes, the entry index and the chunk index.
+// Only built for x86; archives using it need a CPU with AES-NI to be read.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AES_GCM_TARGET __attribute__((target("aes,pclmul,sse4.1,ssse3")))
+
+AES_GCM_TARGET static inline __m128i aes256_expand_even(__m128i previous, __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    previous = _mm_xor_si128(previous, _mm_slli_si128(previous, 4));
+    previous = _mm_xor_si128(previous, _mm_slli_si128(previous, 8));
+    return _mm_xor_si128(previous, assist);
+}
+
+AES_GCM_TARGET static inline __m128i aes256_expand_odd(__m128i even, __m128i previous) {
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(even, 0x00), 0xaa);
+    previous = _mm_xor_si128(previous, _mm_slli_si128(previous, 4));
+    previous = _mm_xor_si128(previous, _mm_slli_si128(previous, 8));
+    return _mm_xor_si128(previous, assist);
+}
+
+// Carry-less multiply of two byte-reversed field elements, unreduced (256 bits in lo/hi).
+AES_GCM_TARGET static inline void ghash_multiply(__m128i a, __m128i b, __m128i& lo, __m128i& hi) {
+    __m128i low = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i high = _mm_clmulepi64_si128(a, b, 0x11);
+    lo = _mm_xor_si128(lo, _mm_xor_si128(low, _mm_slli_si128(mid, 8)));
+    hi = _mm_xor_si128(hi, _mm_xor_si128(high, _mm_srli_si128(mid, 8)));
+}
+
+// Reduces a 256-bit product modulo the GCM polynomial (the bit-reflected method from
+// Intel's carry-less multiplication white paper).
+AES_GCM_TARGET static inline __m128i ghash_reduce(__m128i lo, __m128i hi) {
+    __m128i carry_lo = _mm_srli_epi32(lo, 31);
+    __m128i carry_hi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i carry_mid = _mm_srli_si128(carry_lo, 12);
+    carry_hi = _mm_slli_si128(carry_hi, 4);
+    carry_lo = _mm_slli_si128(carry_lo, 4);
+    lo = _mm_or_si128(lo, carry_lo);
+    hi = _mm_or_si128(_mm_or_si128(hi, carry_hi), carry_mid);
+
+    __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                              _mm_slli_epi32(lo, 25));
+    __m128i a_high = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    __m128i b = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                              _mm_srli_epi32(lo, 7));
+    b = _mm_xor_si128(b, a_high);
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, b));
+}
+
+AES_GCM_TARGET static inline __m128i ghash_mul(__m128i a, __m128i b) {
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    ghash_multiply(a, b, lo, hi);
+    return ghash_reduce(lo, hi);
+}
+
+AES_GCM_TARGET static inline __m128i byte_reverse(__m128i x) {
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+AES_GCM_TARGET static inline __m128i aes256_encrypt_block(const AesGcmKey& key, __m128i block) {
+    const __m128i* rk = reinterpret_cast<const __m128i*>(key.round_keys);
+    block = _mm_xor_si128(block, _mm_load_si128(rk));
+    for (int round = 1; round < 14; ++round) {
+        block = _mm_aesenc_si128(block, _mm_load_si128(rk + round));
+    }
+    return _mm_aesenclast_si128(block, _mm_load_si128(rk + 14));
+}
+
+#define AES256_EXPAND_ROUND(i, rcon) \
+    even = aes256_expand_even(even, _mm_aeskeygenassist_si128(odd, rcon)); \
+    _mm_store_si128(rk + i, even); \
+    if (i + 1 < 15) { odd = aes256_expand_odd(even, odd); _mm_store_si128(rk + i + 1, odd); }
+
+AES_GCM_TARGET void aes_gcm_expand_key(const uint8_t key_bytes[32], AesGcmKey& key) {
+    __m128i* rk = reinterpret_cast<__m128i*>(key.round_keys);
+    __m128i even = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key_bytes));
+    __m128i odd = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key_bytes + 16));
+    _mm_store_si128(rk, even);
+    _mm_store_si128(rk + 1, odd);
+    AES256_EXPAND_ROUND(2, 0x01);
+    AES256_EXPAND_ROUND(4, 0x02);
+    AES256_EXPAND_ROUND(6, 0x04);
+    AES256_EXPAND_ROUND(8, 0x08);
+    AES256_EXPAND_ROUND(10, 0x10);
+    AES256_EXPAND_ROUND(12, 0x20);
+    AES256_EXPAND_ROUND(14, 0x40);
+
+    __m128i* powers = reinterpret_cast<__m128i*>(key.h_powers);
+    __m128i h = byte_reverse(aes256_encrypt_block(key, _mm_setzero_si128()));
+    powers[0] = h;
+    for (int i = 1; i < 4; ++i) {
+        powers[i] = ghash_mul(powers[i - 1], h);
+    }
+}
+
+// Folds 'len' bytes into the GHASH state 'x', four blocks per reduction; a partial last
+// block is padded with zeros.
+AES_GCM_TARGET static __m128i ghash_update(const AesGcmKey& key, __m128i x, const uint8_t* data, size_t len) {
+    const __m128i* powers = reinterpret_cast<const __m128i*>(key.h_powers);
+    const __m128i* blocks = reinterpret_cast<const __m128i*>(data);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64, blocks += 4) {
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        ghash_multiply(_mm_xor_si128(x, byte_reverse(_mm_loadu_si128(blocks))), powers[3], lo, hi);
+        ghash_multiply(byte_reverse(_mm_loadu_si128(blocks + 1)), powers[2], lo, hi);
+        ghash_multiply(byte_reverse(_mm_loadu_si128(blocks + 2)), powers[1], lo, hi);
+        ghash_multiply(byte_reverse(_mm_loadu_si128(blocks + 3)), powers[0], lo, hi);
+        x = ghash_reduce(lo, hi);
+    }
+    for (; i + 16 <= len; i += 16, ++blocks) {
+        x = ghash_mul(_mm_xor_si128(x, byte_reverse(_mm_loadu_si128(blocks))), powers[0]);
+    }
+    if (i < len) {
+        alignas(16) uint8_t last[16] = {0};
+        std::memcpy(last, data + i, len - i);
+        x = ghash_mul(_mm_xor_si128(x, byte_reverse(_mm_load_si128(reinterpret_cast<const __m128i*>(last)))),
+                      powers[0]);
+    }
+    return x;
+}
+
+// CTR mode from counter value 2 (1 is reserved for the tag), eight blocks at a time so
+// the AES units stay busy.
+AES_GCM_TARGET static void aes_gcm_ctr(const AesGcmKey& key, __m128i iv_block, const uint8_t* in,
+                                       uint8_t* out, size_t len) {
+    const __m128i* rk = reinterpret_cast<const __m128i*>(key.round_keys);
+    uint32_t counter = 2;
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128, counter += 8) {
+        // Fully unrolled so the eight blocks stay in registers.
+        __m128i b[8];
+#pragma GCC unroll 8
+        for (int j = 0; j < 8; ++j) {
+            b[j] = _mm_xor_si128(_mm_insert_epi32(iv_block, static_cast<int>(__builtin_bswap32(counter + j)), 3),
+                                 _mm_load_si128(rk));
+        }
+        for (int round = 1; round < 14; ++round) {
+            __m128i round_key = _mm_load_si128(rk + round);
+#pragma GCC unroll 8
+            for (int j = 0; j < 8; ++j) b[j] = _mm_aesenc_si128(b[j], round_key);
+        }
+        __m128i last_key = _mm_load_si128(rk + 14);
+#pragma GCC unroll 8
+        for (int j = 0; j < 8; ++j) {
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 16 * j));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 16 * j),
+                             _mm_xor_si128(data, _mm_aesenclast_si128(b[j], last_key)));
+        }
+    }
+    for (; i < len; i += 16, ++counter) {
+        __m128i keystream = aes256_encrypt_block(
+            key, _mm_insert_epi32(iv_block, static_cast<int>(__builtin_bswap32(counter)), 3));
+        if (len - i >= 16) {
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_xor_si128(data, keystream));
+        } else {
+            alignas(16) uint8_t bytes[16];
+            _mm_store_si128(reinterpret_cast<__m128i*>(bytes), keystream);
+            for (size_t j = 0; i + j < len; ++j) out[i + j] = in[i + j] ^ bytes[j];
+        }
+    }
+}
+
+AES_GCM_TARGET static void aes_gcm_tag(const AesGcmKey& key, __m128i iv_block, const std::string& aad,
+                                       const uint8_t* ciphertext, size_t len, uint8_t tag[AEAD_TAG_SIZE]) {
+    __m128i x = ghash_update(key, _mm_setzero_si128(), reinterpret_cast<const uint8_t*>(aad.data()), aad.size());
+    x = ghash_update(key, x, ciphertext, len);
+    __m128i lengths = _mm_set_epi64x(static_cast<long long>(aad.size()) * 8, static_cast<long long>(len) * 8);
+    x = ghash_mul(_mm_xor_si128(x, lengths), reinterpret_cast<const __m128i*>(key.h_powers)[0]);
+    __m128i j0 = _mm_insert_epi32(iv_block, static_cast<int>(__builtin_bswap32(1)), 3);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(tag),
+                     _mm_xor_si128(byte_reverse(x), aes256_encrypt_block(key, j0)));
+}
+
+AES_GCM_TARGET static __m128i aes_gcm_iv(uint32_t entry_index, uint32_t chunk_index) {
+    return _mm_set_epi32(0, static_cast<int>(chunk_index), static_cast<int>(entry_index), 0);
+}
+
+AES_GCM_TARGET void aes_gcm_seal_chunk(const AesGcmKey& key, uint32_t entry_index, uint32_t chunk_index,
+                                       const std::string& aad, const char* in, char* out, size_t len) {
+    __m128i iv = aes_gcm_iv(entry_index, chunk_index);
+    uint8_t* sealed = reinterpret_cast<uint8_t*>(out);
+    aes_gcm_ctr(key, iv, reinterpret_cast<const uint8_t*>(in), sealed, len);
+    aes_gcm_tag(key, iv, aad, sealed, len, sealed + len);
+}
+
+AES_GCM_TARGET bool aes_gcm_open_chunk(const AesGcmKey& key, uint32_t entry_index, uint32_t chunk_index,
+                                       const std::string& aad, const char* in, char* out, size_t len) {
+    __m128i iv = aes_gcm_iv(entry_index, chunk_index);
+    const uint8_t* sealed = reinterpret_cast<const uint8_t*>(in);
+    uint8_t tag[AEAD_TAG_SIZE];
+    aes_gcm_tag(key, iv, aad, sealed, len, tag);
+    uint8_t diff = 0;
+    for (size_t i = 0; i < AEAD_TAG_SIZE; ++i) {
+        diff |= tag[i] ^ sealed[len + i];
+    }
+    if (diff != 0) {
+        return false;
+    }
+    aes_gcm_ctr(key, iv, sealed, reinterpret_cast<uint8_t*>(out), len);
+    return true;
+}
+
+bool aes_gcm_supported() {
+    return cpuHas(CPU_AES | CPU_PCLMUL | CPU_SSE41 | CPU_SSSE3);
+}
+#else
+bool aes_gcm_supported() { return false; }
+#endif
+
+// --- Cipher selection ---
+const char* cipherName(CipherId cipher) {
+    return cipher == CIPHER_AES_256_GCM ? "aes-256-gcm" : "xchacha20-poly1305";
+}
+
+ArchiveKey deriveArchiveKey(CipherId cipher, const std::vector<uint8_t>& key, const uint8_t nonce[AEAD_NONCE_SIZE],
+                            uint8_t format_version) {
+    ArchiveKey archive_key;
+    archive_key.cipher = cipher;
+    if (cipher == CIPHER_AES_256_GCM) {
+#if defined(__x86_64__) || defined(__i386__)
+        std::vector<uint8_t> material(key);
+        material.insert(material.end(), nonce, nonce + AEAD_NONCE_SIZE);
+        std::vector<uint8_t> aes_key = format_version >= 6 ? sha256(material) : legacy_sha256(material);
+        aes_gcm_expand_key(aes_key.data(), archive_key.aes);
+#endif
+    } else {
+        archive_key.chacha = hchacha20(key, nonce);
+    }
+    return archive_key;
+}
+
+void aead_seal_chunk(const ArchiveKey& key, uint32_t entry_index, uint32_t chunk_index,
+                     const std::string& aad, const char* in, char* out, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (key.cipher == CIPHER_AES_256_GCM) {
+        aes_gcm_seal_chunk(key.aes, entry_index, chunk_index, aad, in, out, len);
+        return;
+    }
+#endif
+    xchacha_seal_chunk(key.chacha, entry_index, chunk_index, aad, in, out, len);
+}
+
+bool aead_open_chunk(const ArchiveKey& key, uint32_t entry_index, uint32_t chunk_index,
+                     const std::string& aad, const char* in, char* out, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (key.cipher == CIPHER_AES_256_GCM) {
+        return aes_gcm_open_chunk(key.aes, entry_index, chunk_index, aad, in, out, len);
+    }
+#endif
+    return xchacha_open_chunk(key.chacha, entry_index, chunk_index, aad, in, out, len);
+}
@@ -0,0 +1,226 @@
+// === libtzar/tzar_crypto.h ===
+// Hashing, password key derivation and the archive ciphers: SHA256 (SHA-NI, AVX2 and
+// scalar), PBKDF2-HMAC-SHA256, the legacy XOR cipher and chunked XChaCha20-Poly1305 and
+// AES-256-GCM. Every backend is chosen at runtime from what the CPU supports (see
+// tzar_cpu.h); the individual kernels are exported as well so tzar_encrypt --bench can
+// check and time them.
+#ifndef TZAR_CRYPTO_H
+#define TZAR_CRYPTO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tzar_format.h"
+
+// --- SHA256 (FIPS 180-4) ---
+// Incremental API (sha256_init / sha256_update / sha256_final). Blocks are compressed
+// with the SHA extensions where the CPU has them.
+extern const uint32_t SHA256_INIT[8];
+
+typedef void (*Sha256Blocks)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+void sha256_blocks_scalar(uint32_t state[8], const uint8_t* data, size_t blocks);
+#if defined(__x86_64__) || defined(__i386__)
+void sha256_blocks_shani(uint32_t state[8], const uint8_t* data, size_t blocks);
+#endif
+bool sha256_shani_supported();
+Sha256Blocks selectSha256Blocks();
+
+// Compresses one block with the fastest block function (or the legacy one); for callers
+// that keep their own state, like the precomputed HMAC states in PBKDF2.
+void sha256_transform(uint32_t state[8], const uint8_t block[64], bool legacy = false);
+
+struct Sha256Context {
+    uint32_t state[8];
+    uint8_t buffer[64]; // Partial block
+    size_t buffered;
+    uint64_t length;    // Total bytes hashed
+    bool legacy;
+};
+
+void sha256_init(Sha256Context& ctx, bool legacy = false);
+void sha256_update(Sha256Context& ctx, const void* data, size_t len);
+void sha256_final(Sha256Context& ctx, uint8_t digest[32]);
+
+// Computes SHA256 hash of a byte vector. Returns 32-byte hash.
+std::vector<uint8_t> sha256(const std::vector<uint8_t>& data, bool legacy = false);
+
+// The hash format versions 0-5 used for keys: a SHA256 with one wrong round constant.
+std::vector<uint8_t> legacy_sha256(const std::vector<uint8_t>& data);
+
+// --- Multi-message SHA256 ---
+// sha256_many() hashes 'count' independent messages (messages[i], lengths[i] bytes)
+// into digests + 32 * i, e.g. the contents of many small entries. On CPUs without
+// SHA-NI it hashes eight at a time with AVX2.
+typedef void (*Sha256Many)(const uint8_t* const* messages, const size_t* lengths, size_t count, uint8_t* digests);
+
+void sha256_many_serial(const uint8_t* const* messages, const size_t* lengths, size_t count, uint8_t* digests);
+#if defined(__x86_64__) || defined(__i386__)
+void sha256_many_avx2(const uint8_t* const* messages, const size_t* lengths, size_t count, uint8_t* digests);
+#endif
+
+struct Sha256ManyInfo {
+    const char* name;
+    Sha256Many hash;
+    bool supported;
+};
+
+// Every multi-message backend built into this library, and whether this CPU can run it.
+std::vector<Sha256ManyInfo> sha256ManyBackends();
+Sha256Many selectSha256Many();
+void sha256_many(const uint8_t* const* messages, const size_t* lengths, size_t count, uint8_t* digests);
+
+// --- Password key derivation (PBKDF2-HMAC-SHA256, format version 6) ---
+// OWASP's 2023 recommendation for PBKDF2-HMAC-SHA256; about half a second per derivation.
+const uint32_t KDF_DEFAULT_ITERATIONS = 600000;
+const uint32_t KDF_MIN_ITERATIONS = 1000;
+
+const char* kdfName(KdfId kdf);
+
+// HMAC-SHA256 with the key blocks absorbed once: 'inner' and 'outer' are the SHA256
+// states after (key ^ ipad) and (key ^ opad).
+struct HmacSha256Key {
+    uint32_t inner[8];
+    uint32_t outer[8];
+};
+
+HmacSha256Key hmac_sha256_key(const uint8_t* key, size_t len);
+
+// HMAC-SHA256 (RFC 2104) of 'len' bytes of 'data'.
+void hmac_sha256(const uint8_t* key, size_t key_len, const void* data, size_t len, uint8_t mac[32]);
+
+// PBKDF2-HMAC-SHA256 producing a single 32-byte block. The salt must leave room for
+// the block index and padding in one SHA256 block (at most 51 bytes).
+std::vector<uint8_t> pbkdf2_hmac_sha256(const std::string& password, const uint8_t* salt, size_t salt_len,
+                                        uint32_t iterations);
+
+// The archive master key: what deriveArchiveKey() (or the XOR cipher) starts from.
+std::vector<uint8_t> deriveMasterKey(const std::string& password, const KdfParams& params);
+
+// --- Password check (format version 7) ---
+// The key check value stored in the header: HMAC-SHA256 of a fixed label and the archive
+// nonce under the master key, truncated to KEY_CHECK_SIZE bytes. Checking it costs one
+// HMAC after the key derivation, so a wrong password is caught before any entry is read.
+void keyCheckValue(const std::vector<uint8_t>& master_key, const uint8_t nonce[AEAD_NONCE_SIZE],
+                   uint8_t check[KEY_CHECK_SIZE]);
+
+// Compares in constant time. Always true for headers without a key check value.
+bool keyCheckMatches(const EncryptedArchiveHeader& header, const std::vector<uint8_t>& master_key);
+
+// Exit status of tzar_decrypt when the password is wrong; nothing has been written then.
+const int DECRYPT_EXIT_WRONG_PASSWORD = 2;
+
+// --- Envelope encryption (format version 8) ---
+// The content is sealed under a random data key (passed to deriveArchiveKey() in place of
+// the master key). The header stores the data key sealed with ChaCha20-Poly1305 under a
+// key-encryption key: HMAC-SHA256 of a fixed label and the archive nonce under the master
+// key. The cipher ID and nonce are the associated data, so the wrapped key only opens in
+// its own archive. A new password only rewraps the data key, and a wrong one fails the tag.
+void wrapDataKey(const std::vector<uint8_t>& master_key, const EncryptedArchiveHeader& header,
+                 const std::vector<uint8_t>& data_key, uint8_t wrapped[WRAPPED_KEY_SIZE]);
+
+// Returns false (leaving 'data_key' untouched) if the wrapped key does not open with
+// 'master_key': the password is wrong or the header was modified.
+bool unwrapDataKey(const std::vector<uint8_t>& master_key, const EncryptedArchiveHeader& header,
+                   std::vector<uint8_t>& data_key);
+
+// --- XOR cipher (format versions 0-3) ---
+// The key repeats over the payload. A 32-byte key is laid out as a 64-byte pattern
+// starting at the right key position and XORed in with the widest vector unit the CPU has.
+const size_t XOR_KEY_PERIOD = 32;
+
+typedef void (*XorKernel)(char* data, size_t len, const uint8_t* pattern);
+
+void xor_kernel_scalar(char* data, size_t len, const uint8_t* pattern);
+#if defined(__x86_64__) || defined(__i386__)
+void xor_kernel_sse2(char* data, size_t len, const uint8_t* pattern);
+void xor_kernel_avx2(char* data, size_t len, const uint8_t* pattern);
+void xor_kernel_avx512(char* data, size_t len, const uint8_t* pattern);
+#endif
+
+struct XorKernelInfo {
+    const char* name;
+    XorKernel kernel;
+    bool supported;
+};
+
+// Every XOR kernel built into this library, slowest first, and whether this CPU can run it.
+std::vector<XorKernelInfo> xorKernels();
+XorKernel selectXorKernel();
+
+// Lays the key out as 64 bytes starting at key position 'offset'.
+void xor_pattern(uint8_t* pattern, const std::vector<uint8_t>& key, uint64_t offset);
+
+// Works in place on a slice of a payload that starts 'offset' bytes into the entry.
+void xor_cipher_inplace(char* data, size_t len, const std::vector<uint8_t>& key, uint64_t offset);
+
+// --- XChaCha20-Poly1305 (format version 4, or 5 with cipher CIPHER_XCHACHA20_POLY1305) ---
+const size_t AEAD_BATCH_CHUNKS = 64; // Chunks handed to the workers at a time (4 MiB)
+
+struct ChaChaKey {
+    uint32_t words[8];
+};
+
+void chacha20_block(const ChaChaKey& key, uint32_t counter, const uint32_t nonce[3], uint32_t out[16]);
+
+// Derives the per-archive subkey from the password key and the archive nonce.
+ChaChaKey hchacha20(const std::vector<uint8_t>& key, const uint8_t nonce[AEAD_NONCE_SIZE]);
+
+// Encrypts or decrypts 'len' bytes from 'in' to 'out' (which may be the same buffer),
+// starting at block 'counter'.
+void chacha20_xor(const ChaChaKey& key, uint32_t counter, const uint32_t nonce[3],
+                  const char* in, char* out, size_t len);
+
+// Computes the RFC 8439 AEAD tag over the associated data and the ciphertext.
+void chacha20_poly1305_tag(const ChaChaKey& key, const uint32_t nonce[3], const std::string& aad,
+                           const char* ciphertext, size_t len, uint8_t tag[AEAD_TAG_SIZE]);
+
+void xchacha_seal_chunk(const ChaChaKey& key, uint32_t entry_index, uint32_t chunk_index,
+                        const std::string& aad, const char* in, char* out, size_t len);
+bool xchacha_open_chunk(const ChaChaKey& key, uint32_t entry_index, uint32_t chunk_index,
+                        const std::string& aad, const char* in, char* out, size_t len);
+
+// --- AES-256-GCM (format version 5, cipher CIPHER_AES_256_GCM) ---
+// Only built for x86; archives using it need a CPU with AES-NI and PCLMULQDQ to be read.
+struct AesGcmKey {
+    alignas(16) uint8_t round_keys[15][16];
+    alignas(16) uint8_t h_powers[4][16]; // H, H^2, H^3, H^4, byte-reversed for GHASH
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+void aes_gcm_expand_key(const uint8_t key_bytes[32], AesGcmKey& key);
+void aes_gcm_seal_chunk(const AesGcmKey& key, uint32_t entry_index, uint32_t chunk_index,
+                        const std::string& aad, const char* in, char* out, size_t len);
+bool aes_gcm_open_chunk(const AesGcmKey& key, uint32_t entry_index, uint32_t chunk_index,
+                        const std::string& aad, const char* in, char* out, size_t len);
+#endif
+bool aes_gcm_supported();
+
+// --- Cipher selection ---
+const char* cipherName(CipherId cipher);
+
+// Key material of the archive's cipher, derived once from the password key and the
+// archive nonce.
+struct ArchiveKey {
+    CipherId cipher = CIPHER_XCHACHA20_POLY1305;
+    ChaChaKey chacha{};
+    AesGcmKey aes{};
+};
+
+// The AES backend must only be selected if aes_gcm_supported(). 'format_version' picks
+// the hash for the AES key (legacy_sha256 before version 6).
+ArchiveKey deriveArchiveKey(CipherId cipher, const std::vector<uint8_t>& key, const uint8_t nonce[AEAD_NONCE_SIZE],
+                            uint8_t format_version);
+
+// Encrypts one chunk from 'in' to 'out' and appends its tag at out + len.
+void aead_seal_chunk(const ArchiveKey& key, uint32_t entry_index, uint32_t chunk_index,
+                     const std::string& aad, const char* in, char* out, size_t len);
+
+// Verifies the tag stored at in + len, then decrypts the chunk into 'out'.
+// Returns false (leaving 'out' untouched) if the chunk is not authentic.
+bool aead_open_chunk(const ArchiveKey& key, uint32_t entry_index, uint32_t chunk_index,
+                     const std::string& aad, const char* in, char* out, size_t len);
+
+#endif // TZAR_CRYPTO_H
@@ -0,0 +1,599 @@
+// === libtzar/tzar_extract.cpp ===
+#include "tzar_extract.h"
+
+#include <algorithm>  // For std::min
+#include <atomic>     // For std::atomic
+#include <cerrno>     // For errno
+#include <chrono>     // For throughput measurement
+#include <cstring>    // For std::memcpy, std::strerror
+#include <deque>      // For per-entry verification state
+#include <fcntl.h>    // For AT_FDCWD, open()
+#include <iomanip>    // For std::setprecision
+#include <iostream>   // For std::cout, std::cerr
+#include <mutex>      // For std::mutex
+#include <stdexcept>  // For std::runtime_error
+#include <sys/stat.h> // For utimensat(), mkdir(), chmod(), lstat()
+#include <thread>     // For the verification workers
+#include <unistd.h>   // For symlink(), link(), unlink(), pwrite(), ftruncate(), syncfs()
+
+#include "tzar_parallel.h" // BoundedQueue
+
+namespace fs = std::filesystem;
+
+// --- Payload sources ---
+
+void PayloadSource::read(char* out, size_t len) {
+    if (len > remaining()) {
+        throw std::runtime_error("Entry content is shorter than its metadata says.");
+    }
+    while (len > 0) {
+        const char* data;
+        size_t n = next(data, len);
+        std::memcpy(out, data, n);
+        out += n;
+        len -= n;
+    }
+}
+
+std::string PayloadSource::readAll() {
+    std::string data(remaining(), '\0');
+    read(&data[0], data.size());
+    return data;
+}
+
+size_t MemoryPayload::next(const char*& data, size_t max) {
+    size_t n = std::min<uint64_t>(remaining_, max);
+    data = data_;
+    data_ += n;
+    remaining_ -= n;
+    return n;
+}
+
+// --- Low-level output ---
+
+void setModificationTime(const fs::path& path, int64_t mtime_ns, int flags) {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT; // Leave the access time alone
+    times[1].tv_sec = mtime_ns / 1000000000;
+    times[1].tv_nsec = mtime_ns % 1000000000;
+    if (times[1].tv_nsec < 0) { // Pre-1970 timestamps
+        times[1].tv_sec -= 1;
+        times[1].tv_nsec += 1000000000;
+    }
+    if (utimensat(AT_FDCWD, path.c_str(), times, flags) != 0) {
+        std::cerr << "Warning: Could not set modification time of " << path << ".\n";
+    }
+}
+
+bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool pwriteAll(int fd, const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+void syncDirectory(const fs::path& dir) {
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) != 0) {
+        std::cerr << "Warning: Could not sync directory " << (dir.empty() ? fs::path(".") : dir)
+                  << ": " << std::strerror(errno) << ".\n";
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// --- Zero blocks ---
+
+size_t countZeroBlocks(const char* data, size_t size, size_t limit) {
+    size_t count = 0;
+    for (size_t offset = 0; count < limit && offset + ZERO_BLOCK_SIZE <= size; offset += ZERO_BLOCK_SIZE) {
+        if (isZeroBlock(data + offset)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool writeSkippingZeroBlocks(int fd, const char* data, size_t size, uint64_t offset) {
+    size_t run_start = 0; // Start of the pending non-zero run
+    size_t block = 0;
+    for (; block + ZERO_BLOCK_SIZE <= size; block += ZERO_BLOCK_SIZE) {
+        if (!isZeroBlock(data + block)) {
+            continue;
+        }
+        if (block > run_start && !pwriteAll(fd, data + run_start, block - run_start, offset + run_start)) {
+            return false;
+        }
+        run_start = block + ZERO_BLOCK_SIZE;
+    }
+    // The pending run plus a partial last block (written even if zero; it is tiny).
+    return size <= run_start || pwriteAll(fd, data + run_start, size - run_start, offset + run_start);
+}
+
+// Writes a regular file's content to 'fd' piece by piece, leaving zero blocks as holes
+// if the state asks for that.
+static bool writeRegularFile(int fd, PayloadSource& payload, uint64_t size, const ExtractState& state) {
+    bool leave_holes = state.skip_zero_blocks && size >= 2 * ZERO_BLOCK_SIZE;
+    for (uint64_t offset = 0; payload.remaining() > 0;) {
+        const char* data;
+        size_t len = payload.next(data, SIZE_MAX);
+        if (!(leave_holes ? writeSkippingZeroBlocks(fd, data, len, offset) : pwriteAll(fd, data, len, offset))) {
+            return false;
+        }
+        offset += len;
+    }
+    return !leave_holes || ftruncate(fd, size) == 0;
+}
+
+// Recreates an ENTRY_SPARSE file in 'fd': the data segments are written at their offsets
+// and the holes are left unallocated.
+static bool writeSparseFile(int fd, PayloadSource& payload) {
+    uint64_t logical_size;
+    uint32_t segment_count;
+    char map_header[sizeof(logical_size) + sizeof(segment_count)];
+    if (payload.remaining() < sizeof(map_header)) {
+        throw std::runtime_error("Corrupted sparse file map in archive.");
+    }
+    payload.read(map_header, sizeof(map_header));
+    std::memcpy(&logical_size, map_header, sizeof(logical_size));
+    std::memcpy(&segment_count, map_header + sizeof(logical_size), sizeof(segment_count));
+    if (payload.remaining() / (2 * sizeof(uint64_t)) < segment_count) {
+        throw std::runtime_error("Corrupted sparse file map in archive.");
+    }
+    std::vector<uint64_t> map(static_cast<size_t>(segment_count) * 2);
+    payload.read(reinterpret_cast<char*>(map.data()), map.size() * sizeof(uint64_t));
+
+    for (uint32_t i = 0; i < segment_count; ++i) {
+        uint64_t offset = map[i * 2];
+        uint64_t length = map[i * 2 + 1];
+        if (length > payload.remaining()) {
+            throw std::runtime_error("Corrupted sparse file map in archive.");
+        }
+        for (uint64_t done = 0; done < length;) {
+            const char* data;
+            size_t len = payload.next(data, std::min<uint64_t>(length - done, SIZE_MAX));
+            if (!pwriteAll(fd, data, len, offset + done)) {
+                return false;
+            }
+            done += len;
+        }
+    }
+    return ftruncate(fd, logical_size) == 0;
+}
+
+// --- Entry extraction ---
+
+void noteItemCreated(const fs::path& outputPath, uint64_t bytes, ExtractState& state) {
+    if (state.durability == DURABILITY_FILE) {
+        syncDirectory(outputPath.parent_path());
+    }
+    state.unsynced_bytes += bytes;
+    state.unsynced_entries++;
+}
+
+bool checkpointDue(const ExtractState& state) {
+    return state.durability != DURABILITY_NONE &&
+           (state.unsynced_bytes >= CHECKPOINT_BYTES || state.unsynced_entries >= CHECKPOINT_ENTRIES);
+}
+
+void checkpoint(const fs::path& outputRoot, ExtractState& state) {
+    if (state.durability == DURABILITY_BATCH) {
+        syncOutput(outputRoot, state);
+    }
+    state.unsynced_bytes = 0;
+    state.unsynced_entries = 0;
+}
+
+void syncOutput(const fs::path& outputRoot, ExtractState& state) {
+    int fd = open(outputRoot.empty() ? "." : outputRoot.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || syncfs(fd) != 0) {
+        std::cerr << "Warning: Could not sync extracted files: " << std::strerror(errno) << ".\n";
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    state.unsynced_bytes = 0;
+    state.unsynced_entries = 0;
+    state.syncfs_calls++;
+}
+
+bool isSafeEntryName(const std::string& name) {
+    fs::path path(name);
+    if (name.empty() || path.is_absolute() || path.has_root_path()) {
+        return false;
+    }
+    for (const fs::path& part : path) {
+        if (part == "..") {
+            return false;
+        }
+    }
+    return true;
+}
+
+// True if symlink 'name' pointing to 'target' resolves inside the output root: the target
+// is relative and its ".." components all come first, climbing no higher than the link's
+// own directory. As every symlink is checked this way and parents are never symlinks,
+// following any chain of them stays inside too.
+static bool isSafeSymlinkTarget(const std::string& name, const std::string& target) {
+    fs::path path(target);
+    if (target.empty() || path.is_absolute() || path.has_root_path()) {
+        return false;
+    }
+    size_t depth = 0; // Directories between the root and the link
+    for (const fs::path& part : fs::path(name).parent_path()) {
+        if (part != ".") depth++;
+    }
+    bool leading = true;
+    for (const fs::path& part : path) {
+        if (part == "..") {
+            if (!leading || depth == 0) {
+                return false;
+            }
+            depth--;
+        } else if (part != "." && !part.empty()) {
+            leading = false;
+        }
+    }
+    return true;
+}
+
+bool ensureParentDirectory(const fs::path& outputRoot, const std::string& name, ExtractState& state) {
+    fs::path relative = fs::path(name).parent_path();
+    if (relative.empty() || state.known_dirs.count((outputRoot / relative).string())) {
+        return true;
+    }
+    fs::path dir = outputRoot;
+    for (const fs::path& part : relative) {
+        dir /= part;
+        if (state.known_dirs.count(dir.string())) {
+            continue;
+        }
+        struct stat st;
+        if (lstat(dir.c_str(), &st) != 0) {
+            if (errno != ENOENT || mkdir(dir.c_str(), 0777) != 0) {
+                std::cerr << "Warning: Cannot create directory " << dir << " for '" << name << "': "
+                          << std::strerror(errno) << ". Skipping.\n";
+                return false;
+            }
+        } else if (!S_ISDIR(st.st_mode)) {
+            std::cerr << "Warning: " << dir << " is not a directory (or is a symlink); not extracting '"
+                      << name << "' through it.\n";
+            return false;
+        }
+        state.known_dirs.insert(dir.string());
+    }
+    return true;
+}
+
+bool prepareEntryPath(const fs::path& outputRoot, const std::string& name, ExtractState& state) {
+    if (!isSafeEntryName(name)) {
+        std::cerr << "Warning: Entry name '" << name << "' leaves the output directory. Skipping.\n";
+        return false;
+    }
+    return ensureParentDirectory(outputRoot, name, state);
+}
+
+bool createLink(const fs::path& outputPath, const std::string& target, bool hard) {
+    auto make_link = [&] {
+        return hard ? link(target.c_str(), outputPath.c_str()) : symlink(target.c_str(), outputPath.c_str());
+    };
+    if (make_link() != 0 && !(errno == EEXIST && unlink(outputPath.c_str()) == 0 && make_link() == 0)) {
+        std::cerr << "Warning: Could not create " << (hard ? "hard link " : "symlink ") << outputPath
+                  << " -> " << target << ": " << std::strerror(errno) << ". Skipping.\n";
+        return false;
+    }
+    return true;
+}
+
+void applyMetadata(const fs::path& outputPath, const EntryHeader& entry) {
+    if (entry.type == ENTRY_SYMLINK) {
+        if (entry.mtime_ns != 0) {
+            setModificationTime(outputPath, entry.mtime_ns, AT_SYMLINK_NOFOLLOW);
+        }
+        return; // Symlink permissions are not meaningful on Linux
+    }
+    if (entry.mode != 0 && chmod(outputPath.c_str(), entry.mode) != 0) {
+        std::cerr << "Warning: Could not set permissions of " << outputPath << ".\n";
+    }
+    if (entry.mtime_ns != 0) {
+        setModificationTime(outputPath, entry.mtime_ns);
+    }
+}
+
+// Finishes a regular file written through 'fd': applies its metadata, syncs it in file
+// durability mode (after the metadata, so that is durable too) and closes it.
+static bool closeExtractedFile(int fd, const fs::path& outputPath, const EntryHeader& entry,
+                               bool ok, ExtractState& state) {
+    if (ok) {
+        applyMetadata(outputPath, entry);
+        ok = state.durability != DURABILITY_FILE || fsync(fd) == 0;
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok) {
+        std::cerr << "Warning: Error writing output file: " << outputPath << ".\n";
+        return false;
+    }
+    noteItemCreated(outputPath, entry.size, state);
+    return true;
+}
+
+bool extractEntry(const EntryHeader& entry, PayloadSource& payload, const fs::path& outputRoot,
+                  ExtractState& state) {
+    if (!prepareEntryPath(outputRoot, entry.name, state)) {
+        return false;
+    }
+    fs::path outputPath = outputRoot / entry.name;
+
+    switch (entry.type) {
+    case ENTRY_DIRECTORY: {
+        struct stat st;
+        if (mkdir(outputPath.c_str(), 0777) == 0) {
+            std::cout << "Extracted directory: " << entry.name << "\n";
+        } else if (errno == EEXIST && lstat(outputPath.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            std::cout << "Directory already exists: " << entry.name << "\n";
+        } else {
+            std::cerr << "Warning: Cannot create directory '" << entry.name << "': " << std::strerror(errno) << ". Skipping.\n";
+            return false;
+        }
+        state.known_dirs.insert(outputPath.string());
+        noteItemCreated(outputPath, 0, state);
+        // Permissions and mtime are applied at the end: a read-only directory would block
+        // its children, and creating the children would change its mtime.
+        if (entry.mode != 0 || entry.mtime_ns != 0) {
+            state.deferred_dirs.push_back(entry);
+        }
+        return true;
+    }
+
+    case ENTRY_FILE:
+    case ENTRY_SPARSE: {
+        // A new file replaces what was there: opening an existing path would write through
+        // a symlink or into every other name of a hard-linked file.
+        if (unlink(outputPath.c_str()) != 0 && errno != ENOENT) {
+            std::cerr << "Warning: Could not replace " << outputPath << ": " << std::strerror(errno) << ". Skipping.\n";
+            return false;
+        }
+        int fd = open(outputPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            std::cerr << "Warning: Could not create output file: " << outputPath << ". Skipping.\n";
+            return false;
+        }
+        bool ok;
+        try {
+            ok = entry.type == ENTRY_SPARSE ? writeSparseFile(fd, payload)
+                                            : writeRegularFile(fd, payload, entry.size, state);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        if (!closeExtractedFile(fd, outputPath, entry, ok, state)) {
+            return false;
+        }
+        if (entry.type == ENTRY_SPARSE) {
+            std::cout << "Extracted sparse file: " << entry.name << "\n";
+        } else {
+            std::cout << "Extracted file: " << entry.name << " (" << entry.size << " bytes)\n";
+        }
+        return true;
+    }
+
+    case ENTRY_SYMLINK: {
+        std::string target = payload.readAll();
+        if (!isSafeSymlinkTarget(entry.name, target)) {
+            std::cerr << "Warning: Symlink '" << entry.name << "' -> " << target
+                      << " points outside the output directory. Skipping.\n";
+            return false;
+        }
+        state.deferred_symlinks.emplace_back(entry, target);
+        return true;
+    }
+
+    case ENTRY_HARDLINK: {
+        std::string target = payload.readAll();
+        if (!isSafeEntryName(target) || !ensureParentDirectory(outputRoot, target, state)) {
+            std::cerr << "Warning: Hard link '" << entry.name << "' -> " << target
+                      << " points outside the output directory. Skipping.\n";
+            return false;
+        }
+        if (!createLink(outputPath, (outputRoot / target).string(), true)) {
+            return false;
+        }
+        noteItemCreated(outputPath, 0, state);
+        std::cout << "Extracted hard link: " << entry.name << " -> " << target << "\n";
+        return true;
+    }
+
+    default:
+        std::cerr << "Warning: Unsupported entry type " << static_cast<int>(entry.type)
+                  << " for '" << entry.name << "'. Skipping.\n";
+        return false;
+    }
+}
+
+void finishExtraction(const fs::path& outputRoot, ExtractState& state) {
+    // Nothing is written after this point, so no entry can go through these symlinks.
+    for (const auto& link : state.deferred_symlinks) {
+        const EntryHeader& entry = link.first;
+        fs::path outputPath = outputRoot / entry.name;
+        if (!createLink(outputPath, link.second, false)) {
+            continue;
+        }
+        applyMetadata(outputPath, entry);
+        noteItemCreated(outputPath, 0, state);
+        std::cout << "Extracted symlink: " << entry.name << " -> " << link.second << "\n";
+    }
+    state.deferred_symlinks.clear();
+    for (auto it = state.deferred_dirs.rbegin(); it != state.deferred_dirs.rend(); ++it) {
+        applyMetadata(outputRoot / it->name, *it);
+    }
+    state.deferred_dirs.clear();
+}
+
+// --- Integrity test (--test) ---
+
+static const size_t VERIFY_CHUNK_SIZE = 4 << 20;
+
+struct VerifyEntry {
+    std::string name;
+    uint64_t size = 0;
+    uint32_t expected_crc = 0;
+    std::vector<uint32_t> chunk_crcs;
+    std::atomic<size_t> chunks_remaining{0};
+};
+
+struct VerifyJob {
+    VerifyEntry* entry = nullptr;
+    size_t chunk_index = 0;
+    size_t length = 0;
+    std::vector<char> buffer;
+};
+
+bool testArchive(std::istream& inputArchive, uint8_t format_version, unsigned worker_count,
+                 const std::set<std::string>& selection, const ChunkDecoder& decode) {
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Every job holds one of the buffers, so neither queue ever fills up.
+    BoundedQueue<VerifyJob> jobs(worker_count * 2);
+    BoundedQueue<std::vector<char>> free_buffers(worker_count * 2); // Bounds memory to (2 * workers) chunks
+    for (unsigned i = 0; i < worker_count * 2; ++i) {
+        free_buffers.push(std::vector<char>(VERIFY_CHUNK_SIZE));
+    }
+
+    std::mutex failures_mutex;
+    std::vector<std::string> failures;
+    bool has_checksums = format_version >= 1;
+
+    auto finish_entry = [&](VerifyEntry* entry) {
+        uint32_t crc = 0;
+        uint64_t remaining = entry->size;
+        for (uint32_t chunk_crc : entry->chunk_crcs) {
+            uint64_t len = std::min<uint64_t>(remaining, VERIFY_CHUNK_SIZE);
+            crc = crc32c_combine(crc, chunk_crc, len);
+            remaining -= len;
+        }
+        if (has_checksums && crc != entry->expected_crc) {
+            std::lock_guard<std::mutex> lock(failures_mutex);
+            failures.push_back(entry->name);
+        }
+        // Release per-entry memory; only the bookkeeping struct stays alive.
+        std::string().swap(entry->name);
+        std::vector<uint32_t>().swap(entry->chunk_crcs);
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < worker_count; ++i) {
+        workers.emplace_back([&] {
+            VerifyJob job;
+            while (jobs.pop(job)) {
+                if (decode) {
+                    decode(job.buffer.data(), job.length, static_cast<uint64_t>(job.chunk_index) * VERIFY_CHUNK_SIZE);
+                }
+                job.entry->chunk_crcs[job.chunk_index] = crc32c_update(0, job.buffer.data(), job.length);
+                free_buffers.push(std::move(job.buffer));
+                if (job.entry->chunks_remaining.fetch_sub(1) == 1) {
+                    finish_entry(job.entry);
+                }
+            }
+        });
+    }
+
+    std::deque<VerifyEntry> entries;
+    uint64_t total_bytes = 0;
+    std::string read_error;
+    try {
+        while (inputArchive.peek() != EOF) {
+            EntryHeader header = readEntryHeader(inputArchive, format_version);
+
+            if (!selection.empty() && !selection.count(header.name)) {
+                readBinaryDataContent(inputArchive, header.size, false); // Skip content
+                continue;
+            }
+
+            uint64_t size = header.size;
+            entries.emplace_back();
+            VerifyEntry& entry = entries.back();
+            entry.name = header.name;
+            entry.size = size;
+            entry.expected_crc = header.crc;
+            size_t chunk_count = (size + VERIFY_CHUNK_SIZE - 1) / VERIFY_CHUNK_SIZE;
+            if (chunk_count == 0) {
+                finish_entry(&entry);
+                continue;
+            }
+            entry.chunk_crcs.resize(chunk_count);
+            entry.chunks_remaining = chunk_count;
+
+            for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+                VerifyJob job;
+                free_buffers.pop(job.buffer);
+                job.entry = &entry;
+                job.chunk_index = chunk;
+                job.length = std::min<uint64_t>(size - chunk * VERIFY_CHUNK_SIZE, VERIFY_CHUNK_SIZE);
+                inputArchive.read(job.buffer.data(), job.length);
+                if (!inputArchive) {
+                    throw std::runtime_error("Error reading binary data from archive.");
+                }
+                total_bytes += job.length;
+                jobs.push(std::move(job));
+            }
+        }
+    } catch (const std::exception& e) {
+        read_error = e.what();
+    }
+
+    jobs.close();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    double mb_per_sec = seconds > 0 ? (total_bytes / (1024.0 * 1024.0)) / seconds : 0.0;
+
+    for (const auto& name : failures) {
+        std::cerr << "FAILED: " << name << " (checksum mismatch"
+                  << (decode ? ": wrong password or corrupted data)\n" : ")\n");
+    }
+    std::cout << "Tested " << entries.size() << " entries, " << total_bytes << " bytes in "
+              << std::fixed << std::setprecision(2) << seconds << " s ("
+              << std::setprecision(1) << mb_per_sec << " MB/s, " << worker_count << " workers).\n";
+    if (!has_checksums) {
+        std::cout << "Note: archive predates per-entry checksums; only structure and readability were verified.\n";
+    }
+    if (!read_error.empty()) {
+        std::cerr << "Error during testing: " << read_error << std::endl;
+        std::cerr << "Archive might be corrupted or incomplete.\n";
+        return false;
+    }
+    if (!failures.empty()) {
+        std::cerr << failures.size() << " entries failed checksum verification.\n";
+        return false;
+    }
+    std::cout << "All entries OK.\n";
+    return true;
+}
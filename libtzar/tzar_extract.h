@@ -0,0 +1,175 @@
+// === libtzar/tzar_extract.h ===
+// Recreating archive entries on disk, and the parallel checksum test of --test. Shared by
+// simple_unarchiver, which holds each entry's content in memory, and tzar_decrypt, which
+// decrypts it chunk by chunk: both hand the content over as a PayloadSource.
+#ifndef TZAR_EXTRACT_H
+#define TZAR_EXTRACT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <istream>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "tzar_format.h"
+
+// --- Payload sources ---
+
+// The content of one entry, handed out in pieces as it is written.
+class PayloadSource {
+public:
+    virtual ~PayloadSource() = default;
+
+    // Content bytes not handed out yet.
+    virtual uint64_t remaining() const = 0;
+
+    // Hands out the next piece of content: at most 'max' bytes, and at least one while
+    // anything remains. 'data' stays valid until the next call.
+    virtual size_t next(const char*& data, size_t max) = 0;
+
+    // Copies the next 'len' bytes to 'out'. Throws std::runtime_error if fewer remain.
+    void read(char* out, size_t len);
+
+    // Returns the whole (small) remaining content, e.g. a link target.
+    std::string readAll();
+};
+
+// Content already in memory, handed out without copying.
+class MemoryPayload : public PayloadSource {
+public:
+    explicit MemoryPayload(const std::vector<char>& content) : data_(content.data()), remaining_(content.size()) {}
+
+    uint64_t remaining() const override { return remaining_; }
+    size_t next(const char*& data, size_t max) override;
+
+private:
+    const char* data_;
+    uint64_t remaining_;
+};
+
+// --- Low-level output ---
+
+// Restores an extracted item's recorded modification time (nanoseconds). Pass
+// AT_SYMLINK_NOFOLLOW in 'flags' to change a symlink itself.
+void setModificationTime(const std::filesystem::path& path, int64_t mtime_ns, int flags = 0);
+
+// Write a whole buffer to 'fd' (at 'offset'), retrying short writes. Return false on error.
+bool writeAll(int fd, const char* data, size_t size);
+bool pwriteAll(int fd, const char* data, size_t size, uint64_t offset);
+
+// Fsyncs a directory (empty for the current one), making the entries created in it durable.
+void syncDirectory(const std::filesystem::path& dir);
+
+// --- Zero blocks ---
+// Regular files with long zero runs (VM images, preallocated databases) are restored
+// sparse: all-zero blocks are skipped instead of written, and a final ftruncate() gives
+// the file its size. isZeroBlock() (tzar_format.h) is the vectorised block test.
+
+// Counts the whole zero blocks in the content, i.e. the holes writeSkippingZeroBlocks()
+// would leave, stopping as soon as 'limit' are found.
+size_t countZeroBlocks(const char* data, size_t size, size_t limit);
+
+// Writes a piece of a regular file that starts at 'offset' in the file, leaving holes
+// where whole blocks are zero. Runs of non-zero blocks are coalesced into one pwrite()
+// each; a partial block at the end is always written. Pieces should start on a block
+// boundary. The caller ftruncate()s the file to its size afterwards.
+bool writeSkippingZeroBlocks(int fd, const char* data, size_t size, uint64_t offset);
+
+// --- Entry extraction ---
+// The entry type says exactly what to create, so each entry maps to one creation call
+// (mkdir, open/write, symlink, link) with no exists()/is_directory() probing.
+// Nothing is ever created outside the output root: entry names and hard link targets must
+// be relative and free of "..", no parent directory may be a symlink, files replace
+// whatever is at their path instead of writing through it, and symlinks are only created
+// once every other entry exists, so no later entry can be written through one.
+
+// Durability modes (simple_unarchiver --durability):
+//   none  - leave writeback to the kernel; a crash may lose recently extracted items.
+//   batch - one syncfs() per checkpoint and one at the end. A single call flushes every
+//           dirty file and directory on the output filesystem, which is far cheaper
+//           than an fsync() per file when extracting many small files.
+//   file  - each item is fsync()ed together with its parent directory before it is
+//           reported, so an "Extracted" line means the item is on disk.
+enum DurabilityMode { DURABILITY_NONE, DURABILITY_BATCH, DURABILITY_FILE };
+
+const uint64_t CHECKPOINT_BYTES = 256ull << 20; // batch: sync after this much unsynced data
+const uint64_t CHECKPOINT_ENTRIES = 4096;       // ... or after this many unsynced items
+
+struct ExtractState {
+    std::unordered_set<std::string> known_dirs; // Directories created or seen during this run
+    std::vector<EntryHeader> deferred_dirs;     // Directory mode/mtime, applied once children exist
+    std::vector<std::pair<EntryHeader, std::string>> deferred_symlinks; // With their targets
+    DurabilityMode durability = DURABILITY_NONE;
+    bool skip_zero_blocks = true;               // Restore zero runs in regular files as holes
+    uint64_t unsynced_bytes = 0;                // Written since the last checkpoint
+    uint64_t unsynced_entries = 0;
+    int syncfs_calls = 0;                       // By syncOutput()
+};
+
+// Accounts for an item created on disk. In file mode its directory entry is synced right
+// away; every item counts towards the next checkpoint.
+void noteItemCreated(const std::filesystem::path& outputPath, uint64_t bytes, ExtractState& state);
+
+// True once enough has been written since the last checkpoint.
+bool checkpointDue(const ExtractState& state);
+
+// Completes a checkpoint, after which everything extracted so far is on disk: batch mode
+// calls syncOutput(); in file mode every item already was synced as it was created, so
+// only the counters start over.
+void checkpoint(const std::filesystem::path& outputRoot, ExtractState& state);
+
+// Flushes everything extracted so far with one syncfs() on the output filesystem.
+void syncOutput(const std::filesystem::path& outputRoot, ExtractState& state);
+
+// True if 'name' is relative, not empty and has no ".." component: an entry name or hard
+// link target that stays inside the output root.
+bool isSafeEntryName(const std::string& name);
+
+// Makes sure the parent directory of entry 'name' exists under 'outputRoot', creating
+// what is missing. Every component below the root must be a real directory, not a symlink.
+// Only the first entry in a directory pays for the checks; later entries hit the cache.
+// Returns false (with a warning) if a component is in the way.
+bool ensureParentDirectory(const std::filesystem::path& outputRoot, const std::string& name, ExtractState& state);
+
+// Checks that entry 'name' may be created under 'outputRoot' (isSafeEntryName()) and
+// prepares its parent directory (ensureParentDirectory()). Warns and returns false if not.
+bool prepareEntryPath(const std::filesystem::path& outputRoot, const std::string& name, ExtractState& state);
+
+// Creates a symlink or hard link, replacing whatever is already at the path.
+bool createLink(const std::filesystem::path& outputPath, const std::string& target, bool hard);
+
+// Applies recorded permission bits and mtime to an extracted item.
+void applyMetadata(const std::filesystem::path& outputPath, const EntryHeader& entry);
+
+// Creates one extracted item under 'outputRoot' (empty for the current directory),
+// consuming its content from 'payload'. Symlinks are checked and deferred until
+// finishExtraction(). Returns false if the item was skipped; the caller then drains what
+// is left of the payload.
+bool extractEntry(const EntryHeader& entry, PayloadSource& payload, const std::filesystem::path& outputRoot,
+                  ExtractState& state);
+
+// Creates the deferred symlinks, then applies deferred directory metadata, deepest
+// directories first.
+void finishExtraction(const std::filesystem::path& outputRoot, ExtractState& state);
+
+// --- Integrity test (--test) ---
+// The reader streams payloads in fixed-size chunks into recycled buffers; a pool of
+// workers decodes and checksums the chunks in parallel, and the last worker to finish an
+// entry combines the chunk CRCs and compares them with the recorded checksum.
+
+// Turns a chunk of stored content into plaintext in place; 'offset' is the chunk's
+// position in the entry's content.
+using ChunkDecoder = std::function<void(char* data, size_t length, uint64_t offset)>;
+
+// Verifies every entry named in 'selection' (every entry if it is empty) of an archive
+// whose stored content is as long as its plaintext, without writing anything. 'decode'
+// may be empty for unencrypted archives. Returns true if all checksums matched.
+bool testArchive(std::istream& inputArchive, uint8_t format_version, unsigned worker_count,
+                 const std::set<std::string>& selection, const ChunkDecoder& decode);
+
+#endif // TZAR_EXTRACT_H
@@ -0,0 +1,537 @@
+// === libtzar/tzar_format.cpp ===
+#include "tzar_format.h"
+
+#include <algorithm> // For std::min
+#include <cstring>   // For std::memcpy, std::memcmp
+#include <sstream>   // For std::ostringstream
+#include <stdexcept> // For std::runtime_error
+#include <sys/stat.h> // For struct stat
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // For the CRC32 instruction and the SSE2/AVX2 zero-block tests
+#endif
+
+#include "tzar_cpu.h"
+
+int64_t statModificationTimeNs(const struct stat& st) {
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+uint64_t aeadChunkCount(uint64_t size) {
+    return size == 0 ? 1 : (size + AEAD_CHUNK_SIZE - 1) / AEAD_CHUNK_SIZE;
+}
+
+uint64_t aeadStoredSize(uint64_t size) {
+    return size + aeadChunkCount(size) * AEAD_TAG_SIZE;
+}
+
+// --- CRC-32C (Castagnoli) checksum ---
+// Portable kernel: slicing-by-8.
+static uint32_t crc32c_table[8][256];
+
+static bool crc32c_init_tables() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+        }
+        crc32c_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = crc32c_table[0][i];
+        for (int t = 1; t < 8; ++t) {
+            c = crc32c_table[0][c & 0xFF] ^ (c >> 8);
+            crc32c_table[t][i] = c;
+        }
+    }
+    return true;
+}
+
+uint32_t crc32c_update_scalar(uint32_t crc, const char* data, size_t len) {
+    static const bool tables_ready = crc32c_init_tables();
+    (void)tables_ready;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// GF(2) matrix helpers for crc32c_combine (same method as zlib's crc32_combine).
+static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    if (len2 == 0) return crc1;
+    uint32_t even[32], odd[32];
+    odd[0] = 0x82F63B78; // Operator for one zero bit
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); // Two zero bits
+    gf2_matrix_square(odd, even); // Four zero bits
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+        gf2_matrix_square(odd, even);
+        if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+    return crc1 ^ crc2;
+}
+
+#if defined(__x86_64__)
+// The CRC32 instruction computes CRC-32C but has a three-cycle latency, so long inputs
+// are hashed as three interleaved streams of a fixed block length. The CRC of a stream
+// followed by another is the first CRC advanced over the second's length of zeros, XORed
+// with the second's CRC (from 0); advancing is linear, so for a fixed length it is four
+// table lookups (same method as Mark Adler's crc32c.c).
+const size_t CRC32C_LONG = 8192;
+const size_t CRC32C_SHORT = 256;
+static uint32_t crc32c_long_table[4][256];
+static uint32_t crc32c_short_table[4][256];
+
+// Fills 'table' with the operator that advances a CRC over 'len' zero bytes.
+static void crc32c_zeros_table(uint32_t table[4][256], size_t len) {
+    uint32_t op[32], square[32];
+    op[0] = 0x82F63B78; // One zero bit
+    for (int n = 1; n < 32; n++) {
+        op[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(square, op); // Two zero bits
+    gf2_matrix_square(op, square); // Four zero bits
+    // Square up to one zero byte, then combine the powers of two making up 'len'.
+    gf2_matrix_square(square, op);
+    std::memcpy(op, square, sizeof(op)); // Eight zero bits
+    uint32_t result[32];
+    bool have_result = false;
+    for (size_t n = len; n != 0; n >>= 1) {
+        if (n & 1) {
+            if (have_result) {
+                for (int i = 0; i < 32; i++) {
+                    result[i] = gf2_matrix_times(op, result[i]);
+                }
+            } else {
+                std::memcpy(result, op, sizeof(result));
+                have_result = true;
+            }
+        }
+        gf2_matrix_square(square, op);
+        std::memcpy(op, square, sizeof(op));
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 0; k < 4; k++) {
+            table[k][i] = gf2_matrix_times(result, i << (8 * k));
+        }
+    }
+}
+
+static bool crc32c_init_shift_tables() {
+    crc32c_zeros_table(crc32c_long_table, CRC32C_LONG);
+    crc32c_zeros_table(crc32c_short_table, CRC32C_SHORT);
+    return true;
+}
+
+static uint32_t crc32c_shift(const uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^ table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+}
+
+// Three streams of 'block' bytes each, merged into 'crc'.
+__attribute__((target("sse4.2")))
+static uint64_t crc32c_sse42_blocks(uint64_t crc, const uint8_t*& p, size_t& len, size_t block,
+                                    const uint32_t table[4][256]) {
+    while (len >= 3 * block) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < block; i += 8) {
+            uint64_t w0, w1, w2;
+            std::memcpy(&w0, p + i, 8);
+            std::memcpy(&w1, p + block + i, 8);
+            std::memcpy(&w2, p + 2 * block + i, 8);
+            crc = _mm_crc32_u64(crc, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+        }
+        crc = crc32c_shift(table, static_cast<uint32_t>(crc)) ^ crc1;
+        crc = crc32c_shift(table, static_cast<uint32_t>(crc)) ^ crc2;
+        p += 3 * block;
+        len -= 3 * block;
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_update_sse42(uint32_t crc, const char* data, size_t len) {
+    static const bool tables_ready = crc32c_init_shift_tables();
+    (void)tables_ready;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    uint64_t c = static_cast<uint32_t>(~crc);
+    c = crc32c_sse42_blocks(c, p, len, CRC32C_LONG, crc32c_long_table);
+    c = crc32c_sse42_blocks(c, p, len, CRC32C_SHORT, crc32c_short_table);
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    for (; len > 0; --len) {
+        c32 = _mm_crc32_u8(c32, *p++);
+    }
+    return ~c32;
+}
+#endif
+
+std::vector<Crc32cKernelInfo> crc32cKernels() {
+    std::vector<Crc32cKernelInfo> kernels = {{"scalar", crc32c_update_scalar, true}};
+#if defined(__x86_64__)
+    kernels.push_back({"sse4.2", crc32c_update_sse42, cpuHas(CPU_SSE42)});
+#endif
+    return kernels;
+}
+
+Crc32cKernel selectCrc32cKernel() {
+    Crc32cKernel best = crc32c_update_scalar;
+    for (const Crc32cKernelInfo& info : crc32cKernels()) {
+        if (info.supported) best = info.update;
+    }
+    return best;
+}
+
+uint32_t crc32c_update(uint32_t crc, const char* data, size_t len) {
+    static const Crc32cKernel update = selectCrc32cKernel();
+    return update(crc, data, len);
+}
+
+// --- Zero-block detection ---
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+bool is_zero_block_avx2(const char* data) {
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < ZERO_BLOCK_SIZE; i += 128) {
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32)));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 64)));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 96)));
+    }
+    return _mm256_testz_si256(acc, acc);
+}
+
+__attribute__((target("sse2")))
+bool is_zero_block_sse2(const char* data) {
+    __m128i acc = _mm_setzero_si128();
+    for (size_t i = 0; i < ZERO_BLOCK_SIZE; i += 64) {
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 32)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 48)));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+}
+#endif
+
+bool is_zero_block_scalar(const char* data) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i < ZERO_BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        acc |= word;
+    }
+    return acc == 0;
+}
+
+std::vector<ZeroBlockTestInfo> zeroBlockTests() {
+    std::vector<ZeroBlockTestInfo> tests = {{"scalar", is_zero_block_scalar, true}};
+#if defined(__x86_64__) || defined(__i386__)
+    tests.push_back({"sse2", is_zero_block_sse2, cpuHas(CPU_SSE2)});
+    tests.push_back({"avx2", is_zero_block_avx2, cpuHas(CPU_AVX2)});
+#endif
+    return tests;
+}
+
+ZeroBlockTest selectZeroBlockTest() {
+    ZeroBlockTest best = is_zero_block_scalar;
+    for (const ZeroBlockTestInfo& info : zeroBlockTests()) {
+        if (info.supported) best = info.test;
+    }
+    return best;
+}
+
+bool isZeroBlock(const char* data) {
+    static const ZeroBlockTest test = selectZeroBlockTest();
+    return test(data);
+}
+
+// --- Readers ---
+std::string readString(std::istream& inFile) {
+    uint32_t len;
+    inFile.read(reinterpret_cast<char*>(&len), sizeof(len));
+    if (!inFile) {
+        throw std::runtime_error("Error reading string length from archive.");
+    }
+    std::vector<char> buffer(len);
+    inFile.read(buffer.data(), len);
+    if (!inFile) {
+        throw std::runtime_error("Error reading string data from archive.");
+    }
+    return std::string(buffer.begin(), buffer.end());
+}
+
+uint32_t readUint32(std::istream& inFile) {
+    uint32_t value;
+    inFile.read(reinterpret_cast<char*>(&value), sizeof(value));
+    if (!inFile) {
+        throw std::runtime_error("Error reading entry metadata from archive.");
+    }
+    return value;
+}
+
+int64_t readInt64(std::istream& inFile) {
+    int64_t value;
+    inFile.read(reinterpret_cast<char*>(&value), sizeof(value));
+    if (!inFile) {
+        throw std::runtime_error("Error reading entry modification time from archive.");
+    }
+    return value;
+}
+
+uint64_t readBinaryDataSize(std::istream& inFile) {
+    uint64_t size;
+    inFile.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (!inFile) {
+        throw std::runtime_error("Error reading binary data size from archive.");
+    }
+    return size;
+}
+
+void discardBytes(std::istream& inFile, uint64_t size) {
+    std::vector<char> scratch(std::min<uint64_t>(size, 1 << 20));
+    while (size > 0) {
+        std::streamsize chunk = static_cast<std::streamsize>(std::min<uint64_t>(size, scratch.size()));
+        if (!inFile.read(scratch.data(), chunk)) {
+            throw std::runtime_error("Error skipping binary data content in archive.");
+        }
+        size -= chunk;
+    }
+}
+
+std::vector<char> readBinaryDataContent(std::istream& inFile, uint64_t size, bool read_content) {
+    std::vector<char> data;
+    if (read_content) {
+        data.resize(size);
+        if (size > 0) {
+            inFile.read(data.data(), size);
+            if (!inFile) {
+                throw std::runtime_error("Error reading binary data from archive.");
+            }
+        }
+    } else {
+        // A pipe cannot seek, so there the bytes are read and dropped instead.
+        inFile.seekg(size, std::ios_base::cur);
+        if (!inFile) {
+            inFile.clear();
+            discardBytes(inFile, size);
+        }
+    }
+    return data;
+}
+
+std::vector<char> readBinaryData(std::istream& inFile, bool read_content) {
+    uint64_t size = readBinaryDataSize(inFile);
+    return readBinaryDataContent(inFile, size, read_content);
+}
+
+// Before version 3 the type is inferred the way older versions always did:
+// empty content means a directory.
+EntryHeader readEntryHeader(std::istream& inFile, uint8_t format_version) {
+    EntryHeader entry;
+    entry.name = readString(inFile);
+    if (format_version >= 3) {
+        char type;
+        if (!inFile.get(type)) {
+            throw std::runtime_error("Error reading entry type from archive.");
+        }
+        entry.type = static_cast<EntryType>(type);
+        entry.mode = readUint32(inFile);
+    }
+    if (format_version >= 1) {
+        entry.crc = readUint32(inFile);
+    }
+    if (format_version >= 2) {
+        entry.mtime_ns = readInt64(inFile);
+    }
+    entry.size = readBinaryDataSize(inFile);
+    if (format_version < 3) {
+        entry.type = entry.size == 0 ? ENTRY_DIRECTORY : ENTRY_FILE;
+    }
+    return entry;
+}
+
+uint8_t readArchiveHeader(std::istream& inFile, uint8_t& encryption_flag) {
+    char header[6];
+    inFile.read(header, sizeof(header));
+    if (inFile && (header[0] == 0x00 || header[0] == 0x01) &&
+        std::memcmp(header + 1, TZAR_MAGIC, sizeof(TZAR_MAGIC)) == 0) {
+        encryption_flag = static_cast<uint8_t>(header[0]);
+        uint8_t version = static_cast<uint8_t>(header[5]);
+        // Encrypted archives have their own, higher versions; see readEncryptedArchiveHeader().
+        if (encryption_flag == 0x00 && version > TZAR_FORMAT_VERSION) {
+            throw std::runtime_error("Unsupported archive format version " + std::to_string(version) + ".");
+        }
+        return version;
+    }
+    // Legacy archive without a header: go back to the first entry. On a pipe the bytes
+    // just read are still in the stream buffer, so step back over them instead.
+    std::streamsize consumed = inFile.gcount();
+    inFile.clear();
+    inFile.seekg(0, std::ios::beg);
+    if (!inFile) {
+        inFile.clear();
+        for (std::streamsize i = 0; i < consumed; ++i) {
+            if (!inFile.unget()) {
+                throw std::runtime_error("Cannot rewind legacy archive read from a pipe.");
+            }
+        }
+    }
+    encryption_flag = 0x00;
+    return 0;
+}
+
+EncryptedArchiveHeader readEncryptedArchiveHeader(std::istream& inFile) {
+    EncryptedArchiveHeader archive;
+    char header[6];
+    inFile.read(header, sizeof(header));
+    if (inFile && header[0] == 0x01 && std::memcmp(header + 1, TZAR_MAGIC, sizeof(TZAR_MAGIC)) == 0) {
+        uint8_t version = static_cast<uint8_t>(header[5]);
+        if (version > TZAR2_FORMAT_VERSION) {
+            throw std::runtime_error("Unsupported archive format version " + std::to_string(version) + ".");
+        }
+        archive.version = version;
+        if (version >= 5) {
+            char id;
+            if (!inFile.get(id)) {
+                throw std::runtime_error("Unexpected end of file while reading cipher ID.");
+            }
+            archive.cipher = static_cast<CipherId>(id);
+            if (archive.cipher != CIPHER_XCHACHA20_POLY1305 && archive.cipher != CIPHER_AES_256_GCM) {
+                throw std::runtime_error("Unknown cipher ID " + std::to_string(static_cast<uint8_t>(id)) + ".");
+            }
+        }
+        if (version >= 6) {
+            KdfParams& kdf = archive.kdf;
+            char id;
+            inFile.get(id);
+            inFile.read(reinterpret_cast<char*>(&kdf.iterations), sizeof(kdf.iterations));
+            inFile.read(reinterpret_cast<char*>(kdf.salt), sizeof(kdf.salt));
+            if (!inFile) {
+                throw std::runtime_error("Unexpected end of file while reading key derivation parameters.");
+            }
+            kdf.kdf = static_cast<KdfId>(id);
+            if (kdf.kdf != KDF_PBKDF2_HMAC_SHA256 || kdf.iterations == 0) {
+                throw std::runtime_error("Unknown key derivation function ID " +
+                                         std::to_string(static_cast<uint8_t>(id)) + ".");
+            }
+        }
+        if (version >= 4 && !inFile.read(reinterpret_cast<char*>(archive.nonce), AEAD_NONCE_SIZE)) {
+            throw std::runtime_error("Unexpected end of file while reading archive nonce.");
+        }
+        if (archive.hasKeyCheck() && !inFile.read(reinterpret_cast<char*>(archive.key_check), KEY_CHECK_SIZE)) {
+            throw std::runtime_error("Unexpected end of file while reading key check value.");
+        }
+        if (archive.hasWrappedKey() &&
+            !inFile.read(reinterpret_cast<char*>(archive.wrapped_key), WRAPPED_KEY_SIZE)) {
+            throw std::runtime_error("Unexpected end of file while reading wrapped data key.");
+        }
+        return archive;
+    }
+    if (inFile.gcount() == 0) {
+        throw std::runtime_error("Unexpected end of file while reading encryption flag.");
+    }
+    if (header[0] != 0x01) {
+        throw std::runtime_error("Not an encrypted .tzar2 file or invalid format.");
+    }
+    inFile.clear();
+    inFile.seekg(1, std::ios::beg);
+    return archive;
+}
+
+// --- Writers ---
+void writeString(std::ostream& outFile, const std::string& str) {
+    uint32_t len = str.length();
+    outFile.write(reinterpret_cast<const char*>(&len), sizeof(len));
+    outFile.write(str.c_str(), len);
+}
+
+void writeUint32(std::ostream& outFile, uint32_t value) {
+    outFile.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void writeInt64(std::ostream& outFile, int64_t value) {
+    outFile.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void writeUint64(std::ostream& outFile, uint64_t value) {
+    outFile.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void writeBinaryData(std::ostream& outFile, const std::vector<char>& data) {
+    writeUint64(outFile, data.size());
+    outFile.write(data.data(), data.size());
+}
+
+std::string entryHeaderBytes(const EntryHeader& entry) {
+    std::ostringstream out;
+    writeString(out, entry.name);
+    out.put(static_cast<char>(entry.type));
+    writeUint32(out, entry.mode);
+    writeUint32(out, entry.crc);
+    writeInt64(out, entry.mtime_ns);
+    writeUint64(out, entry.size);
+    return out.str();
+}
+
+void writeArchiveHeader(std::ostream& outFile) {
+    outFile.put(0x00); // Unencrypted
+    outFile.write(TZAR_MAGIC, sizeof(TZAR_MAGIC));
+    outFile.put(static_cast<char>(TZAR_FORMAT_VERSION));
+}
+
+void writeEncryptedArchiveHeader(std::ostream& outFile, const EncryptedArchiveHeader& header) {
+    outFile.put(0x01); // Encrypted
+    outFile.write(TZAR_MAGIC, sizeof(TZAR_MAGIC));
+    outFile.put(static_cast<char>(TZAR2_FORMAT_VERSION));
+    outFile.put(static_cast<char>(header.cipher));
+    outFile.put(static_cast<char>(header.kdf.kdf));
+    writeUint32(outFile, header.kdf.iterations);
+    outFile.write(reinterpret_cast<const char*>(header.kdf.salt), sizeof(header.kdf.salt));
+    outFile.write(reinterpret_cast<const char*>(header.nonce), AEAD_NONCE_SIZE);
+    outFile.write(reinterpret_cast<const char*>(header.wrapped_key), WRAPPED_KEY_SIZE);
+}
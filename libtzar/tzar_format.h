@@ -0,0 +1,214 @@
+// === libtzar/tzar_format.h ===
+// On-disk layout of .tzar and .tzar2 archives: header constants, entry headers,
+// the CRC-32C checksum and the stream readers and writers every tool shares.
+#ifndef TZAR_FORMAT_H
+#define TZAR_FORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Archive header: encryption flag (0x00 for .tzar, 0x01 for .tzar2), magic and format version.
+// Format version 1 adds a CRC-32C checksum of the plaintext content to every entry,
+// version 2 adds the modification time (nanoseconds since the epoch, 0 if unknown),
+// version 3 adds the entry type and permission bits so extraction never has to guess.
+// Archives without the header (version 0) are still readable.
+// Encrypted archives (.tzar2) continue the numbering: version 4 replaces the XOR cipher
+// with chunked XChaCha20-Poly1305 and stores a random nonce after the version byte,
+// version 5 inserts a cipher ID (CipherId) between the two, version 6 follows the cipher ID
+// with the password KDF (KdfId, u32 iterations, 16-byte salt) and uses the real SHA256,
+// version 7 ends the header with a key check value so a wrong password is rejected
+// before any entry is read, version 8 replaces it with a random data key wrapped by the
+// password key (envelope encryption), so the password can change without touching content,
+// version 9 ends the archive with a sealed index of all entry headers (tzar_index.h).
+const char TZAR_MAGIC[4] = {'T', 'Z', 'A', 'R'};
+const uint8_t TZAR_FORMAT_VERSION = 3;
+const uint8_t TZAR2_FORMAT_VERSION = 9;
+
+// Entry types (format version 3 and later).
+enum EntryType : uint8_t {
+    ENTRY_FILE = 0,      // Regular file; content is the file data
+    ENTRY_DIRECTORY = 1, // Directory; no content
+    ENTRY_SYMLINK = 2,   // Symbolic link; content is the link target
+    ENTRY_HARDLINK = 3,  // Hard link; content is the name of an earlier entry
+    ENTRY_SPARSE = 4,    // File with holes; content is a segment map followed by the data segments
+    ENTRY_REFERENCE = 5  // Reserved: content identical to an earlier entry (not written yet)
+};
+
+// Everything stored for an entry before its content.
+struct EntryHeader {
+    std::string name;
+    EntryType type = ENTRY_FILE;
+    uint32_t mode = 0;     // Permission bits; 0 if not recorded
+    uint32_t crc = 0;      // CRC-32C of the content; only meaningful from version 1
+    int64_t mtime_ns = 0;  // 0 if not recorded
+    uint64_t size = 0;     // Content size
+};
+
+struct stat;
+
+// Converts a stat() modification time to the nanoseconds since the epoch stored in
+// EntryHeader::mtime_ns.
+int64_t statModificationTimeNs(const struct stat& st);
+
+// Version 5 headers name the cipher after the version byte; version 4 archives are
+// always XChaCha20-Poly1305.
+enum CipherId : uint8_t {
+    CIPHER_XCHACHA20_POLY1305 = 1,
+    CIPHER_AES_256_GCM = 2
+};
+
+// Password KDF named by version 6 headers. Versions up to 5 use the unsalted
+// legacy_sha256(password) as the key.
+enum KdfId : uint8_t {
+    KDF_LEGACY_SHA256 = 0,     // legacy_sha256(password); only implied by versions 0-5
+    KDF_PBKDF2_HMAC_SHA256 = 1 // PBKDF2-HMAC-SHA256 with a 32-byte output
+};
+
+const size_t KDF_SALT_SIZE = 16;
+
+struct KdfParams {
+    KdfId kdf = KDF_LEGACY_SHA256;
+    uint32_t iterations = 0;
+    uint8_t salt[KDF_SALT_SIZE] = {};
+};
+
+// From version 4 every payload is sealed in AEAD_CHUNK_SIZE chunks, each followed by its tag.
+const size_t AEAD_CHUNK_SIZE = 64 << 10;
+const size_t AEAD_TAG_SIZE = 16;
+const size_t AEAD_NONCE_SIZE = 16; // Random per-archive part of the nonce, stored in the header
+
+const size_t KEY_CHECK_SIZE = 16; // Version 7; see keyCheckValue()
+const size_t DATA_KEY_SIZE = 32;
+const size_t WRAPPED_KEY_SIZE = DATA_KEY_SIZE + AEAD_TAG_SIZE; // Version 8; see wrapDataKey()
+
+// Everything in a .tzar2 header after the flag and magic.
+struct EncryptedArchiveHeader {
+    uint8_t version = 0;                         // 0 for the bare 0x01 flag of the oldest archives
+    CipherId cipher = CIPHER_XCHACHA20_POLY1305; // Version 4 and later
+    KdfParams kdf;                               // KDF_LEGACY_SHA256 before version 6
+    uint8_t nonce[AEAD_NONCE_SIZE] = {};         // Version 4 and later
+    uint8_t key_check[KEY_CHECK_SIZE] = {};      // Version 7 only
+    uint8_t wrapped_key[WRAPPED_KEY_SIZE] = {};  // Version 8 and later
+
+    bool hasKeyCheck() const { return version == 7; }
+    bool hasWrappedKey() const { return version >= 8; }
+    bool hasIndex() const { return version >= 9; } // Entries end where the index starts
+};
+
+// Number of chunks an entry of 'size' bytes is sealed in; empty entries still get one
+// (empty) chunk so that their header is authenticated.
+uint64_t aeadChunkCount(uint64_t size);
+
+// Bytes an entry of 'size' bytes occupies in a version 4 or later archive.
+uint64_t aeadStoredSize(uint64_t size);
+
+// --- CRC-32C (Castagnoli) checksum ---
+// Continues a CRC-32C over 'len' more bytes. Start with crc = 0. Uses the SSE4.2 CRC32
+// instruction where the CPU has it, slicing-by-8 tables otherwise.
+uint32_t crc32c_update(uint32_t crc, const char* data, size_t len);
+
+// Returns the CRC-32C of A||B given crc(A), crc(B) and the length of B.
+// Lets chunks of one entry be checksummed independently on different threads.
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+typedef uint32_t (*Crc32cKernel)(uint32_t crc, const char* data, size_t len);
+
+uint32_t crc32c_update_scalar(uint32_t crc, const char* data, size_t len);
+#if defined(__x86_64__)
+uint32_t crc32c_update_sse42(uint32_t crc, const char* data, size_t len);
+#endif
+
+struct Crc32cKernelInfo {
+    const char* name;
+    Crc32cKernel update;
+    bool supported;
+};
+
+// Every CRC-32C kernel built into this library, slowest first, and whether this CPU can run it.
+std::vector<Crc32cKernelInfo> crc32cKernels();
+Crc32cKernel selectCrc32cKernel();
+
+// --- Zero-block detection ---
+// Sparse extraction skips all-zero blocks instead of writing them. The test is the hot
+// loop of that, so it is vectorised.
+const size_t ZERO_BLOCK_SIZE = 4096; // Filesystem block; smaller holes are not allocated anyway
+
+typedef bool (*ZeroBlockTest)(const char* data);
+
+bool is_zero_block_scalar(const char* data);
+#if defined(__x86_64__) || defined(__i386__)
+bool is_zero_block_sse2(const char* data);
+bool is_zero_block_avx2(const char* data);
+#endif
+
+struct ZeroBlockTestInfo {
+    const char* name;
+    ZeroBlockTest test;
+    bool supported;
+};
+
+// Every zero-block test built into this library, slowest first, and whether this CPU can run it.
+std::vector<ZeroBlockTestInfo> zeroBlockTests();
+ZeroBlockTest selectZeroBlockTest();
+
+// True if the ZERO_BLOCK_SIZE bytes at 'data' are all zero.
+bool isZeroBlock(const char* data);
+
+// --- Readers ---
+// All of them throw std::runtime_error on a short read.
+std::string readString(std::istream& inFile);
+uint32_t readUint32(std::istream& inFile);
+int64_t readInt64(std::istream& inFile);
+
+// Reads the size (as uint64_t) that precedes an entry's binary data.
+uint64_t readBinaryDataSize(std::istream& inFile);
+
+// Consumes 'size' bytes from a stream that cannot seek (stdin or a pipe).
+void discardBytes(std::istream& inFile, uint64_t size);
+
+// Reads 'size' bytes of binary data whose size has already been read. If 'read_content'
+// is false, it just skips the data.
+std::vector<char> readBinaryDataContent(std::istream& inFile, uint64_t size, bool read_content = true);
+
+// Reads the size, then the data (or skips it if 'read_content' is false).
+std::vector<char> readBinaryData(std::istream& inFile, bool read_content = true);
+
+// Reads an entry's header, up to and including its content size.
+EntryHeader readEntryHeader(std::istream& inFile, uint8_t format_version);
+
+// Reads the archive header. Returns the format version (0 for archives written before
+// the header existed, in which case the stream is rewound) and stores the encryption
+// flag in 'encryption_flag'. Only versions of unencrypted archives are checked.
+uint8_t readArchiveHeader(std::istream& inFile, uint8_t& encryption_flag);
+
+// Reads the .tzar2 header. Version 0 archives consist of the bare 0x01 flag followed
+// by entries; fields an older version does not store keep their defaults.
+EncryptedArchiveHeader readEncryptedArchiveHeader(std::istream& inFile);
+
+// --- Writers ---
+void writeString(std::ostream& outFile, const std::string& str);
+void writeUint32(std::ostream& outFile, uint32_t value);
+void writeInt64(std::ostream& outFile, int64_t value);
+void writeUint64(std::ostream& outFile, uint64_t value);
+
+// Writes the size (as uint64_t), then the data itself.
+void writeBinaryData(std::ostream& outFile, const std::vector<char>& data);
+
+// Serializes an entry's header, up to and including its content size, the way version 3
+// and later store it. In .tzar2 archives the same bytes are the associated data of all of
+// the entry's chunks.
+std::string entryHeaderBytes(const EntryHeader& entry);
+
+// Writes the header of an unencrypted archive at TZAR_FORMAT_VERSION.
+void writeArchiveHeader(std::ostream& outFile);
+
+// Writes the header of an encrypted archive at TZAR2_FORMAT_VERSION ('header.version'
+// and 'header.key_check' are ignored). The header's size depends only on the version,
+// so a rewritten header (tzar_rekey) fits exactly over the old one.
+void writeEncryptedArchiveHeader(std::ostream& outFile, const EncryptedArchiveHeader& header);
+
+#endif // TZAR_FORMAT_H
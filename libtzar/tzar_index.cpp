@@ -0,0 +1,184 @@
+// === libtzar/tzar_index.cpp ===
+#include "tzar_index.h"
+
+#include <algorithm> // For std::min
+#include <cstring>   // For std::memcpy, std::memcmp
+#include <stdexcept> // For std::runtime_error
+
+// --- Encoding ---
+static void putVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// Reads a varint at 'pos', advancing it. Throws on a truncated or overlong value.
+static uint64_t getVarint(const std::string& in, size_t& pos) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.size()) break;
+        uint8_t byte = static_cast<uint8_t>(in[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return value;
+    }
+    throw std::runtime_error("Archive index is corrupted.");
+}
+
+// Bytes entryHeaderBytes() produces for 'entry'.
+static uint64_t entryHeaderSize(const EntryHeader& entry) {
+    return sizeof(uint32_t) + entry.name.size() + 1 + sizeof(entry.mode) + sizeof(entry.crc) +
+           sizeof(entry.mtime_ns) + sizeof(entry.size);
+}
+
+void ArchiveIndexBuilder::add(const EntryHeader& entry) {
+    if (entry_count_ == ARCHIVE_INDEX_ENTRY) {
+        throw std::runtime_error("Too many entries for the archive index.");
+    }
+    size_t shared = 0;
+    size_t limit = std::min(previous_name_.size(), entry.name.size());
+    while (shared < limit && previous_name_[shared] == entry.name[shared]) {
+        shared++;
+    }
+    putVarint(encoded_, shared);
+    putVarint(encoded_, entry.name.size() - shared);
+    encoded_.append(entry.name, shared, std::string::npos);
+    encoded_.push_back(static_cast<char>(entry.type));
+    putVarint(encoded_, entry.mode);
+    encoded_.append(reinterpret_cast<const char*>(&entry.crc), sizeof(entry.crc));
+    // Zigzag, so entries slightly older than the previous one stay short too.
+    int64_t delta = static_cast<int64_t>(static_cast<uint64_t>(entry.mtime_ns) - static_cast<uint64_t>(previous_mtime_ns_));
+    putVarint(encoded_, (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+    putVarint(encoded_, entry.size);
+
+    previous_name_ = entry.name;
+    previous_mtime_ns_ = entry.mtime_ns;
+    entry_count_++;
+}
+
+// --- Sealing ---
+static std::string footerBytes(const ArchiveIndexFooter& footer) {
+    char bytes[ARCHIVE_INDEX_FOOTER_SIZE];
+    std::memcpy(bytes, &footer.entries_end, 8);
+    std::memcpy(bytes + 8, &footer.encoded_size, 8);
+    std::memcpy(bytes + 16, &footer.entry_count, 4);
+    std::memcpy(bytes + 20, TZAR_INDEX_MAGIC, sizeof(TZAR_INDEX_MAGIC));
+    return std::string(bytes, sizeof(bytes));
+}
+
+void writeArchiveIndex(std::ostream& outFile, const ArchiveKey& key, uint64_t entries_end,
+                       const ArchiveIndexBuilder& index) {
+    ArchiveIndexFooter footer;
+    footer.entries_end = entries_end;
+    footer.encoded_size = index.encoded().size();
+    footer.entry_count = index.entryCount();
+    const std::string aad = footerBytes(footer);
+
+    const std::string& plain = index.encoded();
+    const uint64_t chunk_count = aeadChunkCount(plain.size());
+    std::vector<char> sealed(aeadStoredSize(plain.size()));
+    for (uint64_t chunk = 0; chunk < chunk_count; ++chunk) {
+        size_t offset = chunk * AEAD_CHUNK_SIZE;
+        size_t len = std::min(plain.size() - offset, AEAD_CHUNK_SIZE);
+        aead_seal_chunk(key, ARCHIVE_INDEX_ENTRY, static_cast<uint32_t>(chunk), aad, plain.data() + offset,
+                        sealed.data() + chunk * (AEAD_CHUNK_SIZE + AEAD_TAG_SIZE), len);
+    }
+    outFile.write(sealed.data(), sealed.size());
+    outFile.write(aad.data(), aad.size());
+}
+
+// --- Reading ---
+ArchiveIndexFooter readArchiveIndexFooter(std::istream& inFile, uint64_t entries_start) {
+    const std::streampos position = inFile.tellg();
+    inFile.seekg(0, std::ios::end);
+    const uint64_t file_size = static_cast<uint64_t>(inFile.tellg());
+    char bytes[ARCHIVE_INDEX_FOOTER_SIZE];
+    if (!inFile || file_size < entries_start + ARCHIVE_INDEX_FOOTER_SIZE ||
+        !inFile.seekg(file_size - ARCHIVE_INDEX_FOOTER_SIZE) || !inFile.read(bytes, sizeof(bytes)) ||
+        std::memcmp(bytes + 20, TZAR_INDEX_MAGIC, sizeof(TZAR_INDEX_MAGIC)) != 0) {
+        throw std::runtime_error("Archive index is missing; the archive is incomplete.");
+    }
+    inFile.seekg(position);
+
+    ArchiveIndexFooter footer;
+    std::memcpy(&footer.entries_end, bytes, 8);
+    std::memcpy(&footer.encoded_size, bytes + 8, 8);
+    std::memcpy(&footer.entry_count, bytes + 16, 4);
+    // The sealed index must fill the space between the last entry and the footer exactly.
+    const uint64_t index_space = file_size - ARCHIVE_INDEX_FOOTER_SIZE;
+    if (footer.entries_end < entries_start || footer.entries_end > index_space ||
+        footer.encoded_size > index_space - footer.entries_end ||
+        aeadStoredSize(footer.encoded_size) != index_space - footer.entries_end) {
+        throw std::runtime_error("Archive index footer does not match the file size.");
+    }
+    return footer;
+}
+
+bool readArchiveIndex(std::istream& inFile, const ArchiveKey& key, const ArchiveIndexFooter& footer,
+                      uint64_t entries_start, std::vector<IndexedEntry>& entries) {
+    const std::streampos position = inFile.tellg();
+    std::vector<char> sealed(aeadStoredSize(footer.encoded_size));
+    if (!inFile.seekg(static_cast<std::streamoff>(footer.entries_end)) || !inFile.read(sealed.data(), sealed.size())) {
+        throw std::runtime_error("Error reading archive index.");
+    }
+    inFile.seekg(position);
+
+    const std::string aad = footerBytes(footer);
+    std::string encoded(footer.encoded_size, '\0');
+    const uint64_t chunk_count = aeadChunkCount(encoded.size());
+    for (uint64_t chunk = 0; chunk < chunk_count; ++chunk) {
+        size_t offset = chunk * AEAD_CHUNK_SIZE;
+        size_t len = std::min<size_t>(encoded.size() - offset, AEAD_CHUNK_SIZE);
+        if (!aead_open_chunk(key, ARCHIVE_INDEX_ENTRY, static_cast<uint32_t>(chunk), aad,
+                             sealed.data() + chunk * (AEAD_CHUNK_SIZE + AEAD_TAG_SIZE), &encoded[offset], len)) {
+            return false;
+        }
+    }
+
+    std::vector<IndexedEntry> decoded;
+    decoded.reserve(std::min<uint64_t>(footer.entry_count, encoded.size()));
+    size_t pos = 0;
+    uint64_t offset = entries_start;
+    std::string name;
+    int64_t mtime_ns = 0;
+    for (uint32_t i = 0; i < footer.entry_count; ++i) {
+        uint64_t shared = getVarint(encoded, pos);
+        uint64_t suffix = getVarint(encoded, pos);
+        // The suffix is followed by at least the type byte.
+        if (shared > name.size() || suffix >= encoded.size() - pos) {
+            throw std::runtime_error("Archive index is corrupted.");
+        }
+        name.resize(shared);
+        name.append(encoded, pos, suffix);
+        pos += suffix;
+
+        IndexedEntry entry;
+        entry.header.name = name;
+        entry.header.type = static_cast<EntryType>(encoded[pos++]);
+        entry.header.mode = static_cast<uint32_t>(getVarint(encoded, pos));
+        if (encoded.size() - pos < sizeof(entry.header.crc)) {
+            throw std::runtime_error("Archive index is corrupted.");
+        }
+        std::memcpy(&entry.header.crc, &encoded[pos], sizeof(entry.header.crc));
+        pos += sizeof(entry.header.crc);
+        uint64_t zigzag = getVarint(encoded, pos);
+        int64_t delta = static_cast<int64_t>((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+        mtime_ns = static_cast<int64_t>(static_cast<uint64_t>(mtime_ns) + static_cast<uint64_t>(delta));
+        entry.header.mtime_ns = mtime_ns;
+        entry.header.size = getVarint(encoded, pos);
+        entry.offset = offset;
+
+        uint64_t stored = entryHeaderSize(entry.header) + aeadStoredSize(entry.header.size);
+        if (entry.header.size > footer.entries_end || stored > footer.entries_end - offset) {
+            throw std::runtime_error("Archive index does not match the archive's entries.");
+        }
+        offset += stored;
+        decoded.push_back(std::move(entry));
+    }
+    if (pos != encoded.size() || offset != footer.entries_end) {
+        throw std::runtime_error("Archive index does not match the archive's entries.");
+    }
+    entries = std::move(decoded);
+    return true;
+}
@@ -0,0 +1,75 @@
+// === libtzar/tzar_index.h ===
+// The central index of a .tzar2 archive (format version 9): a copy of every entry header,
+// compressed and sealed after the last entry, with a fixed-size footer at the very end of
+// the file. Listing an archive then costs one seek and one small decryption instead of a
+// seek per entry, and never reads any content.
+#ifndef TZAR_INDEX_H
+#define TZAR_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "tzar_crypto.h"
+#include "tzar_format.h"
+
+const char TZAR_INDEX_MAGIC[4] = {'T', 'Z', 'I', 'X'};
+
+// Footer layout: u64 entries_end, u64 encoded_size, u32 entry_count, then TZAR_INDEX_MAGIC.
+const size_t ARCHIVE_INDEX_FOOTER_SIZE = 24;
+
+// Entry index in the nonces of the index chunks; no entry of an archive can have it.
+const uint32_t ARCHIVE_INDEX_ENTRY = UINT32_MAX;
+
+struct ArchiveIndexFooter {
+    uint64_t entries_end = 0;  // Offset of the sealed index, just after the last entry
+    uint64_t encoded_size = 0; // Size of the encoded index before sealing
+    uint32_t entry_count = 0;
+};
+
+// An entry as listed by the index, with the offset of its header in the archive.
+struct IndexedEntry {
+    EntryHeader header;
+    uint64_t offset = 0;
+};
+
+// Encodes the entry headers of an archive in order as they are written. Names are front
+// coded (the length shared with the previous name, then the rest) and numbers stored as
+// varints, modification times as the difference to the previous entry. Entry offsets are
+// not stored: they follow from the header and content sizes.
+class ArchiveIndexBuilder {
+public:
+    // Throws std::runtime_error once the archive has too many entries for the index.
+    void add(const EntryHeader& entry);
+
+    uint32_t entryCount() const { return entry_count_; }
+    const std::string& encoded() const { return encoded_; }
+
+private:
+    std::string encoded_;
+    std::string previous_name_;
+    int64_t previous_mtime_ns_ = 0;
+    uint32_t entry_count_ = 0;
+};
+
+// Seals the index in AEAD_CHUNK_SIZE chunks with 'key' and writes it, then the footer.
+// The footer is the associated data of every chunk. 'entries_end' is the current position
+// of 'outFile', just after the last entry.
+void writeArchiveIndex(std::ostream& outFile, const ArchiveKey& key, uint64_t entries_end,
+                       const ArchiveIndexBuilder& index);
+
+// Reads the footer at the end of a version 9 archive whose first entry starts at
+// 'entries_start', leaving the stream where it was. Throws std::runtime_error if the
+// footer is missing or does not fit the file.
+ArchiveIndexFooter readArchiveIndexFooter(std::istream& inFile, uint64_t entries_start);
+
+// Opens and decodes the index into 'entries'. Returns false if a chunk fails
+// authentication (wrong key or tampered index). Throws std::runtime_error if the index
+// is malformed or does not add up to the entries it describes.
+bool readArchiveIndex(std::istream& inFile, const ArchiveKey& key, const ArchiveIndexFooter& footer,
+                      uint64_t entries_start, std::vector<IndexedEntry>& entries);
+
+#endif // TZAR_INDEX_H
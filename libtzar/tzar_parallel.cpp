@@ -0,0 +1,86 @@
+// === libtzar/tzar_parallel.cpp ===
+#include "tzar_parallel.h"
+
+#include <iomanip> // For std::setw, std::setprecision
+
+ParallelFor::ParallelFor(unsigned threads) {
+    for (unsigned i = 1; i < threads; ++i) {
+        workers_.emplace_back([this] { work(); });
+    }
+}
+
+ParallelFor::~ParallelFor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    start_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ParallelFor::run(size_t count, const std::function<void(size_t)>& fn) {
+    if (workers_.empty() || count < 2) {
+        for (size_t i = 0; i < count; ++i) fn(i);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fn_ = &fn;
+        count_ = count;
+        next_ = 0;
+        active_ = workers_.size();
+        generation_++;
+    }
+    start_.notify_all();
+    for (size_t i; (i = next_++) < count;) {
+        fn(i);
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return active_ == 0; });
+}
+
+void ParallelFor::work() {
+    uint64_t seen = 0;
+    for (;;) {
+        const std::function<void(size_t)>* fn;
+        size_t count;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_.wait(lock, [&] { return stop_ || generation_ != seen; });
+            if (stop_) return;
+            seen = generation_;
+            fn = fn_;
+            count = count_;
+        }
+        for (size_t i; (i = next_++) < count;) {
+            (*fn)(i);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--active_ == 0) {
+            done_.notify_all();
+        }
+    }
+}
+
+void printStageStats(std::ostream& out, const std::vector<const StageStats*>& stages, double wall_seconds) {
+    const StageStats* busiest = nullptr;
+    double busiest_utilization = -1;
+    out << "Stage    Threads     Items         MB    Busy\n";
+    for (const StageStats* stage : stages) {
+        double capacity = wall_seconds * stage->threads();
+        double utilization = capacity > 0 ? stage->busySeconds() / capacity : 0.0;
+        out << std::left << std::setw(8) << stage->name() << std::right << std::setw(8) << stage->threads()
+            << std::setw(10) << stage->items() << std::setw(11) << std::fixed << std::setprecision(1)
+            << stage->bytes() / (1024.0 * 1024.0) << std::setw(7) << utilization * 100 << "%\n";
+        if (utilization > busiest_utilization) {
+            busiest_utilization = utilization;
+            busiest = stage;
+        }
+    }
+    if (busiest != nullptr) {
+        out << "Bottleneck: " << busiest->name() << " (" << std::fixed << std::setprecision(2) << wall_seconds
+            << " s wall time)\n";
+    }
+}
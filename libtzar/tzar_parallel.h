@@ -0,0 +1,122 @@
+// === libtzar/tzar_parallel.h ===
+#ifndef TZAR_PARALLEL_H
+#define TZAR_PARALLEL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs fn(0) ... fn(count - 1) on a fixed set of worker threads plus the caller.
+// 'fn' must not throw.
+class ParallelFor {
+public:
+    explicit ParallelFor(unsigned threads);
+    ~ParallelFor();
+
+    void run(size_t count, const std::function<void(size_t)>& fn);
+
+private:
+    void work();
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_, done_;
+    const std::function<void(size_t)>* fn_ = nullptr;
+    size_t count_ = 0;
+    std::atomic<size_t> next_{0};
+    size_t active_ = 0;
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+};
+
+// --- Pipelines ---
+// Blocking FIFO between two pipeline stages holding at most 'capacity' items, so a fast
+// stage cannot run arbitrarily far ahead of a slow one. push() waits while the queue is
+// full and pop() while it is empty. After close(), push() drops its item and returns
+// false, and pop() returns what is left, then false. Without a capacity push() never
+// waits, for queues whose items are bounded some other way.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity = SIZE_MAX) : capacity_(capacity) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return items_.size() < capacity_ || closed_; });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+        if (items_.empty()) return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+private:
+    const size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_, not_full_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
+
+// Work done by the threads of one pipeline stage. Time spent waiting for input or for
+// room downstream is not counted, so busy time over (threads x wall time) is how much
+// of its capacity the stage used; the busiest stage is the bottleneck.
+class StageStats {
+public:
+    StageStats(const char* name, unsigned threads) : name_(name), threads_(threads) {}
+
+    // Records 'items' items (of 'bytes' bytes) that took 'busy' to process.
+    void add(std::chrono::steady_clock::duration busy, uint64_t bytes = 0, uint64_t items = 1) {
+        busy_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count();
+        items_ += items;
+        bytes_ += bytes;
+    }
+
+    const char* name() const { return name_; }
+    unsigned threads() const { return threads_; }
+    uint64_t items() const { return items_; }
+    uint64_t bytes() const { return bytes_; }
+    double busySeconds() const { return busy_ns_ / 1e9; }
+
+private:
+    const char* name_;
+    unsigned threads_;
+    std::atomic<uint64_t> busy_ns_{0};
+    std::atomic<uint64_t> items_{0};
+    std::atomic<uint64_t> bytes_{0};
+};
+
+// Prints one line per stage (threads, items, bytes, utilization over 'wall_seconds')
+// and names the busiest stage.
+void printStageStats(std::ostream& out, const std::vector<const StageStats*>& stages, double wall_seconds);
+
+#endif // TZAR_PARALLEL_H
@@ -0,0 +1,39 @@
+// === libtzar/tzar_seal.cpp ===
+#include "tzar_seal.h"
+
+#include <cerrno>    // For errno
+#include <cstring>   // For std::strerror
+#include <stdexcept> // For std::runtime_error
+#include <sys/random.h> // For getrandom()
+
+#include "tzar_agent_protocol.h"
+
+NewArchiveKey newArchiveKey(CipherId cipher, const std::string& password, uint32_t kdf_iterations,
+                            const std::string& agent_socket) {
+    // A fresh nonce per archive means the same password never reuses a keystream.
+    NewArchiveKey archive;
+    EncryptedArchiveHeader& header = archive.header;
+    header.version = TZAR2_FORMAT_VERSION;
+    header.cipher = cipher;
+    std::vector<uint8_t> data_key(DATA_KEY_SIZE);
+    if (getrandom(header.nonce, sizeof(header.nonce), 0) != static_cast<ssize_t>(sizeof(header.nonce)) ||
+        getrandom(header.kdf.salt, sizeof(header.kdf.salt), 0) != static_cast<ssize_t>(sizeof(header.kdf.salt)) ||
+        getrandom(data_key.data(), data_key.size(), 0) != static_cast<ssize_t>(data_key.size())) {
+        throw std::runtime_error(std::string("Could not obtain random bytes: ") + std::strerror(errno));
+    }
+
+    std::vector<uint8_t> master_key;
+    if (!agent_socket.empty()) {
+        // The agent's salt is shared by every archive it keys; the per-archive nonce
+        // still gives each archive its own cipher key.
+        master_key = agentNewKey(agent_socket, header.kdf);
+        archive.from_agent = true;
+    } else {
+        header.kdf.kdf = KDF_PBKDF2_HMAC_SHA256;
+        header.kdf.iterations = kdf_iterations != 0 ? kdf_iterations : KDF_DEFAULT_ITERATIONS;
+        master_key = deriveMasterKey(password, header.kdf);
+    }
+    wrapDataKey(master_key, header, data_key, header.wrapped_key);
+    archive.key = deriveArchiveKey(cipher, data_key, header.nonce, TZAR2_FORMAT_VERSION);
+    return archive;
+}
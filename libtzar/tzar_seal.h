@@ -0,0 +1,28 @@
+// === libtzar/tzar_seal.h ===
+// Writing .tzar2 archives: the key of a new archive. Shared by tzar_encrypt and
+// simple_archiver --encrypt.
+#ifndef TZAR_SEAL_H
+#define TZAR_SEAL_H
+
+#include <cstdint>
+#include <string>
+
+#include "tzar_crypto.h"
+#include "tzar_format.h"
+
+// Header and cipher key of a new .tzar2 archive.
+struct NewArchiveKey {
+    EncryptedArchiveHeader header;
+    ArchiveKey key;
+    bool from_agent = false;
+};
+
+// Draws a fresh nonce and salt and stretches 'password' with PBKDF2 ('kdf_iterations',
+// or KDF_DEFAULT_ITERATIONS if 0). If 'agent_socket' is not empty the key agent there
+// supplies the master key and its KDF parameters instead and 'password' is ignored.
+// The content key comes from a random data key, stored in the header wrapped by the
+// master key. Throws std::runtime_error.
+NewArchiveKey newArchiveKey(CipherId cipher, const std::string& password, uint32_t kdf_iterations,
+                            const std::string& agent_socket);
+
+#endif // TZAR_SEAL_H
@@ -6,37 +6,506 @@
 #include <cstdint>   // For fixed-width integer types (uint32_t, uint64_t)
 #include <filesystem> // For directory traversal (C++17)
 #include <map>       // For mapping items to their base paths
+#include <set>       // For the multiply-linked files that could not be read
+#include <cstring>   // For std::memcpy
+#include <sys/stat.h> // For lstat() (entry type, mode and modification time)
+#include <fcntl.h>   // For open()
+#include <unistd.h>  // For lseek(), pread(), close()
+#include <algorithm> // For std::max
+#include <cstdlib>   // For std::atoi, std::strtoul, std::getenv
+#include <stdexcept> // For std::runtime_error
+#include <thread>    // For std::thread::hardware_concurrency
+#include <memory>    // For std::shared_ptr
+#include <functional> // For std::function
+#include <chrono>    // For stage timing
+#include <mutex>     // For std::mutex, std::lock_guard
+#include <condition_variable> // For std::condition_variable
+#include <atomic>    // For std::atomic
+
+#include "libtzar/tzar_format.h" // Archive layout, readers, writers and CRC-32C
+#include "libtzar/tzar_agent_protocol.h" // AGENT_SOCKET_ENV
+#include "libtzar/tzar_seal.h"   // Keys of new .tzar2 archives for --encrypt
+#include "libtzar/tzar_parallel.h" // Pipeline queues and stage statistics
+#include "libtzar/tzar_index.h"  // The sealed index ending a .tzar2 archive
 
 namespace fs = std::filesystem; // Alias for std::filesystem
 
-// Function to write a string to an output file stream.
-// It first writes the length of the string (as uint32_t), then the string data itself.
-void writeString(std::ofstream& outFile, const std::string& str) {
-    uint32_t len = str.length(); // Get the length of the string
-    // Write the length (4 bytes)
-    outFile.write(reinterpret_cast<const char*>(&len), sizeof(len));
-    // Write the string data
-    outFile.write(str.c_str(), len);
+// Function to read a whole regular file into 'content'. Returns false on error.
+bool readFileContent(const fs::path& itemPath, std::vector<char>& content) {
+    std::ifstream inputFile(itemPath, std::ios::binary | std::ios::ate); // Open in binary and at end for size
+    if (!inputFile.is_open()) {
+        std::cerr << "Warning: Could not open input file: " << itemPath << ". Skipping.\n";
+        return false;
+    }
+
+    uint64_t fileSize = inputFile.tellg();
+    inputFile.seekg(0, std::ios::beg); // Go back to the beginning of the file
+
+    content.resize(fileSize);
+    if (fileSize > 0) {
+        inputFile.read(content.data(), fileSize);
+        if (!inputFile) {
+            std::cerr << "Warning: Error reading file: " << itemPath << ". Data might be incomplete. Skipping.\n";
+            return false;
+        }
+    }
+    return true;
 }
 
-// Function to write binary data (from a vector of chars) to an output file stream.
-// It first writes the size of the data (as uint64_t), then the data itself.
-void writeBinaryData(std::ofstream& outFile, const std::vector<char>& data) {
-    uint64_t size = data.size(); // Get the size of the binary data
-    // Write the size (8 bytes)
-    outFile.write(reinterpret_cast<const char*>(&size), sizeof(size));
-    // Write the binary data
-    outFile.write(data.data(), size);
+// Function to build the payload of an ENTRY_SPARSE entry from a file with holes:
+// logical size (uint64_t), segment count (uint32_t), (offset, length) pairs (uint64_t each),
+// followed by the data of each segment. Returns false if the file has no holes worth
+// recording, in which case it should be archived as a regular file.
+bool readSparseContent(const fs::path& itemPath, const struct stat& st, std::vector<char>& payload) {
+    int fd = open(itemPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> segments;
+    uint64_t data_bytes = 0;
+    off_t pos = 0;
+    while (pos < st.st_size) {
+        off_t data_start = lseek(fd, pos, SEEK_DATA);
+        if (data_start < 0) break; // ENXIO: only a hole remains
+        off_t data_end = lseek(fd, data_start, SEEK_HOLE);
+        if (data_end < 0) data_end = st.st_size;
+        segments.emplace_back(data_start, data_end - data_start);
+        data_bytes += data_end - data_start;
+        pos = data_end;
+    }
+    if (data_bytes == static_cast<uint64_t>(st.st_size)) {
+        close(fd); // No holes after all (or SEEK_DATA unsupported)
+        return false;
+    }
+
+    uint64_t logical_size = st.st_size;
+    uint32_t segment_count = segments.size();
+    size_t map_bytes = sizeof(logical_size) + sizeof(segment_count) + segments.size() * 2 * sizeof(uint64_t);
+    payload.resize(map_bytes + data_bytes);
+    char* out = payload.data();
+    std::memcpy(out, &logical_size, sizeof(logical_size));
+    out += sizeof(logical_size);
+    std::memcpy(out, &segment_count, sizeof(segment_count));
+    out += sizeof(segment_count);
+    for (const auto& segment : segments) {
+        std::memcpy(out, &segment.first, sizeof(uint64_t));
+        std::memcpy(out + sizeof(uint64_t), &segment.second, sizeof(uint64_t));
+        out += 2 * sizeof(uint64_t);
+    }
+    for (const auto& segment : segments) {
+        uint64_t done = 0;
+        while (done < segment.second) {
+            ssize_t n = pread(fd, out, segment.second - done, segment.first + done);
+            if (n <= 0) {
+                close(fd);
+                return false;
+            }
+            out += n;
+            done += n;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+// --- Archiving pipeline ---
+// walk -> read -> seal -> write, each stage on its own threads. The walk lstat()s the
+// items in order and decides what each becomes. Reader threads load and checksum file
+// contents. Entries are then numbered in walk order, skipping files that could not be
+// read, since an entry's number is part of every chunk nonce. Sealer threads encrypt
+// .tzar2 content a batch of AEAD_BATCH_CHUNKS chunks at a time, so one large file is spread
+// over all of them. The writer writes the entries in order. The queues between the stages
+// are bounded, and the walk waits while ARCHIVE_INFLIGHT_BYTES of content are on their
+// way to the writer, so memory use does not depend on the input.
+
+const size_t ARCHIVE_INFLIGHT_BYTES = 256 << 20;
+const size_t ARCHIVE_QUEUE_ENTRIES = 1024; // Between the walk and the readers, and before the writer
+const size_t ARCHIVE_SEAL_TASKS_PER_THREAD = 4;
+
+// An item on its way through the pipeline.
+struct PendingEntry {
+    uint64_t sequence = 0;       // Position in the walk
+    EntryHeader header;          // Checksum and size are filled in once the content is known
+    fs::path path;               // Regular file for a reader to load; empty if the walk set 'content'
+    struct stat st = {};         // Of 'path'
+    bool try_sparse = false;     // 'path' has holes worth storing as ENTRY_SPARSE
+    fs::path link_path;          // ENTRY_HARDLINK: the link, stored as a file if its target is skipped
+    std::vector<char> content;
+    std::string message;         // Printed when the entry is written
+    bool skipped = false;        // Could not be read; nothing is written
+    size_t budget = 0;           // Share of ARCHIVE_INFLIGHT_BYTES held until written
+    uint32_t entry_index = 0;
+    std::string header_bytes;    // As written, and the associated data of every chunk
+    std::vector<char> sealed;    // .tzar2 only
+    std::atomic<size_t> batches_left{0};
+};
+
+typedef std::shared_ptr<PendingEntry> EntryPtr;
+
+// A batch of chunks of one entry for a sealer.
+struct SealTask {
+    EntryPtr entry;
+    uint64_t first_chunk = 0;
+    size_t count = 0;
+};
+
+// Bytes of content between the walk and the writer. An entry larger than the whole
+// budget takes all of it.
+class ByteBudget {
+public:
+    explicit ByteBudget(size_t capacity) : capacity_(capacity) {}
+
+    // Returns the amount taken, or 0 once closed.
+    size_t acquire(size_t bytes) {
+        bytes = std::max<size_t>(1, std::min(bytes, capacity_));
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return used_ + bytes <= capacity_ || closed_; });
+        if (closed_) return 0;
+        used_ += bytes;
+        return bytes;
+    }
+
+    void release(size_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            used_ -= bytes;
+        }
+        cv_.notify_all();
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        cv_.notify_all();
+    }
+
+private:
+    const size_t capacity_;
+    size_t used_ = 0;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+class ArchivePipeline {
+public:
+    // 'key' is set for a .tzar2 archive, whose entries are then sealed.
+    ArchivePipeline(std::ofstream& file, const ArchiveKey* key, unsigned read_threads, unsigned seal_threads)
+        : file_(file), key_(key), read_threads_(std::max(1u, read_threads)),
+          seal_threads_(key != nullptr ? std::max(1u, seal_threads) : 0),
+          budget_(ARCHIVE_INFLIGHT_BYTES), to_read_(ARCHIVE_QUEUE_ENTRIES),
+          to_seal_(std::max(1u, seal_threads_) * ARCHIVE_SEAL_TASKS_PER_THREAD), to_write_(ARCHIVE_QUEUE_ENTRIES),
+          walk_stats_("walk", 1), read_stats_("read", read_threads_), seal_stats_("seal", seal_threads_),
+          write_stats_("write", 1) {}
+
+    // Runs every stage; 'walk' produces the entries through add(). Throws
+    // std::runtime_error with the first error of any stage; the output is then incomplete.
+    void run(const std::function<void()>& walk) {
+        auto start = std::chrono::steady_clock::now();
+        std::thread walker([&] {
+            stage([&] {
+                walk();
+                // Time spent waiting in add() was not walking.
+                walk_stats_.add(std::chrono::steady_clock::now() - start - walk_blocked_, 0, walked_);
+            });
+            to_read_.close();
+        });
+        readers_running_ = read_threads_;
+        std::vector<std::thread> readers;
+        for (unsigned i = 0; i < read_threads_; ++i) {
+            readers.emplace_back([this] {
+                stage([this] { readEntries(); });
+                {
+                    std::lock_guard<std::mutex> lock(ready_mutex_);
+                    readers_running_--;
+                }
+                ready_cv_.notify_all();
+            });
+        }
+        std::vector<std::thread> sealers;
+        for (unsigned i = 0; i < seal_threads_; ++i) {
+            sealers.emplace_back([this] { stage([this] { sealBatches(); }); });
+        }
+        std::thread writer([this] { stage([this] { writeEntries(); }); });
+
+        stage([this] { numberEntries(); });
+        to_seal_.close();
+        to_write_.close();
+        walker.join();
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        for (auto& sealer : sealers) {
+            sealer.join();
+        }
+        writer.join();
+        wall_seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (failed_) {
+            throw std::runtime_error(error_);
+        }
+    }
+
+    // Queues an entry from the walk. Entries without a 'path' carry their content.
+    void add(EntryPtr entry) {
+        auto start = std::chrono::steady_clock::now();
+        entry->sequence = walked_++;
+        if (!entry->path.empty()) {
+            uint64_t size = static_cast<uint64_t>(entry->st.st_size);
+            entry->budget = budget_.acquire(key_ != nullptr ? 2 * size : size); // Plus the sealed copy
+        }
+        to_read_.push(std::move(entry));
+        walk_blocked_ += std::chrono::steady_clock::now() - start;
+    }
+
+    // Headers of the entries written; complete once run() has returned.
+    const ArchiveIndexBuilder& index() const { return index_; }
+
+    void printStats(std::ostream& out) const {
+        std::vector<const StageStats*> stages = {&walk_stats_, &read_stats_};
+        if (key_ != nullptr) stages.push_back(&seal_stats_);
+        stages.push_back(&write_stats_);
+        printStageStats(out, stages, wall_seconds_);
+    }
+
+private:
+    // Runs a stage; an error in any of them stops all of them.
+    void stage(const std::function<void()>& fn) {
+        try {
+            fn();
+        } catch (const std::exception& e) {
+            {
+                std::lock_guard<std::mutex> lock(error_mutex_);
+                if (!failed_) error_ = e.what();
+                failed_ = true;
+            }
+            budget_.close();
+            to_read_.close();
+            to_seal_.close();
+            to_write_.close();
+            // Taking the locks orders the notifications after any check of 'failed_' in
+            // a waiter that has not gone to sleep yet.
+            { std::lock_guard<std::mutex> lock(ready_mutex_); }
+            ready_cv_.notify_all();
+            { std::lock_guard<std::mutex> lock(sealed_mutex_); }
+            sealed_cv_.notify_all();
+        }
+    }
+
+    // Read stage: loads file contents and checksums every entry.
+    void readEntries() {
+        EntryPtr entry;
+        while (to_read_.pop(entry) && !failed_) {
+            auto start = std::chrono::steady_clock::now();
+            if (!entry->path.empty()) {
+                const std::string name = entry->header.name;
+                if (entry->try_sparse && readSparseContent(entry->path, entry->st, entry->content)) {
+                    entry->header.type = ENTRY_SPARSE;
+                    entry->message = "Archiving sparse file: " + name + " (" + std::to_string(entry->st.st_size) +
+                                     " bytes)";
+                } else if (readFileContent(entry->path, entry->content)) {
+                    entry->message = "Archiving file: " + name + " (" + std::to_string(entry->content.size()) +
+                                     " bytes)";
+                } else {
+                    entry->skipped = true;
+                }
+            }
+            entry->header.size = entry->content.size();
+            entry->header.crc = crc32c_update(0, entry->content.data(), entry->content.size());
+            read_stats_.add(std::chrono::steady_clock::now() - start, entry->content.size());
+            {
+                std::lock_guard<std::mutex> lock(ready_mutex_);
+                ready_[entry->sequence] = std::move(entry);
+            }
+            ready_cv_.notify_all();
+        }
+    }
+
+    // Runs on the caller of run(): numbers the entries in walk order as the readers finish
+    // them and hands them to the sealers and the writer.
+    void numberEntries() {
+        for (uint64_t sequence = 0;; ++sequence) {
+            EntryPtr entry;
+            {
+                std::unique_lock<std::mutex> lock(ready_mutex_);
+                ready_cv_.wait(lock, [&] { return ready_.count(sequence) || readers_running_ == 0 || failed_; });
+                auto it = ready_.find(sequence);
+                if (it == ready_.end() || failed_) return;
+                entry = std::move(it->second);
+                ready_.erase(it);
+            }
+            if (entry->header.type == ENTRY_HARDLINK && !resolveHardLink(*entry)) {
+                continue;
+            }
+            if (entry->skipped) {
+                if (entry->st.st_nlink > 1) {
+                    skipped_link_targets_.insert(entry->header.name); // Later links need another name
+                }
+                budget_.release(entry->budget);
+                continue;
+            }
+            if (entry_count_ == UINT32_MAX) {
+                throw std::runtime_error("Too many entries to archive.");
+            }
+            entry->entry_index = entry_count_++;
+            entry->header_bytes = entryHeaderBytes(entry->header);
+            if (key_ != nullptr) {
+                const uint64_t chunk_count = aeadChunkCount(entry->header.size);
+                if (chunk_count > UINT32_MAX) {
+                    throw std::runtime_error("Entry '" + entry->header.name + "' is too large to encrypt.");
+                }
+                index_.add(entry->header);
+                entry->sealed.resize(aeadStoredSize(entry->header.size));
+                entry->batches_left = (chunk_count + AEAD_BATCH_CHUNKS - 1) / AEAD_BATCH_CHUNKS;
+                if (!to_write_.push(entry)) return;
+                for (uint64_t first = 0; first < chunk_count; first += AEAD_BATCH_CHUNKS) {
+                    SealTask task;
+                    task.entry = entry;
+                    task.first_chunk = first;
+                    task.count = std::min<uint64_t>(AEAD_BATCH_CHUNKS, chunk_count - first);
+                    if (!to_seal_.push(std::move(task))) return;
+                }
+            } else if (!to_write_.push(std::move(entry))) {
+                return;
+            }
+        }
+    }
+
+    // Numbering stage: points a hard link at a name that is actually in the archive. The walk
+    // links to the first name of an inode, but that file may have failed to read. The first
+    // later link is then stored as the file itself (read here, outside the byte budget; this
+    // only happens when a file vanishes or becomes unreadable during the walk), and the
+    // links after it point at it. Returns false if the link has to be skipped as well.
+    bool resolveHardLink(PendingEntry& entry) {
+        const std::string target(entry.content.begin(), entry.content.end());
+        const std::string& name = entry.header.name;
+        auto substitute = link_substitutes_.find(target);
+        if (substitute != link_substitutes_.end()) {
+            entry.content.assign(substitute->second.begin(), substitute->second.end());
+            entry.message = "Archiving hard link: " + name + " -> " + substitute->second;
+        } else if (skipped_link_targets_.count(target)) {
+            if (!readFileContent(entry.link_path, entry.content)) {
+                return false;
+            }
+            entry.header.type = ENTRY_FILE;
+            entry.message = "Archiving file: " + name + " (" + std::to_string(entry.content.size()) + " bytes)";
+            link_substitutes_[target] = name;
+        } else {
+            return true;
+        }
+        entry.header.size = entry.content.size();
+        entry.header.crc = crc32c_update(0, entry.content.data(), entry.content.size());
+        return true;
+    }
+
+    // Seal stage: encrypts batches of chunks of any entry into its sealed buffer.
+    void sealBatches() {
+        SealTask task;
+        while (to_seal_.pop(task) && !failed_) {
+            auto start = std::chrono::steady_clock::now();
+            PendingEntry& entry = *task.entry;
+            size_t bytes = 0;
+            for (size_t i = 0; i < task.count; ++i) {
+                uint64_t chunk = task.first_chunk + i;
+                size_t offset = chunk * AEAD_CHUNK_SIZE;
+                size_t len = std::min<uint64_t>(entry.header.size - offset, AEAD_CHUNK_SIZE);
+                aead_seal_chunk(*key_, entry.entry_index, static_cast<uint32_t>(chunk), entry.header_bytes,
+                                entry.content.data() + offset,
+                                entry.sealed.data() + chunk * (AEAD_CHUNK_SIZE + AEAD_TAG_SIZE), len);
+                bytes += len;
+            }
+            seal_stats_.add(std::chrono::steady_clock::now() - start, bytes);
+            if (entry.batches_left.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(sealed_mutex_);
+                sealed_cv_.notify_all();
+            }
+            task.entry.reset();
+        }
+    }
+
+    // Write stage: writes each entry once it is sealed, in walk order.
+    void writeEntries() {
+        EntryPtr entry;
+        while (to_write_.pop(entry) && !failed_) {
+            if (key_ != nullptr) {
+                std::unique_lock<std::mutex> lock(sealed_mutex_);
+                sealed_cv_.wait(lock, [&] { return entry->batches_left == 0 || failed_; });
+                if (failed_) return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            const std::vector<char>& stored = key_ != nullptr ? entry->sealed : entry->content;
+            file_.write(entry->header_bytes.data(), entry->header_bytes.size());
+            file_.write(stored.data(), stored.size());
+            if (!file_) {
+                throw std::runtime_error("Error writing output archive.");
+            }
+            if (!entry->message.empty()) {
+                std::cout << entry->message << "\n";
+            }
+            write_stats_.add(std::chrono::steady_clock::now() - start, stored.size());
+            budget_.release(entry->budget);
+            entry.reset();
+        }
+    }
+
+    std::ofstream& file_;
+    const ArchiveKey* key_;
+    const unsigned read_threads_;
+    const unsigned seal_threads_;
+    ByteBudget budget_;
+    BoundedQueue<EntryPtr> to_read_;
+    BoundedQueue<SealTask> to_seal_;
+    BoundedQueue<EntryPtr> to_write_;
+    uint64_t walked_ = 0; // Walk thread only
+    std::chrono::steady_clock::duration walk_blocked_{0};
+
+    // Entries the readers have finished, by walk position, until they are numbered.
+    std::mutex ready_mutex_;
+    std::condition_variable ready_cv_;
+    std::map<uint64_t, EntryPtr> ready_;
+    unsigned readers_running_ = 0;
+    uint32_t entry_count_ = 0;
+    ArchiveIndexBuilder index_;
+    std::set<std::string> skipped_link_targets_;          // Multiply-linked files not archived
+    std::map<std::string, std::string> link_substitutes_; // ... and the link stored in their place
+
+    std::mutex sealed_mutex_; // Signals entries whose last batch is sealed
+    std::condition_variable sealed_cv_;
+
+    StageStats walk_stats_, read_stats_, seal_stats_, write_stats_;
+    double wall_seconds_ = 0;
+    std::atomic<bool> failed_{false};
+    std::mutex error_mutex_;
+    std::string error_;
+};
+
+// Function to queue an entry whose content the walk already has (directories and links).
+void queueEntry(ArchivePipeline& pipeline, const std::string& name, EntryType type, uint32_t mode,
+                std::vector<char> content, int64_t mtime_ns, std::string message) {
+    EntryPtr entry = std::make_shared<PendingEntry>();
+    entry->header.name = name;
+    entry->header.type = type;
+    entry->header.mode = mode;
+    entry->header.mtime_ns = mtime_ns;
+    entry->content = std::move(content);
+    entry->message = std::move(message);
+    pipeline.add(std::move(entry));
 }
 
-// Function to archive a single file or an empty directory.
-// It takes the output archive stream, the full path to the item, and the base path
-// to calculate the relative path.
-void archiveItem(std::ofstream& outputArchive, const fs::path& itemPath, const fs::path& basePath) {
+// Function to archive a single file, directory, symbolic link or hard link.
+// It takes the archiving pipeline, the full path to the item, the base path
+// to calculate the relative path, and the map of multiply-linked files seen so far
+// (used to store later links to the same inode as ENTRY_HARDLINK).
+void archiveItem(ArchivePipeline& pipeline, const fs::path& itemPath, const fs::path& basePath,
+                 std::map<std::pair<dev_t, ino_t>, std::string>& hardLinks) {
     // Calculate the relative path of the item within the base directory.
     // This is crucial for recreating the directory structure during unarchiving.
-    // Use fs::relative with the correct base path.
-    fs::path relativePath = fs::relative(itemPath, basePath);
+    // Only the parent is canonicalized: fs::relative() would resolve the item itself,
+    // recording a symlink under its target's name.
+    fs::path parentPath = itemPath.has_parent_path() ? itemPath.parent_path() : fs::current_path();
+    fs::path relativePath = (fs::canonical(parentPath) / itemPath.filename()).lexically_relative(basePath);
     
     // Ensure relativePath is not empty for the root item if basePath is its parent
     // If relativePath is ".", convert it to the item's name
@@ -44,51 +513,126 @@ void archiveItem(std::ofstream& outputArchive, const fs::path& itemPath, const f
         relativePath = itemPath.filename();
     }
 
-    if (fs::is_regular_file(itemPath)) {
-        // Handle regular files
-        std::ifstream inputFile(itemPath, std::ios::binary | std::ios::ate); // Open in binary and at end for size
-        if (!inputFile.is_open()) {
-            std::cerr << "Warning: Could not open input file: " << itemPath << ". Skipping.\n";
-            return;
-        }
-
-        uint64_t fileSize = inputFile.tellg();
-        inputFile.seekg(0, std::ios::beg); // Go back to the beginning of the file
+    // One lstat() gives the type, permissions and mtime; symlinks are not followed.
+    struct stat st;
+    if (lstat(itemPath.c_str(), &st) != 0) {
+        std::cerr << "Warning: Could not stat: " << itemPath << ". Skipping.\n";
+        return;
+    }
+    uint32_t mode = st.st_mode & 07777;
+    int64_t mtime_ns = statModificationTimeNs(st);
 
-        std::vector<char> fileContent(fileSize);
-        if (fileSize > 0) {
-            inputFile.read(fileContent.data(), fileSize);
-            if (!inputFile) {
-                std::cerr << "Warning: Error reading file: " << itemPath << ". Data might be incomplete. Skipping.\n";
-                inputFile.close();
+    if (S_ISREG(st.st_mode)) {
+        // Later links to an inode we've already archived only record the first name.
+        if (st.st_nlink > 1) {
+            auto inode = std::make_pair(st.st_dev, st.st_ino);
+            auto it = hardLinks.find(inode);
+            if (it != hardLinks.end()) {
+                EntryPtr link = std::make_shared<PendingEntry>();
+                link->header.name = relativePath.string();
+                link->header.type = ENTRY_HARDLINK;
+                link->header.mode = mode;
+                link->header.mtime_ns = mtime_ns;
+                link->content.assign(it->second.begin(), it->second.end());
+                link->message = "Archiving hard link: " + relativePath.string() + " -> " + it->second;
+                link->link_path = itemPath;
+                pipeline.add(std::move(link));
                 return;
             }
+            hardLinks[inode] = relativePath.string();
         }
-        inputFile.close();
 
-        std::cout << "Archiving file: " << relativePath.string() << " (" << fileSize << " bytes)\n";
-        writeString(outputArchive, relativePath.string()); // Write relative filename
-        writeBinaryData(outputArchive, fileContent);       // Write file content
-    } else if (fs::is_directory(itemPath)) {
-        // Handle directories: write an empty content to signify a directory entry.
-        // This is important for recreating empty directories or parent directories.
-        std::cout << "Archiving directory: " << relativePath.string() << "\n";
-        writeString(outputArchive, relativePath.string()); // Write relative directory path
-        writeBinaryData(outputArchive, {}); // Write empty content for directories
+        // Handle regular files: a reader thread loads the content.
+        EntryPtr entry = std::make_shared<PendingEntry>();
+        entry->header.name = relativePath.string();
+        entry->header.type = ENTRY_FILE;
+        entry->header.mode = mode;
+        entry->header.mtime_ns = mtime_ns;
+        entry->path = itemPath;
+        entry->st = st;
+        // Files occupying fewer blocks than their size have holes; store only the data.
+        entry->try_sparse = static_cast<uint64_t>(st.st_blocks) * 512 < static_cast<uint64_t>(st.st_size);
+        pipeline.add(std::move(entry));
+    } else if (S_ISDIR(st.st_mode)) {
+        // Handle directories: no content. This is important for recreating
+        // empty directories or parent directories.
+        queueEntry(pipeline, relativePath.string(), ENTRY_DIRECTORY, mode, {}, mtime_ns,
+                   "Archiving directory: " + relativePath.string());
+    } else if (S_ISLNK(st.st_mode)) {
+        // Handle symbolic links: the content is the link target.
+        std::string target = fs::read_symlink(itemPath).string();
+        std::vector<char> payload(target.begin(), target.end());
+        queueEntry(pipeline, relativePath.string(), ENTRY_SYMLINK, mode, std::move(payload), mtime_ns,
+                   "Archiving symlink: " + relativePath.string() + " -> " + target);
+    } else {
+        std::cerr << "Warning: Skipping unsupported item: " << itemPath << " (device, FIFO or socket).\n";
     }
 }
 
 int main(int argc, char* argv[]) {
-    // Usage: ./simple_archiver <output_archive_name> <input_path1> [input_path2 ...]
-    // The output_archive_name will always have the .tzar extension.
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <output_archive_base_name> <input_file_or_directory1> [input_file_or_directory2 ...]\n";
+    // Usage: ./simple_archiver [--read-threads=N] [--stats] [--encrypt [--threads=N] [--cipher=NAME]
+    //            [--kdf-iterations=N]] <output_archive_name> <input_path1> [input_path2 ...]
+    // The output_archive_name will always have the .tzar extension (.tzar2 with --encrypt).
+    bool encrypt = false;
+    bool print_stats = false;
+    unsigned thread_count = std::max(1u, std::thread::hardware_concurrency()); // Sealer threads
+    unsigned read_threads = std::min(4u, thread_count);
+    CipherId cipher = aes_gcm_supported() ? CIPHER_AES_256_GCM : CIPHER_XCHACHA20_POLY1305;
+    uint32_t kdf_iterations = 0; // 0: KDF_DEFAULT_ITERATIONS, or the agent's setting
+    std::string encrypt_option; // The last option that only applies with --encrypt
+    int firstArg = 1;
+    for (; firstArg < argc && std::string(argv[firstArg]).rfind("--", 0) == 0; ++firstArg) {
+        std::string arg = argv[firstArg];
+        if (arg == "--encrypt") {
+            encrypt = true;
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            thread_count = std::max(1, std::atoi(arg.c_str() + 10));
+            encrypt_option = "--threads";
+        } else if (arg.rfind("--read-threads=", 0) == 0) {
+            read_threads = std::max(1, std::atoi(arg.c_str() + 15));
+        } else if (arg == "--stats") {
+            print_stats = true;
+        } else if (arg == "--cipher=aes-256-gcm") {
+            if (!aes_gcm_supported()) {
+                std::cerr << "Error: AES-256-GCM needs a CPU with AES-NI and PCLMULQDQ.\n";
+                return 1;
+            }
+            cipher = CIPHER_AES_256_GCM;
+            encrypt_option = "--cipher";
+        } else if (arg == "--cipher=xchacha20-poly1305") {
+            cipher = CIPHER_XCHACHA20_POLY1305;
+            encrypt_option = "--cipher";
+        } else if (arg.rfind("--kdf-iterations=", 0) == 0) {
+            kdf_iterations = static_cast<uint32_t>(std::strtoul(arg.c_str() + 17, nullptr, 10));
+            if (kdf_iterations < KDF_MIN_ITERATIONS) {
+                std::cerr << "Error: --kdf-iterations must be at least " << KDF_MIN_ITERATIONS << ".\n";
+                return 1;
+            }
+            encrypt_option = "--kdf-iterations";
+        } else {
+            std::cerr << "Error: Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (argc - firstArg < 2) {
+        std::cerr << "Usage: " << argv[0] << " [--read-threads=N] [--stats] [--encrypt [--threads=N]"
+                  << " [--cipher=aes-256-gcm|xchacha20-poly1305] [--kdf-iterations=N]]"
+                  << " <output_archive_base_name> <input_file_or_directory1> [input_file_or_directory2 ...]\n";
+        std::cerr << "--read-threads sets the threads loading files, --threads those sealing them;"
+                  << " --stats shows how busy each stage was.\n";
+        std::cerr << "With --encrypt the key comes from the tzar_agent named by " << AGENT_SOCKET_ENV
+                  << ", or the password is prompted.\n";
+        return 1;
+    }
+    if (!encrypt && !encrypt_option.empty()) {
+        std::cerr << "Error: " << encrypt_option << " only applies with --encrypt"
+                  << (encrypt_option == "--threads" ? "; --read-threads sets the threads loading files.\n" : ".\n");
         return 1;
     }
 
     // Get the base name from the first argument (e.g., "my_archive" from "my_archive" or "my_archive.zip")
-    fs::path providedOutputPath(argv[1]);
-    std::string outputArchiveName = providedOutputPath.stem().string() + ".tzar";
+    fs::path providedOutputPath(argv[firstArg]);
+    std::string outputArchiveName = providedOutputPath.stem().string() + (encrypt ? ".tzar2" : ".tzar");
     
     // Vector to store paths of items that will actually be archived
     std::vector<fs::path> itemsToArchive;
@@ -96,7 +640,7 @@ int main(int argc, char* argv[]) {
     std::map<fs::path, fs::path> itemBasePaths;
 
     // First pass: Collect all valid files and directories to be archived
-    for (int i = 2; i < argc; ++i) {
+    for (int i = firstArg + 1; i < argc; ++i) {
         fs::path inputPath = argv[i];
         
         if (!fs::exists(inputPath)) {
@@ -113,7 +657,8 @@ int main(int argc, char* argv[]) {
         }
         basePath = fs::canonical(basePath); // Ensure basePath is canonical
 
-        if (fs::is_regular_file(inputPath)) {
+        if (fs::is_symlink(inputPath) || fs::is_regular_file(inputPath)) {
+            // Symlinks given on the command line are archived as links, not followed.
             itemsToArchive.push_back(inputPath);
             itemBasePaths[inputPath] = basePath;
         } else if (fs::is_directory(inputPath)) {
@@ -136,22 +681,77 @@ int main(int argc, char* argv[]) {
         return 0; // Exit successfully, but without creating an archive
     }
 
+    // With --encrypt, get the key before anything is written.
+    NewArchiveKey newKey;
+    if (encrypt) {
+        const char* agentSocket = std::getenv(AGENT_SOCKET_ENV);
+        bool useAgent = agentSocket != nullptr && *agentSocket != '\0';
+        if (useAgent && kdf_iterations != 0) {
+            std::cerr << "Error: --kdf-iterations has no effect with the key agent; pass it to tzar_agent instead.\n";
+            return 1;
+        }
+        std::string password;
+        if (!useAgent) {
+            std::cout << "Enter password for encryption: ";
+            std::getline(std::cin, password);
+            if (password.empty()) {
+                std::cerr << "Error: Password cannot be empty for encryption.\n";
+                return 1;
+            }
+        }
+        try {
+            newKey = newArchiveKey(cipher, password, kdf_iterations, useAgent ? agentSocket : "");
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
     // If there are items to archive, proceed to open the output file and write
     std::ofstream outputArchive(outputArchiveName, std::ios::binary);
     if (!outputArchive.is_open()) {
         std::cerr << "Error: Could not open output archive file: " << outputArchiveName << std::endl;
         return 1;
     }
+    if (encrypt) {
+        writeEncryptedArchiveHeader(outputArchive, newKey.header);
+        const KdfParams& kdf = newKey.header.kdf;
+        std::cout << "Cipher: " << cipherName(cipher) << ", key derivation: " << kdfName(kdf.kdf) << " ("
+                  << kdf.iterations << " iterations" << (newKey.from_agent ? ", from key agent" : "") << ")\n";
+    } else {
+        writeArchiveHeader(outputArchive);
+    }
 
     // Process each collected item and write it to the archive
-    for (const auto& itemPath : itemsToArchive) {
-        // Retrieve the correct basePath for this item from the map
-        // Note: We need to ensure that itemPath exists as a key in itemBasePaths.
-        // It should always exist if it was added to itemsToArchive.
-        archiveItem(outputArchive, itemPath, itemBasePaths.at(itemPath));
+    std::map<std::pair<dev_t, ino_t>, std::string> hardLinks;
+    ArchivePipeline pipeline(outputArchive, encrypt ? &newKey.key : nullptr, read_threads, thread_count);
+    try {
+        pipeline.run([&] {
+            for (const auto& itemPath : itemsToArchive) {
+                // Retrieve the correct basePath for this item from the map
+                // Note: We need to ensure that itemPath exists as a key in itemBasePaths.
+                // It should always exist if it was added to itemsToArchive.
+                archiveItem(pipeline, itemPath, itemBasePaths.at(itemPath), hardLinks);
+            }
+        });
+        if (encrypt) {
+            writeArchiveIndex(outputArchive, newKey.key, outputArchive.tellp(), pipeline.index());
+        }
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        outputArchive.close();
+        fs::remove(outputArchiveName);
+        return 1;
+    }
+    if (print_stats) {
+        pipeline.printStats(std::cout);
     }
 
     outputArchive.close();
+    if (!outputArchive) {
+        std::cerr << "Error: Could not write output archive file: " << outputArchiveName << std::endl;
+        return 1;
+    }
     std::cout << "Archiving complete. Archive saved to: " << outputArchiveName << std::endl;
 
     return 0;
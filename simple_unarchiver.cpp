@@ -7,69 +7,894 @@
 #include <filesystem> // For directory creation (C++17)
 #include <stdexcept> // For std::runtime_error
 #include <set>       // For efficient lookup of files to extract
+#include <cstring>   // For std::memcpy, std::memcmp
+#include <deque>     // For the read-ahead chunks
+#include <thread>    // For the prefetch and checksum threads
+#include <mutex>     // For std::mutex
+#include <condition_variable> // For std::condition_variable
+#include <algorithm> // For std::min, std::max
+#include <cstdlib>   // For std::atoi
+#include <sys/stat.h> // For lstat() in --refresh mode
+#include <fcntl.h>   // For AT_FDCWD, open()
+#include <unistd.h>  // For pread(), ftruncate(), fdatasync()
+#include <cerrno>    // For errno
+#include <sys/mman.h> // For mapping the io_uring rings
+#include <sys/syscall.h> // For the io_uring system calls
+#include <linux/io_uring.h> // For io_uring structures and opcodes
+#include <poll.h>    // For waiting on a pipe in the prefetch thread
+#include <memory>    // For std::unique_ptr
+
+#include "libtzar/tzar_format.h" // Archive layout, readers, writers and CRC-32C
+#include "libtzar/tzar_parallel.h" // BoundedQueue for the checksum workers
+#include "libtzar/tzar_extract.h" // Creating the extracted items and the --test pipeline
 
 namespace fs = std::filesystem; // Alias for std::filesystem
 
-// Function to read a string from an input file stream.
-// It first reads the length (as uint32_t), then reads that many characters to form the string.
-std::string readString(std::ifstream& inFile) {
-    uint32_t len;
-    // Read the length (4 bytes)
-    inFile.read(reinterpret_cast<char*>(&len), sizeof(len));
-    if (!inFile) { // Check for read error or EOF
-        throw std::runtime_error("Error reading string length from archive.");
-    }
-    
-    std::vector<char> buffer(len); // Create a buffer for the string data
-    // Read the string data
-    inFile.read(buffer.data(), len);
-    if (!inFile) { // Check for read error or EOF
-        throw std::runtime_error("Error reading string data from archive.");
-    }
-    return std::string(buffer.begin(), buffer.end()); // Construct string from buffer
+// --- Read-ahead (prefetch) ---
+// Extraction alternates between reading the archive and writing output; on HDDs and
+// network block devices the two latencies would add up. A prefetch thread reads the
+// archive into a bounded ring of chunks and asks the kernel to start reading the region
+// after them (POSIX_FADV_WILLNEED), while the extraction thread consumes chunks and
+// writes. The ring is exposed as a streambuf, so the entry readers above work on it
+// unchanged. Seeks within the buffered data are free; longer ones restart the reader
+// at the new offset. Pipes cannot seek, but tellg() works on them too. The last bytes
+// consumed are kept in front of each new chunk, so a few unget()s work across chunk
+// boundaries; that is how a legacy archive from a pipe is rewound after its missing
+// header, even when the pipe delivered the first bytes in several small reads.
+
+const size_t PREFETCH_CHUNK_SIZE = 4 << 20;
+const unsigned PREFETCH_CHUNKS = 8; // Up to 32 MiB read ahead
+const size_t PREFETCH_PUTBACK_SIZE = 16; // At least the 6 bytes of an archive header
+
+class PrefetchStreamBuf : public std::streambuf {
+public:
+    // Takes ownership of 'fd' and starts reading it.
+    explicit PrefetchStreamBuf(int fd) : fd_(fd) {
+        struct stat st;
+        seekable_ = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (seekable_) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        for (unsigned i = 0; i < PREFETCH_CHUNKS; ++i) {
+            free_.emplace_back(PREFETCH_PUTBACK_SIZE + PREFETCH_CHUNK_SIZE);
+        }
+        reader_ = std::thread(&PrefetchStreamBuf::readLoop, this);
+    }
+
+    ~PrefetchStreamBuf() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        reader_.join();
+        close(fd_);
+    }
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        releaseCurrent();
+        cv_.wait(lock, [this] { return !filled_.empty() || eof_; });
+        if (filled_.empty()) {
+            if (error_ != 0) {
+                std::cerr << "Error: Could not read archive: " << std::strerror(error_) << "\n";
+                error_ = 0;
+            }
+            return traits_type::eof();
+        }
+        takeFront(0);
+        lock.unlock();
+        cv_.notify_all();
+        return traits_type::to_int_type(*gptr());
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        uint64_t position = base_offset_ + (gptr() - eback());
+        if (dir == std::ios_base::cur && off == 0) {
+            return pos_type(off_type(position)); // tellg()
+        }
+        if (dir == std::ios_base::end) {
+            return pos_type(off_type(-1));
+        }
+        return seekpos(pos_type(dir == std::ios_base::beg ? off : off_type(position) + off), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode) override {
+        if (!seekable_ || off_type(pos) < 0) {
+            return pos_type(off_type(-1));
+        }
+        uint64_t target = off_type(pos);
+        if (target >= base_offset_ && target <= base_offset_ + (egptr() - eback())) {
+            setg(eback(), eback() + (target - base_offset_), egptr());
+            return pos;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        releaseCurrent();
+        while (!filled_.empty() && filled_.front().offset + filled_.front().length <= target) {
+            free_.push_back(std::move(filled_.front().data));
+            filled_.pop_front();
+        }
+        if (!filled_.empty() && filled_.front().offset <= target) {
+            takeFront(target - filled_.front().offset); // Short skip into read-ahead data
+        } else {
+            // Beyond the read-ahead: drop it and restart the reader at the target.
+            for (Chunk& chunk : filled_) {
+                free_.push_back(std::move(chunk.data));
+            }
+            filled_.clear();
+            generation_++;
+            read_offset_ = target;
+            eof_ = false;
+            base_offset_ = target;
+            putback_length_ = 0;
+            setg(nullptr, nullptr, nullptr);
+        }
+        lock.unlock();
+        cv_.notify_all();
+        return pos;
+    }
+
+private:
+    // 'length' bytes of data start PREFETCH_PUTBACK_SIZE bytes into 'data'.
+    struct Chunk {
+        std::vector<char> data;
+        size_t length = 0;
+        uint64_t offset = 0;
+    };
+
+    // Returns the chunk being consumed to the free list, keeping the tail of the get area
+    // for putback. Caller holds the mutex.
+    void releaseCurrent() {
+        if (!current_.data.empty()) {
+            putback_length_ = std::min<size_t>(PREFETCH_PUTBACK_SIZE, egptr() - eback());
+            std::memcpy(putback_, egptr() - putback_length_, putback_length_);
+            base_offset_ = current_.offset + current_.length;
+            free_.push_back(std::move(current_.data));
+            current_ = Chunk();
+        }
+        setg(nullptr, nullptr, nullptr);
+    }
+
+    // Makes the first filled chunk the get area, starting 'skip' bytes in, with the kept
+    // putback bytes in front of it if it continues where they end. Caller holds the mutex.
+    void takeFront(size_t skip) {
+        current_ = std::move(filled_.front());
+        filled_.pop_front();
+        char* data = current_.data.data() + PREFETCH_PUTBACK_SIZE;
+        size_t kept = current_.offset == base_offset_ ? putback_length_ : 0;
+        std::memcpy(data - kept, putback_, kept);
+        base_offset_ = current_.offset - kept;
+        setg(data - kept, data + skip, data + current_.length);
+    }
+
+    void readLoop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            cv_.wait(lock, [this] { return stop_ || (!free_.empty() && !eof_); });
+            if (stop_) {
+                return;
+            }
+            std::vector<char> buffer = std::move(free_.back());
+            free_.pop_back();
+            uint64_t offset = read_offset_;
+            uint64_t generation = generation_;
+            lock.unlock();
+
+            ssize_t n;
+            if (seekable_) {
+                // Get the kernel reading the rest of the window while this chunk is read.
+                posix_fadvise(fd_, offset + PREFETCH_CHUNK_SIZE,
+                              PREFETCH_CHUNK_SIZE * (PREFETCH_CHUNKS - 1), POSIX_FADV_WILLNEED);
+                do {
+                    n = pread(fd_, buffer.data() + PREFETCH_PUTBACK_SIZE, PREFETCH_CHUNK_SIZE, offset);
+                } while (n < 0 && errno == EINTR);
+            } else {
+                n = readPipe(buffer);
+            }
+            int error = n < 0 ? errno : 0;
+
+            lock.lock();
+            if (generation != generation_ || (n < 0 && error == 0)) {
+                free_.push_back(std::move(buffer)); // Stale after a seek, or stopping
+                continue;
+            }
+            if (n <= 0) {
+                error_ = error;
+                eof_ = true;
+                free_.push_back(std::move(buffer));
+            } else {
+                filled_.push_back(Chunk{std::move(buffer), static_cast<size_t>(n), offset});
+                read_offset_ += n;
+            }
+            cv_.notify_all();
+        }
+    }
+
+    // Reads whatever a pipe has available (without waiting for a full chunk, so
+    // extraction keeps up with the archive as it arrives). Polls so the destructor is
+    // not stuck behind a writer that has gone quiet. Returns -1 with errno 0 on stop.
+    ssize_t readPipe(std::vector<char>& buffer) {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_) {
+                    errno = 0;
+                    return -1;
+                }
+            }
+            struct pollfd pfd = {fd_, POLLIN, 0};
+            if (poll(&pfd, 1, 100) == 0) {
+                continue;
+            }
+            ssize_t n = read(fd_, buffer.data() + PREFETCH_PUTBACK_SIZE, PREFETCH_CHUNK_SIZE);
+            if (n >= 0 || (errno != EINTR && errno != EAGAIN)) {
+                return n;
+            }
+        }
+    }
+
+    int fd_;
+    bool seekable_ = false;
+    std::thread reader_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::vector<char>> free_; // Empty chunk buffers
+    std::deque<Chunk> filled_;            // Read-ahead data in archive order
+    Chunk current_;                       // Chunk behind the get area (consumer only)
+    uint64_t base_offset_ = 0;            // Archive offset of eback()
+    char putback_[PREFETCH_PUTBACK_SIZE]; // Last bytes of the previous get area (consumer only)
+    size_t putback_length_ = 0;
+    uint64_t read_offset_ = 0;            // Where the reader continues
+    uint64_t generation_ = 0;             // Bumped by seeks; older reads are dropped
+    bool eof_ = false;
+    bool stop_ = false;
+    int error_ = 0;
+};
+
+// --- Refresh mode (--refresh) ---
+
+// Function to check whether an existing file already matches an archive entry, so
+// --refresh can leave it alone. A single stat() decides when size and mtime agree;
+// the file is only read and checksummed when the size matches but the mtime does not,
+// or always with 'trust_mtime' false. 'checksummed' is set when that slower path was taken.
+bool isExistingFileCurrent(const fs::path& path, uint64_t size, int64_t mtime_ns,
+                           bool has_checksum, uint32_t expected_crc, bool& checksummed,
+                           bool trust_mtime = true) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) { // Never a file behind a symlink
+        return false;
+    }
+    if (static_cast<uint64_t>(st.st_size) != size) {
+        return false;
+    }
+    if (trust_mtime && mtime_ns != 0 && statModificationTimeNs(st) == mtime_ns) {
+        return true;
+    }
+    if (!has_checksum) {
+        return false; // Nothing to compare the content against
+    }
+
+    checksummed = true;
+    std::ifstream existingFile(path, std::ios::binary);
+    if (!existingFile.is_open()) {
+        return false;
+    }
+    std::vector<char> buffer(1 << 20);
+    uint32_t crc = 0;
+    while (existingFile) {
+        existingFile.read(buffer.data(), buffer.size());
+        crc = crc32c_update(crc, buffer.data(), existingFile.gcount());
+    }
+    if (crc != expected_crc) {
+        return false;
+    }
+    // Same content: adopt the recorded mtime so the next refresh only needs a stat().
+    if (mtime_ns != 0) {
+        setModificationTime(path, mtime_ns);
+    }
+    return true;
 }
 
-// Function to read binary data (into a vector of chars) from an input file stream.
-// It first reads the size (as uint64_t). If 'read_content' is true, it reads the data
-// into a vector. Otherwise, it just skips the data.
-std::vector<char> readBinaryData(std::ifstream& inFile, bool read_content = true) {
-    uint64_t size;
-    // Read the size (8 bytes)
-    inFile.read(reinterpret_cast<char*>(&size), sizeof(size));
-    if (!inFile) { // Check for read error or EOF
-        throw std::runtime_error("Error reading binary data size from archive.");
+// --- io_uring extraction writer ---
+// Small files are written with one linked unlinkat -> openat -> write -> close chain
+// each. The openat installs a direct descriptor into a registered file slot, so the write and
+// close in the same chain can refer to it without a round trip to user space. Up to
+// URING_SLOTS chains are kept in flight and submitted together, so writing a small file
+// costs a fraction of a syscall instead of four. init() fails on kernels without
+// io_uring or direct descriptors, and extraction then uses the synchronous path. It is
+// not used with --durability=file, which needs each file's metadata applied before its
+// fsync().
+
+const size_t URING_MAX_FILE_SIZE = 1 << 20; // Larger files are written synchronously
+const size_t URING_MIN_HOLE_BLOCKS = 16;    // ... as are files with this many zero blocks
+const unsigned URING_SLOTS = 64;            // Files in flight (registered file slots)
+const unsigned URING_ENTRIES = 256;         // Submission queue size; the CQ is twice this
+
+class UringWriter {
+public:
+    ~UringWriter() {
+        if (ring_fd_ >= 0) {
+            try {
+                drain(); // Buffers must outlive the kernel's use of them
+            } catch (const std::exception&) {
+            }
+        }
+        shutdown();
     }
 
-    std::vector<char> data;
-    if (read_content) {
-        data.resize(size); // Resize vector to hold the binary data
-        if (size > 0) { // Only read if there's data to read
-            // Read the binary data
-            inFile.read(data.data(), size);
-            if (!inFile) { // Check for read error or EOF
-                throw std::runtime_error("Error reading binary data from archive.");
+    // Sets up the ring and checks that direct descriptors work. Returns false if the
+    // synchronous path has to be used instead.
+    bool init() {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+        if (ring_fd_ < 0) {
+            return false;
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            sq_ring_ = nullptr;
+            shutdown();
+            return false;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring_ = sq_ring_;
+        } else {
+            cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_fd_, IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED) {
+                cq_ring_ = nullptr;
+                shutdown();
+                return false;
+            }
+        }
+        sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            shutdown();
+            return false;
+        }
+        sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+        char* sq = static_cast<char*>(sq_ring_);
+        char* cq = static_cast<char*>(cq_ring_);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        local_tail_ = *sq_tail_;
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // Empty (-1) slots for the direct descriptors installed by openat.
+        std::vector<int> fds(URING_SLOTS, -1);
+        if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES, fds.data(), URING_SLOTS) < 0) {
+            shutdown();
+            return false;
+        }
+
+        // Open and close /dev/null through a slot to make sure the kernel supports
+        // openat/close on direct descriptors (5.15+) before trusting it with real files.
+        struct io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>("/dev/null");
+        sqe->open_flags = O_RDONLY; // O_CLOEXEC is rejected for direct descriptors
+        sqe->file_index = 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe = nextSqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = 1;
+        bool probe_ok = true;
+        unsigned probe_seen = 0;
+        while (probe_seen < 2) {
+            if (!enter(2 - probe_seen)) {
+                probe_ok = false;
+                break;
             }
+            unsigned head = *cq_head_;
+            unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head, ++probe_seen) {
+                probe_ok = probe_ok && cqes_[head & cq_mask_].res == 0;
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
         }
-    } else {
-        // If not reading content, just skip the bytes
-        inFile.seekg(size, std::ios_base::cur);
-        if (!inFile) {
-            throw std::runtime_error("Error skipping binary data content in archive.");
+        if (!probe_ok) {
+            shutdown();
+            return false;
+        }
+
+        slots_.resize(URING_SLOTS);
+        for (unsigned i = 0; i < URING_SLOTS; ++i) {
+            free_slots_.push_back(URING_SLOTS - 1 - i);
+        }
+        return true;
+    }
+
+    bool enabled() const { return ring_fd_ >= 0; }
+
+    // Queues a regular file for writing. Takes ownership of the content, which stays
+    // alive until the write completes. Blocks while all slots are busy.
+    void submitFile(const fs::path& outputPath, const EntryHeader& entry, std::vector<char> content) {
+        while (free_slots_.empty()) {
+            submitAndReap(1);
+        }
+        unsigned index = free_slots_.back();
+        free_slots_.pop_back();
+        Slot& slot = slots_[index];
+        slot.path = outputPath;
+        slot.entry = entry;
+        slot.content = std::move(content);
+        slot.expected = slot.content.empty() ? 3 : 4;
+        slot.seen = 0;
+        slot.error = 0;
+
+        // The file replaces whatever is at the path rather than writing through it (a
+        // symlink, or a file with other hard links). A hard link lets the openat run when
+        // there was nothing to remove; O_EXCL fails it if the removal did not work.
+        struct io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(slot.path.c_str());
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = index * 4 + 3;
+
+        sqe = nextSqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(slot.path.c_str());
+        sqe->len = entry.mode != 0 ? entry.mode : 0666;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL;
+        sqe->file_index = index + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = index * 4 + 0;
+
+        if (!slot.content.empty()) {
+            sqe = nextSqe();
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = index;
+            sqe->addr = reinterpret_cast<uint64_t>(slot.content.data());
+            sqe->len = slot.content.size();
+            sqe->off = 0;
+            // A hard link still closes the file if the write fails.
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+            sqe->user_data = index * 4 + 1;
+        }
+
+        sqe = nextSqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = index + 1;
+        sqe->user_data = index * 4 + 2;
+
+        // Submit in batches; completions are reaped on the same call.
+        if (unsubmitted_ >= URING_ENTRIES / 4) {
+            submitAndReap(0);
+        }
+    }
+
+    // Waits until every queued file has been written and closed.
+    void drain() {
+        while (free_slots_.size() < slots_.size()) {
+            submitAndReap(1);
+        }
+    }
+
+    int written() const { return written_; }
+
+private:
+    struct Slot {
+        fs::path path;
+        EntryHeader entry;
+        std::vector<char> content;
+        unsigned expected = 0; // Completions to wait for (3 or 4)
+        unsigned seen = 0;
+        int error = 0;
+    };
+
+    struct io_uring_sqe* nextSqe() {
+        unsigned index = local_tail_ & sq_mask_;
+        struct io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        local_tail_++;
+        unsubmitted_++;
+        return sqe;
+    }
+
+    // Publishes queued SQEs and waits for at least 'min_complete' completions.
+    bool enter(unsigned min_complete) {
+        __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+        for (;;) {
+            long ret = syscall(__NR_io_uring_enter, ring_fd_, unsubmitted_, min_complete,
+                               min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret >= 0) {
+                unsubmitted_ -= std::min<unsigned>(ret, unsubmitted_);
+                return true;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                return false;
+            }
+        }
+    }
+
+    void submitAndReap(unsigned min_complete) {
+        if (!enter(min_complete)) {
+            throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+        }
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            Slot& slot = slots_[cqe.user_data / 4];
+            unsigned op = cqe.user_data % 4;
+            int error = cqe.res < 0 ? -cqe.res : 0;
+            if (op == 1 && cqe.res >= 0 && static_cast<size_t>(cqe.res) != slot.content.size()) {
+                error = EIO; // Short write
+            }
+            if (op == 3 && error == ENOENT) {
+                error = 0; // Nothing to replace
+            }
+            // Keep the first real error; later ops in a broken chain report ECANCELED.
+            if (error != 0 && (slot.error == 0 || slot.error == ECANCELED)) {
+                slot.error = error;
+            }
+            if (++slot.seen == slot.expected) {
+                completeSlot(cqe.user_data / 4);
+            }
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    void completeSlot(unsigned index) {
+        Slot& slot = slots_[index];
+        if (slot.error != 0) {
+            std::cerr << "Warning: Could not write output file: " << slot.path << ": "
+                      << std::strerror(slot.error) << ". Skipping.\n";
+        } else {
+            applyMetadata(slot.path, slot.entry);
+            std::cout << "Extracted file: " << slot.entry.name << " (" << slot.content.size() << " bytes)\n";
+            written_++;
+        }
+        std::vector<char>().swap(slot.content);
+        free_slots_.push_back(index);
+    }
+
+    void shutdown() {
+        if (sqes_) munmap(sqes_, sqes_size_);
+        if (cq_ring_ && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_) munmap(sq_ring_, sq_ring_size_);
+        if (ring_fd_ >= 0) close(ring_fd_);
+        sqes_ = nullptr;
+        sq_ring_ = cq_ring_ = nullptr;
+        ring_fd_ = -1;
+    }
+
+    int ring_fd_ = -1;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    size_t sqes_size_ = 0;
+    struct io_uring_sqe* sqes_ = nullptr;
+    struct io_uring_cqe* cqes_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned local_tail_ = 0; // Tail including SQEs not yet published to the kernel
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    unsigned unsubmitted_ = 0;
+    std::vector<Slot> slots_;
+    std::vector<unsigned> free_slots_;
+    int written_ = 0;
+};
+
+// --- Extraction journal (--journal, --resume) ---
+// After every durability checkpoint one fixed-size record (entries completed, archive
+// offset, CRC) is appended to the journal and fdatasync()ed. Everything the record
+// covers was synced before it was written, so a rerun with --resume can skip those
+// entries. Records are only ever appended, and a torn final record fails its CRC and is
+// ignored. The journal is deleted once extraction finishes.
+
+const char JOURNAL_MAGIC[8] = {'T', 'Z', 'A', 'R', 'J', 'R', 'N', 'L'};
+
+struct JournalRecord {
+    uint64_t entries_done = 0;   // Entries fully processed (a prefix of the archive)
+    uint64_t archive_offset = 0; // Input offset just after them, 0 if unknown (pipe)
+};
+
+class ExtractionJournal {
+public:
+    ~ExtractionJournal() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    // Opens the journal at 'path' for an archive of 'archive_size' bytes (0 if unknown).
+    // With 'resume', the last valid record of an existing journal is returned in
+    // 'resume_point' and new records are appended; otherwise a new journal is started.
+    void open(const fs::path& path, uint64_t archive_size, bool resume, JournalRecord& resume_point) {
+        path_ = path;
+        if (resume && readExisting(archive_size, resume_point)) {
+            // Cut off a torn record so new records stay aligned.
+            fd_ = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (fd_ >= 0 && ftruncate(fd_, valid_length_) != 0) {
+                close(fd_);
+                fd_ = -1;
+            }
+        } else {
+            if (resume) {
+                std::cout << "No usable journal at " << path << "; extracting from the start.\n";
+            }
+            fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            char header[sizeof(JOURNAL_MAGIC) + sizeof(uint64_t)];
+            std::memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+            std::memcpy(header + sizeof(JOURNAL_MAGIC), &archive_size, sizeof(archive_size));
+            if (fd_ >= 0 && !writeAll(fd_, header, sizeof(header))) {
+                close(fd_);
+                fd_ = -1;
+            }
+        }
+        if (fd_ < 0) {
+            throw std::runtime_error("Could not open journal " + path.string() + ": " + std::strerror(errno));
+        }
+        syncDirectory(path.parent_path()); // The journal's own directory entry
+    }
+
+    bool active() const { return fd_ >= 0; }
+
+    // Appends a record. The extracted data it covers must already be on disk.
+    void record(uint64_t entries_done, uint64_t archive_offset) {
+        char buffer[RECORD_SIZE] = {};
+        std::memcpy(buffer, &entries_done, sizeof(entries_done));
+        std::memcpy(buffer + 8, &archive_offset, sizeof(archive_offset));
+        uint32_t crc = crc32c_update(0, buffer, 16);
+        std::memcpy(buffer + 16, &crc, sizeof(crc));
+        if (!writeAll(fd_, buffer, sizeof(buffer)) || fdatasync(fd_) != 0) {
+            throw std::runtime_error(std::string("Could not write extraction journal: ") + std::strerror(errno));
+        }
+    }
+
+    // Removes the journal after a completed extraction.
+    void finish() {
+        close(fd_);
+        fd_ = -1;
+        unlink(path_.c_str());
+    }
+
+private:
+    static const size_t RECORD_SIZE = 24; // u64 entries, u64 offset, u32 crc, u32 zero
+
+    bool readExisting(uint64_t archive_size, JournalRecord& last) {
+        std::ifstream in(path_, std::ios::binary);
+        char header[sizeof(JOURNAL_MAGIC) + sizeof(uint64_t)];
+        if (!in.read(header, sizeof(header)) || std::memcmp(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+            return false;
+        }
+        uint64_t journal_archive_size;
+        std::memcpy(&journal_archive_size, header + sizeof(JOURNAL_MAGIC), sizeof(journal_archive_size));
+        if (journal_archive_size != 0 && archive_size != 0 && journal_archive_size != archive_size) {
+            throw std::runtime_error("Journal " + path_.string() + " was written for a different archive.");
+        }
+        valid_length_ = sizeof(header);
+        char buffer[RECORD_SIZE];
+        while (in.read(buffer, sizeof(buffer))) {
+            uint32_t crc;
+            std::memcpy(&crc, buffer + 16, sizeof(crc));
+            if (crc32c_update(0, buffer, 16) != crc) {
+                break; // Torn write from the crash
+            }
+            std::memcpy(&last.entries_done, buffer, sizeof(uint64_t));
+            std::memcpy(&last.archive_offset, buffer + 8, sizeof(uint64_t));
+            valid_length_ += sizeof(buffer);
+        }
+        return true;
+    }
+
+    fs::path path_;
+    int fd_ = -1;
+    off_t valid_length_ = 0; // Header plus intact records of the journal being resumed
+};
+
+// --- Parallel checksum verification during extraction ---
+// Verifying the CRC is the CPU-bound step of extraction. Large payloads are split into
+// blocks that a pool of workers checksums while the extraction thread is writing the
+// same payload out; the block CRCs are combined in order once all are done. This is
+// the stage that will decode compressed blocks once archives carry them.
+
+const size_t CHECKSUM_BLOCK_SIZE = 1 << 20;
+const size_t PARALLEL_CHECKSUM_MIN = 4 << 20; // Smaller payloads are checksummed inline
+
+class ChecksumPool;
+
+// Checksum of one payload. Declare it after the payload: if extraction throws, the
+// destructor waits for the workers before the payload goes away.
+struct ChecksumTask {
+    ~ChecksumTask();
+    uint64_t size = 0;
+    uint32_t crc = 0;
+    std::vector<uint32_t> block_crcs;
+    size_t blocks_remaining = 0;  // Guarded by the pool's mutex
+    ChecksumPool* pool = nullptr; // Set while blocks are queued
+};
+
+class ChecksumPool {
+public:
+    explicit ChecksumPool(unsigned worker_count) {
+        for (unsigned i = 0; i < worker_count && worker_count > 1; ++i) {
+            workers_.emplace_back([this] { work(); });
+        }
+    }
+
+    ~ChecksumPool() {
+        jobs_.close();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    // Starts checksumming 'data', which must stay alive until wait() returns.
+    void start(ChecksumTask& task, const char* data, uint64_t size) {
+        task.size = size;
+        if (workers_.empty() || size < PARALLEL_CHECKSUM_MIN) {
+            task.crc = crc32c_update(0, data, size);
+            return;
+        }
+        size_t block_count = (size + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE;
+        task.block_crcs.assign(block_count, 0);
+        task.blocks_remaining = block_count;
+        task.pool = this;
+        for (size_t block = 0; block < block_count; ++block) {
+            uint64_t offset = block * CHECKSUM_BLOCK_SIZE;
+            jobs_.push(Job{&task, block, data + offset, std::min<uint64_t>(size - offset, CHECKSUM_BLOCK_SIZE)});
+        }
+    }
+
+    // Waits for the task and returns the CRC of the whole payload.
+    uint32_t wait(ChecksumTask& task) {
+        if (task.block_crcs.empty()) {
+            return task.crc;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [&task] { return task.blocks_remaining == 0; });
+        }
+        uint32_t crc = 0;
+        uint64_t remaining = task.size;
+        for (uint32_t block_crc : task.block_crcs) {
+            uint64_t len = std::min<uint64_t>(remaining, CHECKSUM_BLOCK_SIZE);
+            crc = crc32c_combine(crc, block_crc, len);
+            remaining -= len;
+        }
+        task.block_crcs.clear();
+        task.pool = nullptr;
+        task.crc = crc;
+        return crc;
+    }
+
+private:
+    struct Job {
+        ChecksumTask* task = nullptr;
+        size_t block = 0;
+        const char* data = nullptr;
+        uint64_t length = 0;
+    };
+
+    void work() {
+        Job job;
+        while (jobs_.pop(job)) {
+            uint32_t crc = crc32c_update(0, job.data, job.length);
+            std::lock_guard<std::mutex> lock(mutex_);
+            job.task->block_crcs[job.block] = crc;
+            if (--job.task->blocks_remaining == 0) {
+                done_.notify_all();
+            }
         }
     }
-    return data; // Return the vector (empty if content was skipped)
+
+    BoundedQueue<Job> jobs_; // Unbounded: jobs only point into payloads already in memory
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable done_;
+};
+
+ChecksumTask::~ChecksumTask() {
+    if (pool) {
+        pool->wait(*this);
+    }
 }
 
 int main(int argc, char* argv[]) {
-    // Usage: ./simple_unarchiver <input_archive_name> [file_to_extract1] [file_to_extract2 ...]
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <input_archive_name> [file_to_extract1] [file_to_extract2 ...]\n";
+    // Usage: ./simple_unarchiver [options] <input_archive_name> [file_to_extract1] [file_to_extract2 ...]
+    // Options:
+    //   --test       Verify every entry's checksum without writing anything
+    //   --threads=N  Number of checksum worker threads (default: all cores)
+    //   --refresh    Only rewrite files that differ from the existing ones on disk
+    //   --no-io-uring  Write every file synchronously even if io_uring is available
+    //   --no-prefetch  Read the archive on the extraction thread instead of reading ahead
+    //   --durability=none|batch|file  When extracted items are synced to disk (default: none)
+    //   --no-sparse  Write zero blocks of regular files instead of leaving holes
+    //   --journal=FILE  Record progress in FILE at every checkpoint (implies batch durability)
+    //   --resume     Skip the entries the journal marks as completed
+    bool test_mode = false;
+    bool refresh_mode = false;
+    bool use_io_uring = true;
+    bool use_prefetch = true;
+    DurabilityMode durability = DURABILITY_NONE;
+    bool skip_zero_blocks = true;
+    std::string journal_path;
+    bool resume_mode = false;
+    unsigned worker_count = std::max(1u, std::thread::hardware_concurrency());
+    int argi = 1;
+    for (; argi < argc && std::string(argv[argi]).rfind("--", 0) == 0; ++argi) {
+        std::string option = argv[argi];
+        if (option == "--test") {
+            test_mode = true;
+        } else if (option == "--refresh") {
+            refresh_mode = true;
+        } else if (option == "--no-io-uring") {
+            use_io_uring = false;
+        } else if (option == "--no-prefetch") {
+            use_prefetch = false;
+        } else if (option == "--no-sparse") {
+            skip_zero_blocks = false;
+        } else if (option == "--durability=none") {
+            durability = DURABILITY_NONE;
+        } else if (option == "--durability=batch") {
+            durability = DURABILITY_BATCH;
+        } else if (option == "--durability=file") {
+            durability = DURABILITY_FILE;
+        } else if (option.rfind("--journal=", 0) == 0) {
+            journal_path = option.substr(10);
+        } else if (option == "--resume") {
+            resume_mode = true;
+        } else if (option.rfind("--threads=", 0) == 0) {
+            worker_count = std::max(1, std::atoi(option.c_str() + 10));
+        } else {
+            std::cerr << "Error: Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    if (resume_mode && journal_path.empty()) {
+        std::cerr << "Error: --resume needs the journal of the interrupted run (--journal=FILE).\n";
+        return 1;
+    }
+
+    if (argi >= argc) {
+        std::cerr << "Usage: " << argv[0] << " [--test] [--threads=N] [--refresh] [--no-io-uring] [--no-prefetch] [--durability=none|batch|file] [--no-sparse] [--journal=FILE [--resume]] <input_archive_name|-> [file_to_extract1] [file_to_extract2 ...]\n";
         return 1;
     }
 
-    std::string inputArchiveName = argv[1];
-    std::ifstream inputArchive(inputArchiveName, std::ios::binary);
-    if (!inputArchive.is_open()) {
+    // "-" reads the archive from standard input, so extraction can start while the
+    // archive is still arriving (e.g. from a pipe or the network).
+    std::string inputArchiveName = argv[argi];
+    const char* inputPath = inputArchiveName == "-" ? "/dev/stdin" : inputArchiveName.c_str();
+    std::ifstream archiveFile;
+    std::unique_ptr<PrefetchStreamBuf> prefetch;
+    if (use_prefetch) {
+        int fd = open(inputPath, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            prefetch.reset(new PrefetchStreamBuf(fd));
+        }
+    } else {
+        archiveFile.open(inputPath, std::ios::binary);
+    }
+    std::istream inputArchive(prefetch ? static_cast<std::streambuf*>(prefetch.get()) : archiveFile.rdbuf());
+    if (!prefetch && !archiveFile.is_open()) {
         std::cerr << "Error: Could not open input archive file: " << inputArchiveName << std::endl;
         return 1;
     }
@@ -77,88 +902,228 @@ int main(int argc, char* argv[]) {
     // Collect paths of files to extract if provided
     std::set<std::string> files_to_extract;
     bool extract_all = true;
-    if (argc > 2) {
+    if (argc > argi + 1) {
         extract_all = false;
-        for (int i = 2; i < argc; ++i) {
+        for (int i = argi + 1; i < argc; ++i) {
             files_to_extract.insert(argv[i]);
         }
     }
 
     // Use a try-catch block to handle potential errors during reading (e.g., corrupted archive).
     try {
+        uint8_t encryption_flag = 0x00;
+        uint8_t format_version = readArchiveHeader(inputArchive, encryption_flag);
+        if (encryption_flag != 0x00) {
+            std::cerr << "Error: Archive is encrypted. Use tzar_decrypt for .tzar2 archives.\n";
+            return 1;
+        }
+
+        if (test_mode) {
+            bool ok = testArchive(inputArchive, format_version, worker_count, files_to_extract, ChunkDecoder());
+            return ok ? 0 : 1;
+        }
+
         int extracted_count = 0;
         int skipped_count = 0;
+        int checksum_failures = 0;
+        int unchanged_count = 0;   // --refresh: files left as they were
+        int checksummed_count = 0; // --refresh: files whose content had to be compared
+        int resumed_count = 0;     // --resume: files found complete after the last checkpoint
+
+        // A journal record is only worth writing once the data it covers is on disk.
+        if (!journal_path.empty() && durability == DURABILITY_NONE) {
+            durability = DURABILITY_BATCH;
+        }
+
+        ExtractState extract_state;
+        extract_state.durability = durability;
+        extract_state.skip_zero_blocks = skip_zero_blocks;
+        UringWriter uring_writer;
+        ChecksumPool checksum_pool(worker_count);
+        if (durability == DURABILITY_FILE) {
+            use_io_uring = false;
+        }
+        if (use_io_uring && !uring_writer.init()) {
+            use_io_uring = false; // Kernel without io_uring: fall back to synchronous writes
+        }
+
+        ExtractionJournal journal;
+        JournalRecord resume_point;
+        uint64_t entries_read = 0;
+        bool verifying_tail = false; // --resume: files after the checkpoint may be complete already
+        if (!journal_path.empty()) {
+            std::error_code ec;
+            uint64_t archive_size = inputArchiveName == "-" ? 0 : fs::file_size(inputArchiveName, ec);
+            journal.open(journal_path, ec ? 0 : archive_size, resume_mode, resume_point);
+        }
+        if (resume_point.entries_done > 0) {
+            // Step over the completed entries by their headers. Symlinks and directory
+            // metadata are only created at the very end, so they are collected again on the way.
+            for (; entries_read < resume_point.entries_done; ++entries_read) {
+                if (inputArchive.peek() == EOF) {
+                    throw std::runtime_error("Archive has fewer entries than the journal records.");
+                }
+                EntryHeader entry = readEntryHeader(inputArchive, format_version);
+                bool selected = (extract_all || files_to_extract.count(entry.name)) && isSafeEntryName(entry.name);
+                if (entry.type == ENTRY_SYMLINK && selected) {
+                    std::vector<char> target = readBinaryDataContent(inputArchive, entry.size);
+                    MemoryPayload payload(target);
+                    extractEntry(entry, payload, fs::path(), extract_state);
+                    continue;
+                }
+                readBinaryDataContent(inputArchive, entry.size, false);
+                if (entry.type == ENTRY_DIRECTORY && (entry.mode != 0 || entry.mtime_ns != 0) && selected) {
+                    extract_state.deferred_dirs.push_back(entry);
+                }
+            }
+            std::streamoff offset = inputArchive.tellg();
+            if (resume_point.archive_offset != 0 && offset >= 0 &&
+                static_cast<uint64_t>(offset) != resume_point.archive_offset) {
+                throw std::runtime_error("Journal does not match this archive.");
+            }
+            std::cout << "Resuming after " << entries_read << " entries completed by an earlier run.\n";
+            verifying_tail = true;
+        }
 
         // Loop to read files until the end of the archive is reached.
         while (inputArchive.peek() != EOF) {
-            std::string relativePathStr = readString(inputArchive); // Read relative path
+            EntryHeader entry = readEntryHeader(inputArchive, format_version);
+            entries_read++;
 
-            bool should_extract_current_item = extract_all || files_to_extract.count(relativePathStr);
-            
-            std::vector<char> fileContent;
-            if (should_extract_current_item) {
-                fileContent = readBinaryData(inputArchive, true); // Read content
-            } else {
-                readBinaryData(inputArchive, false); // Skip content
+            bool should_extract_current_item = extract_all || files_to_extract.count(entry.name);
+
+            // Names that would leave the output directory, or lead through a symlink, are
+            // skipped before the --refresh and --resume checks look at the path.
+            if (should_extract_current_item && !prepareEntryPath(fs::path(), entry.name, extract_state)) {
+                readBinaryDataContent(inputArchive, entry.size, false);
+                skipped_count++;
+                continue;
             }
 
-            if (should_extract_current_item) {
-                fs::path outputPath = relativePathStr; // Convert string to filesystem path
+            // Files extracted after the last checkpoint of the interrupted run are kept if
+            // they are complete; the first missing or partial one ends the check. They were
+            // never synced, so after a power loss size and mtime can be right while data
+            // blocks are not: their content is always compared.
+            if (verifying_tail && should_extract_current_item && entry.type == ENTRY_FILE &&
+                entry.size > 0 && format_version >= 1) {
+                bool checksummed = false;
+                if (isExistingFileCurrent(entry.name, entry.size, entry.mtime_ns, true, entry.crc, checksummed,
+                                          false)) {
+                    applyMetadata(entry.name, entry); // The crash may have come before chmod
+                    readBinaryDataContent(inputArchive, entry.size, false);
+                    resumed_count++;
+                    continue;
+                }
+                verifying_tail = false;
+            }
 
-                // Create parent directories if they don't exist, for both files and directories
-                if (outputPath.has_parent_path()) {
-                    fs::create_directories(outputPath.parent_path());
+            // Empty files are included: the stat() alone decides for them.
+            if (should_extract_current_item && refresh_mode && entry.type == ENTRY_FILE) {
+                bool checksummed = false;
+                bool current = isExistingFileCurrent(entry.name, entry.size, entry.mtime_ns,
+                                                     format_version >= 1, entry.crc, checksummed);
+                if (checksummed) checksummed_count++;
+                if (current) {
+                    readBinaryDataContent(inputArchive, entry.size, false); // Skip content
+                    unchanged_count++;
+                    continue;
                 }
+            }
 
-                // Handle directory entries (empty content)
-                if (fileContent.empty()) { // This entry represents a directory
-                    if (fs::exists(outputPath)) {
-                        if (fs::is_directory(outputPath)) {
-                            std::cout << "Directory already exists: " << relativePathStr << "\n";
-                        } else {
-                            // Conflict: a file exists where a directory should be
-                            std::cerr << "Warning: Cannot create directory '" << relativePathStr << "' because a file with that name already exists. Skipping.\n";
-                            continue; // Skip this entry to prevent further errors
-                        }
-                    } else {
-                        // Directory does not exist, create it
-                        fs::create_directories(outputPath);
-                        std::cout << "Extracted directory: " << relativePathStr << "\n";
+            std::vector<char> fileContent = readBinaryDataContent(inputArchive, entry.size, should_extract_current_item);
+
+            // The checksum is computed by the pool while the entry is being written.
+            bool verify_checksum = should_extract_current_item && format_version >= 1;
+            ChecksumTask checksum;
+            if (verify_checksum) {
+                checksum_pool.start(checksum, fileContent.data(), fileContent.size());
+            }
+            auto check_checksum = [&] {
+                if (verify_checksum && checksum_pool.wait(checksum) != entry.crc) {
+                    std::cerr << "Warning: Checksum mismatch for '" << entry.name << "'. Content is corrupted.\n";
+                    checksum_failures++;
+                }
+                verify_checksum = false;
+            };
+
+            if (should_extract_current_item) {
+                bool use_ring = use_io_uring && entry.type == ENTRY_FILE && entry.size <= URING_MAX_FILE_SIZE;
+                // The ring writes files whole, so only files with enough zero blocks to be
+                // worth leaving as holes are written synchronously instead.
+                if (use_ring && extract_state.skip_zero_blocks &&
+                    fileContent.size() >= URING_MIN_HOLE_BLOCKS * ZERO_BLOCK_SIZE) {
+                    use_ring = countZeroBlocks(fileContent.data(), fileContent.size(), URING_MIN_HOLE_BLOCKS) <
+                               URING_MIN_HOLE_BLOCKS;
+                }
+                if (use_ring) {
+                    // Small file: queue it on the ring; its result is counted once it completes.
+                    check_checksum(); // The ring takes the content over
+                    uring_writer.submitFile(entry.name, entry, std::move(fileContent));
+                    extract_state.unsynced_bytes += entry.size;
+                    extract_state.unsynced_entries++;
+                } else {
+                    if (use_io_uring && entry.type == ENTRY_HARDLINK) {
+                        uring_writer.drain(); // The link target may still be in flight
                     }
-                } else { // This entry represents a file (non-empty content)
-                    // This is a file, write its content
-                    std::ofstream outputFile(outputPath, std::ios::binary);
-                    if (!outputFile.is_open()) {
-                        std::cerr << "Warning: Could not create output file: " << outputPath << ". Skipping.\n";
-                        continue; 
+                    MemoryPayload payload(fileContent);
+                    if (extractEntry(entry, payload, fs::path(), extract_state)) {
+                        extracted_count++;
+                    }
+                    check_checksum();
+                }
+                if (checkpointDue(extract_state)) {
+                    if (use_io_uring) {
+                        uring_writer.drain(); // Queued files must be written before the sync
+                    }
+                    checkpoint(fs::path(), extract_state);
+                    if (journal.active()) {
+                        std::streamoff offset = inputArchive.tellg();
+                        journal.record(entries_read, offset >= 0 ? offset : 0);
                     }
-
-                    outputFile.write(fileContent.data(), fileContent.size());
-                    outputFile.close();
-                    std::cout << "Extracted file: " << relativePathStr << " (" << fileContent.size() << " bytes)\n";
                 }
-                extracted_count++;
             } else {
                 skipped_count++;
             }
         }
+        if (use_io_uring) {
+            uring_writer.drain();
+            extracted_count += uring_writer.written();
+        }
+        finishExtraction(fs::path(), extract_state);
+        if (durability != DURABILITY_NONE) {
+            // Final sync; in file mode this covers the deferred directory metadata.
+            syncOutput(fs::path(), extract_state);
+            std::cout << "Durability: extracted items synced to disk ("
+                      << extract_state.syncfs_calls << " syncfs calls).\n";
+        }
+        if (journal.active()) {
+            journal.finish();
+        }
+        if (resume_point.entries_done > 0) {
+            std::cout << "Resume: " << resumed_count << " files from the interrupted run were already complete.\n";
+        }
         if (!extract_all && extracted_count == 0 && !files_to_extract.empty()) {
             std::cerr << "Warning: No specified files were found in the archive to extract.\n";
         } else if (!extract_all) {
             std::cout << "Extracted " << extracted_count << " items, skipped " << skipped_count << " items.\n";
         }
+        if (refresh_mode) {
+            std::cout << "Refresh: " << extracted_count << " items extracted, " << unchanged_count
+                      << " files unchanged (" << checksummed_count << " needed a content comparison).\n";
+        }
+        if (checksum_failures > 0) {
+            std::cerr << "Error: " << checksum_failures << " entries failed checksum verification.\n";
+            return 1;
+        }
     } catch (const std::runtime_error& e) {
         std::cerr << "Error during unarchiving: " << e.what() << std::endl;
         std::cerr << "Archive might be corrupted or incomplete.\n";
-        inputArchive.close();
         return 1; // Indicate error
     } catch (const std::exception& e) {
         std::cerr << "An unexpected error occurred: " << e.what() << std::endl;
-        inputArchive.close();
         return 1; // Indicate error
     }
 
-    inputArchive.close(); // Close the input archive file
     std::cout << "Unarchiving complete.\n";
 
     return 0; // Indicate successful execution
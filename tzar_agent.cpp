@@ -0,0 +1,340 @@
+// === tzar_agent.cpp ===
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#include <cstring> // For std::memcpy, std::memcmp
+#include <cstdlib> // For std::getenv, std::strtoul
+#include <algorithm> // For std::max
+#include <new> // For placement new
+#include <csignal> // For sigaction()
+#include <cerrno> // For errno
+#include <sys/mman.h> // For mmap(), mlock(), madvise()
+#include <sys/prctl.h> // For PR_SET_DUMPABLE
+#include <sys/random.h> // For getrandom()
+#include <sys/socket.h>
+#include <sys/un.h> // For sockaddr_un
+#include <sys/stat.h> // For umask()
+#include <poll.h>
+#include <fcntl.h> // For open()
+#include <unistd.h> // For fork(), setsid(), unlink()
+
+#include "libtzar/tzar_crypto.h" // For deriveMasterKey()
+#include "libtzar/tzar_agent_protocol.h"
+
+// Key agent for tzar_encrypt and tzar_decrypt: holds the password and the keys derived
+// from it so that batch jobs run the (deliberately slow) KDF once instead of per archive.
+
+// --- Locked key store ---
+// The password and every derived key live in one mlock()ed, MADV_DONTDUMP mapping
+// that is wiped before exit; nothing secret is kept in ordinary heap memory.
+const size_t AGENT_MAX_PASSWORD = 1024;
+const size_t AGENT_CACHE_SLOTS = 64;
+
+struct CachedKey {
+    bool used;
+    uint64_t last_used;
+    KdfParams params;
+    uint8_t key[AGENT_KEY_SIZE];
+};
+
+struct AgentSecrets {
+    char password[AGENT_MAX_PASSWORD];
+    size_t password_size;
+    KdfParams new_archive_params; // Salt and cost used for every archive encrypted through the agent
+    CachedKey cache[AGENT_CACHE_SLOTS];
+};
+
+static AgentSecrets* secrets = nullptr;
+static size_t secrets_mapping_size = 0;
+static uint64_t request_counter = 0;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void onStopSignal(int) {
+    stop_requested = 1;
+}
+
+AgentSecrets* allocateSecrets() {
+    long page = sysconf(_SC_PAGESIZE);
+    secrets_mapping_size = (sizeof(AgentSecrets) + page - 1) / page * page;
+    void* memory = mmap(nullptr, secrets_mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        throw std::runtime_error(std::string("Could not allocate key store: ") + std::strerror(errno));
+    }
+    if (mlock(memory, secrets_mapping_size) != 0) {
+        std::string reason = std::strerror(errno);
+        munmap(memory, secrets_mapping_size);
+        throw std::runtime_error("Could not lock key store in memory: " + reason + " (check ulimit -l).");
+    }
+    madvise(memory, secrets_mapping_size, MADV_DONTDUMP);
+    return new (memory) AgentSecrets();
+}
+
+void wipeSecrets() {
+    if (secrets != nullptr) {
+        explicit_bzero(secrets, secrets_mapping_size);
+        munlock(secrets, secrets_mapping_size);
+        munmap(secrets, secrets_mapping_size);
+        secrets = nullptr;
+    }
+}
+
+bool sameParams(const KdfParams& a, const KdfParams& b) {
+    return a.kdf == b.kdf && a.iterations == b.iterations && std::memcmp(a.salt, b.salt, KDF_SALT_SIZE) == 0;
+}
+
+// Returns the cached key for 'params', deriving it (and evicting the least recently
+// used slot) on a miss.
+const uint8_t* lookupKey(const KdfParams& params) {
+    CachedKey* slot = &secrets->cache[0];
+    for (CachedKey& entry : secrets->cache) {
+        if (entry.used && sameParams(entry.params, params)) {
+            entry.last_used = ++request_counter;
+            return entry.key;
+        }
+        if (!entry.used || (slot->used && entry.last_used < slot->last_used)) {
+            slot = &entry;
+        }
+    }
+    std::string password(secrets->password, secrets->password_size);
+    std::vector<uint8_t> key = deriveMasterKey(password, params);
+    explicit_bzero(&password[0], password.size());
+    slot->used = true;
+    slot->last_used = ++request_counter;
+    slot->params = params;
+    std::memcpy(slot->key, key.data(), AGENT_KEY_SIZE);
+    explicit_bzero(key.data(), key.size());
+    return slot->key;
+}
+
+// --- Socket server ---
+bool readFully(int fd, void* data, size_t size) {
+    char* out = static_cast<char*>(data);
+    for (size_t done = 0; done < size;) {
+        ssize_t n = recv(fd, out + done, size - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Answers one request on 'fd'. Only processes running as the agent's own user are served,
+// and only keys that are expensive to derive (agentServesKdf()).
+void serveClient(int fd) {
+    ucred peer = {};
+    socklen_t peer_size = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) != 0 || peer.uid != getuid()) {
+        return;
+    }
+    timeval timeout = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint8_t request[AGENT_DERIVE_REQUEST_SIZE];
+    if (!readFully(fd, request, 1)) {
+        return;
+    }
+    uint8_t response[1 + 1 + 4 + KDF_SALT_SIZE + AGENT_KEY_SIZE];
+    size_t response_size = 1;
+    response[0] = AGENT_ERROR;
+    try {
+        if (request[0] == AGENT_NEW_KEY) {
+            const KdfParams& params = secrets->new_archive_params;
+            const uint8_t* key = lookupKey(params);
+            response[0] = AGENT_OK;
+            response[1] = params.kdf;
+            std::memcpy(response + 2, &params.iterations, 4);
+            std::memcpy(response + 6, params.salt, KDF_SALT_SIZE);
+            std::memcpy(response + 6 + KDF_SALT_SIZE, key, AGENT_KEY_SIZE);
+            response_size = sizeof(response);
+        } else if (request[0] == AGENT_DERIVE && readFully(fd, request + 1, AGENT_DERIVE_REQUEST_SIZE - 1)) {
+            KdfParams params;
+            params.kdf = static_cast<KdfId>(request[1]);
+            std::memcpy(&params.iterations, request + 2, 4);
+            std::memcpy(params.salt, request + 6, KDF_SALT_SIZE);
+            if (agentServesKdf(params)) {
+                std::memcpy(response + 1, lookupKey(params), AGENT_KEY_SIZE);
+                response[0] = AGENT_OK;
+                response_size = 1 + AGENT_KEY_SIZE;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "tzar_agent: " << e.what() << std::endl;
+    }
+    send(fd, response, response_size, MSG_NOSIGNAL);
+    explicit_bzero(response, sizeof(response));
+}
+
+// Accepts requests on 'listener' until a stop signal or 'idle_timeout' seconds (0 = never)
+// without a request.
+int serve(int listener, int idle_timeout) {
+    pollfd pfd = {listener, POLLIN, 0};
+    while (!stop_requested) {
+        int ready = poll(&pfd, 1, idle_timeout > 0 ? idle_timeout * 1000 : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "tzar_agent: poll failed: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+        if (ready == 0) {
+            break; // Idle timeout
+        }
+        int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+        serveClient(client);
+        close(client);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // Usage: ./tzar_agent [--kdf-iterations=N] [--timeout=SECONDS] [--socket=PATH] [--foreground]
+    // Prints shell commands that set TZAR_AGENT_SOCK and TZAR_AGENT_PID, as in
+    //   eval "$(./tzar_agent)"
+    uint32_t iterations = KDF_DEFAULT_ITERATIONS;
+    int idle_timeout = 0;
+    std::string socket_path;
+    bool foreground = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--kdf-iterations=", 0) == 0) {
+            iterations = static_cast<uint32_t>(std::strtoul(arg.c_str() + 17, nullptr, 10));
+        } else if (arg.rfind("--timeout=", 0) == 0) {
+            idle_timeout = std::max(0, std::atoi(arg.c_str() + 10));
+        } else if (arg.rfind("--socket=", 0) == 0) {
+            socket_path = arg.substr(9);
+        } else if (arg == "--foreground") {
+            foreground = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--kdf-iterations=N] [--timeout=SECONDS] [--socket=PATH] [--foreground]\n";
+            std::cerr << "Caches password-derived keys for tzar_encrypt and tzar_decrypt.\n";
+            std::cerr << "Start it with: eval \"$(" << argv[0] << ")\"\n";
+            return 1;
+        }
+    }
+    if (iterations < KDF_MIN_ITERATIONS) {
+        std::cerr << "Error: --kdf-iterations must be at least " << KDF_MIN_ITERATIONS << ".\n";
+        return 1;
+    }
+
+    // Keep the keys out of core dumps and away from ptrace by other processes.
+    prctl(PR_SET_DUMPABLE, 0);
+    try {
+        secrets = allocateSecrets();
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // stdout carries the shell commands, so the prompt goes to stderr.
+    std::string password;
+    std::cerr << "Enter password for the key agent: ";
+    std::getline(std::cin, password);
+    if (password.empty() || password.size() > AGENT_MAX_PASSWORD) {
+        std::cerr << "Error: Password must be 1 to " << AGENT_MAX_PASSWORD << " bytes.\n";
+        wipeSecrets();
+        return 1;
+    }
+    std::memcpy(secrets->password, password.data(), password.size());
+    secrets->password_size = password.size();
+    explicit_bzero(&password[0], password.size());
+
+    KdfParams& params = secrets->new_archive_params;
+    params.kdf = KDF_PBKDF2_HMAC_SHA256;
+    params.iterations = iterations;
+    if (getrandom(params.salt, sizeof(params.salt), 0) != static_cast<ssize_t>(sizeof(params.salt))) {
+        std::cerr << "Error: Could not obtain random bytes: " << std::strerror(errno) << std::endl;
+        wipeSecrets();
+        return 1;
+    }
+
+    // A private directory keeps other users from even reaching the socket.
+    std::string socket_dir;
+    if (socket_path.empty()) {
+        const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+        std::string dir_template = std::string(runtime_dir && *runtime_dir ? runtime_dir : "/tmp") + "/tzar-XXXXXX";
+        if (mkdtemp(&dir_template[0]) == nullptr) {
+            std::cerr << "Error: Could not create socket directory: " << std::strerror(errno) << std::endl;
+            wipeSecrets();
+            return 1;
+        }
+        socket_dir = dir_template;
+        socket_path = socket_dir + "/agent.sock";
+    }
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    int listener = -1;
+    if (socket_path.size() < sizeof(address.sun_path)) {
+        std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    mode_t old_umask = umask(0177);
+    bool listening = listener >= 0 && bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 &&
+                     listen(listener, 64) == 0;
+    umask(old_umask);
+    if (!listening) {
+        std::cerr << "Error: Could not listen on " << socket_path << ": "
+                  << (listener >= 0 ? std::strerror(errno) : "invalid socket path") << std::endl;
+        if (!socket_dir.empty()) rmdir(socket_dir.c_str());
+        wipeSecrets();
+        return 1;
+    }
+
+    // Derive the key for new archives now, so the first batch job does not wait for it.
+    try {
+        lookupKey(params);
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        wipeSecrets();
+        return 1;
+    }
+
+    if (!foreground) {
+        pid_t child = fork();
+        if (child < 0) {
+            std::cerr << "Error: fork failed: " << std::strerror(errno) << std::endl;
+            wipeSecrets();
+            return 1;
+        }
+        if (child > 0) {
+            // The parent's copy of the key store is wiped; the child keeps serving.
+            std::cout << "TZAR_AGENT_SOCK=" << socket_path << "; export TZAR_AGENT_SOCK;\n";
+            std::cout << "TZAR_AGENT_PID=" << child << "; export TZAR_AGENT_PID;\n";
+            std::cout << "echo Agent pid " << child << ";\n";
+            wipeSecrets();
+            return 0;
+        }
+        // fork() does not inherit memory locks.
+        mlock(secrets, secrets_mapping_size);
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            if (null_fd > STDERR_FILENO) close(null_fd);
+        }
+    } else {
+        std::cout << "TZAR_AGENT_SOCK=" << socket_path << "; export TZAR_AGENT_SOCK;\n" << std::flush;
+    }
+
+    struct sigaction stop = {};
+    stop.sa_handler = onStopSignal;
+    sigaction(SIGTERM, &stop, nullptr);
+    sigaction(SIGINT, &stop, nullptr);
+    sigaction(SIGHUP, &stop, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    int status = serve(listener, idle_timeout);
+    close(listener);
+    unlink(socket_path.c_str());
+    if (!socket_dir.empty()) {
+        rmdir(socket_dir.c_str());
+    }
+    wipeSecrets();
+    return status;
+}
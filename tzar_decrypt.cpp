@@ -4,195 +4,617 @@
 #include <vector>
 #include <string>
 #include <cstdint>
-#include <sstream>
 #include <iomanip>
 #include <stdexcept>
 #include <limits> // For std::numeric_limits
 #include <filesystem> // For directory creation
+#include <cstring> // For std::memcpy, std::memcmp
+#include <thread> // For std::thread::hardware_concurrency
+#include <chrono> // For throughput measurement
+#include <algorithm> // For std::min, std::max
+#include <cstdlib> // For std::atoi, std::getenv
+#include <set> // For entries selected with --extract
+
+#include "libtzar/tzar_format.h"
+#include "libtzar/tzar_crypto.h"
+#include "libtzar/tzar_parallel.h"
+#include "libtzar/tzar_agent_protocol.h"
+#include "libtzar/tzar_index.h"
+#include "libtzar/tzar_extract.h"
 
 namespace fs = std::filesystem; // Alias for std::filesystem
 
-// --- Basic SHA256 Implementation (for password hashing) ---
-// This is a simplified, self-contained SHA256. NOT for production use.
-// Based on public domain implementations and FIPS 180-4.
-
-// Rotate right
-#define ROTR(x, n) ((x >> n) | (x << (32 - n)))
-
-// SHA256 functions
-#define CH(x, y, z) ((x & y) ^ (~x & z))
-#define MAJ(x, y, z) ((x & y) ^ (x & z) ^ (y & z))
-#define SIG0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
-#define SIG1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
-#define CAP_SIG0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ (x >> 3))
-#define CAP_SIG1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ (x >> 10))
-
-// SHA256 K constants
-static const uint32_t K[64] = {
-    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b94ca4f, 0x682e6ff3,
-    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+// --- Streaming payload decryption ---
+// Payloads are never loaded whole: file data is decrypted in DECRYPT_CHUNK_SIZE pieces
+// in one reused buffer and written out straight away, so memory use does not depend
+// on entry size. Version 4 payloads are opened a batch of AEAD chunks at a time.
+
+const size_t DECRYPT_CHUNK_SIZE = 4 << 20;
+
+// Thrown when a version 4 chunk fails its tag check: the password is wrong or the
+// archive was modified. Nothing from the failing batch has been handed out.
+class AuthenticationError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
 };
 
-// Initial hash values H0-H7
-static uint32_t H[8] = {
-    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
-    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+// How the archive's payloads are encrypted and where they end, plus the workers and
+// buffers used to open version 4 chunks (shared by all entries).
+struct PayloadCipher {
+    uint8_t format_version = 0;
+    std::streamoff entries_end = -1; // Start of the index (version 9); -1 reads to the end
+    std::vector<uint8_t> xor_key; // Versions 0-3
+    ArchiveKey archive_key;       // Versions 4 and 5
+    ParallelFor* workers = nullptr;
+    std::vector<char> sealed;
+    std::vector<char> plain;
+
+    bool authenticated() const { return format_version >= 4; }
 };
 
-// SHA256 compression function
-void sha256_transform(uint32_t state[8], const uint8_t block[64]) {
-    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
-    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
-    uint32_t W[64];
-
-    for (int i = 0; i < 16; ++i) {
-        W[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
-    }
-
-    for (int i = 16; i < 64; ++i) {
-        W[i] = CAP_SIG1(W[i - 2]) + W[i - 7] + CAP_SIG0(W[i - 15]) + W[i - 16];
-    }
-
-    for (int i = 0; i < 64; ++i) {
-        uint32_t T1 = h + SIG1(e) + CH(e, f, g) + K[i] + W[i];
-        uint32_t T2 = SIG0(a) + MAJ(a, b, c);
-        h = g;
-        g = f;
-        f = e;
-        e = d + T1;
-        d = c;
-        c = b;
-        b = a;
-        a = T1 + T2;
-    }
-
-    state[0] += a;
-    state[1] += b;
-    state[2] += c;
-    state[3] += d;
-    state[4] += e;
-    state[5] += f;
-    state[6] += g;
-    state[7] += h;
+// True while another entry header follows: until the index of a version 9 archive,
+// or the end of the file before that.
+bool moreEntries(std::ifstream& inFile, const PayloadCipher& cipher) {
+    if (cipher.entries_end >= 0) {
+        return inFile.tellg() < cipher.entries_end;
+    }
+    return inFile.peek() != EOF;
 }
 
-// Computes SHA256 hash of a byte vector. Returns 32-byte hash.
-std::vector<uint8_t> sha256(const std::vector<uint8_t>& data) {
-    uint32_t state[8];
-    for(int i = 0; i < 8; ++i) state[i] = H[i]; // Reset state for each call
+// Reads one entry's payload from the archive, decrypting it and keeping the CRC-32C of
+// the plaintext. 'entry_index' is the entry's position in the archive (version 4 nonces).
+class PayloadReader {
+public:
+    PayloadReader(std::ifstream& inFile, const EntryHeader& entry, uint32_t entry_index, PayloadCipher& cipher)
+        : inFile_(inFile), entry_(entry), entry_index_(entry_index), cipher_(cipher),
+          remaining_(entry.size), unread_(entry.size) {
+        if (cipher_.authenticated()) {
+            chunk_count_ = aeadChunkCount(entry.size);
+            aad_ = entryHeaderBytes(entry);
+        }
+    }
 
-    std::vector<uint8_t> padded_data = data;
-    uint64_t bit_len = data.size() * 8;
+    uint64_t remaining() const { return remaining_; }
+    uint32_t crc() const { return crc_; }
 
-    // Pad with a '1' bit
-    padded_data.push_back(0x80);
+    // Reads and decrypts the next 'len' bytes of the payload into 'data'.
+    void read(char* data, size_t len) {
+        if (len > remaining_) {
+            throw std::runtime_error("Entry content is shorter than its metadata says.");
+        }
+        if (!cipher_.authenticated()) {
+            inFile_.read(data, len);
+            if (!inFile_) {
+                throw std::runtime_error("Error reading binary data.");
+            }
+            xor_cipher_inplace(data, len, cipher_.xor_key, position_);
+            crc_ = crc32c_update(crc_, data, len);
+            position_ += len;
+            remaining_ -= len;
+            return;
+        }
+        while (len > 0) {
+            if (plain_position_ == plain_length_) {
+                openBatch();
+                plain_position_ = skip_; // Start of a restricted range within the first chunk
+                skip_ = 0;
+            }
+            size_t n = std::min(len, plain_length_ - plain_position_);
+            std::memcpy(data, cipher_.plain.data() + plain_position_, n);
+            plain_position_ += n;
+            data += n;
+            len -= n;
+            remaining_ -= n;
+        }
+    }
 
-    // Pad with zeros until length is 448 mod 512 bits (56 mod 64 bytes)
-    while ((padded_data.size() % 64) != 56) {
-        padded_data.push_back(0x00);
+    // Restricts the reader to bytes [offset, offset + length) of the content. Must be called
+    // before anything is read. The stream is moved straight to the first chunk holding the
+    // range and no chunk after the last one is read; crc() then covers only those chunks.
+    void restrict(uint64_t offset, uint64_t length) {
+        if (offset > entry_.size || length > entry_.size - offset) {
+            throw std::runtime_error("Range is outside of '" + entry_.name + "'.");
+        }
+        std::streampos start = inFile_.tellg();
+        if (!cipher_.authenticated()) {
+            inFile_.seekg(start + static_cast<std::streamoff>(offset));
+            position_ = offset;
+        } else {
+            uint64_t first = offset / AEAD_CHUNK_SIZE;
+            uint64_t end = length == 0 ? first : (offset + length + AEAD_CHUNK_SIZE - 1) / AEAD_CHUNK_SIZE;
+            inFile_.seekg(start + static_cast<std::streamoff>(first * (AEAD_CHUNK_SIZE + AEAD_TAG_SIZE)));
+            next_chunk_ = first;
+            chunk_count_ = end;
+            unread_ = std::min<uint64_t>(entry_.size, end * AEAD_CHUNK_SIZE) - std::min(entry_.size, first * AEAD_CHUNK_SIZE);
+            skip_ = offset - first * AEAD_CHUNK_SIZE;
+        }
+        if (!inFile_) {
+            throw std::runtime_error("Error seeking in archive.");
+        }
+        remaining_ = length;
     }
 
-    // Append 64-bit message length
-    for (int i = 7; i >= 0; --i) {
-        padded_data.push_back((bit_len >> (8 * i)) & 0xFF);
+    // Opens the first batch of a version 4 payload up front, so that entries of up to
+    // AEAD_BATCH_CHUNKS chunks are fully authenticated before anything is created for them.
+    void authenticateAhead() {
+        if (cipher_.authenticated() && next_chunk_ == 0) {
+            openBatch();
+        }
     }
 
-    for (size_t i = 0; i < padded_data.size(); i += 64) {
-        sha256_transform(state, &padded_data[i]);
+    // Reads the whole (small) remaining payload, e.g. a link target.
+    std::string readAll() {
+        std::string data(remaining_, '\0');
+        read(&data[0], data.size());
+        return data;
     }
 
-    std::vector<uint8_t> hash(32);
-    for (int i = 0; i < 8; ++i) {
-        hash[i * 4] = (state[i] >> 24) & 0xFF;
-        hash[i * 4 + 1] = (state[i] >> 16) & 0xFF;
-        hash[i * 4 + 2] = (state[i] >> 8) & 0xFF;
-        hash[i * 4 + 3] = state[i] & 0xFF;
+    // Consumes what is left (e.g. after a skipped entry) so the CRC and the tags still
+    // cover it.
+    void finish(std::vector<char>& buffer) {
+        while (remaining_ > 0) {
+            read(buffer.data(), std::min<uint64_t>(remaining_, buffer.size()));
+        }
+        if (next_chunk_ < chunk_count_) {
+            openBatch(); // The single empty chunk of an empty entry
+        }
+    }
+
+    // Skips the rest of the payload without decrypting it, after an AuthenticationError.
+    void discard() {
+        uint64_t stored = unread_ + (chunk_count_ - next_chunk_) * AEAD_TAG_SIZE;
+        inFile_.seekg(static_cast<std::streamoff>(stored), std::ios::cur);
+        if (!inFile_) {
+            throw std::runtime_error("Error reading binary data.");
+        }
+        remaining_ = unread_ = 0;
+        next_chunk_ = chunk_count_;
+    }
+
+private:
+    // Reads the next batch of sealed chunks and opens them across the workers, each also
+    // checksumming its plaintext.
+    void openBatch() {
+        size_t count = std::min<uint64_t>(AEAD_BATCH_CHUNKS, chunk_count_ - next_chunk_);
+        size_t len = std::min<uint64_t>(unread_, count * AEAD_CHUNK_SIZE);
+        inFile_.read(cipher_.sealed.data(), len + count * AEAD_TAG_SIZE);
+        if (!inFile_) {
+            throw std::runtime_error("Error reading binary data.");
+        }
+        uint32_t chunk_crcs[AEAD_BATCH_CHUNKS];
+        bool authentic[AEAD_BATCH_CHUNKS];
+        cipher_.workers->run(count, [&](size_t i) {
+            size_t offset = i * AEAD_CHUNK_SIZE;
+            size_t chunk_len = std::min(len - offset, AEAD_CHUNK_SIZE);
+            authentic[i] = aead_open_chunk(cipher_.archive_key, entry_index_, static_cast<uint32_t>(next_chunk_ + i),
+                                           aad_, cipher_.sealed.data() + i * (AEAD_CHUNK_SIZE + AEAD_TAG_SIZE),
+                                           cipher_.plain.data() + offset, chunk_len);
+            chunk_crcs[i] = authentic[i] ? crc32c_update(0, cipher_.plain.data() + offset, chunk_len) : 0;
+        });
+        for (size_t i = 0; i < count; ++i) {
+            if (!authentic[i]) {
+                next_chunk_ += count;
+                unread_ -= len;
+                throw AuthenticationError("Authentication failed for '" + entry_.name +
+                                          "' (wrong password or tampered archive).");
+            }
+            crc_ = crc32c_combine(crc_, chunk_crcs[i], std::min(len - i * AEAD_CHUNK_SIZE, AEAD_CHUNK_SIZE));
+        }
+        next_chunk_ += count;
+        unread_ -= len;
+        plain_position_ = 0;
+        plain_length_ = len;
+    }
+
+    std::ifstream& inFile_;
+    const EntryHeader& entry_;
+    uint32_t entry_index_;
+    PayloadCipher& cipher_;
+    uint64_t remaining_; // Plaintext not yet handed out
+    uint64_t unread_;    // Plaintext not yet read from the archive (version 4)
+    uint64_t position_ = 0; // Offset of the next byte in the content (XOR key position)
+    size_t skip_ = 0;       // Bytes of the first chunk before a restricted range
+    uint32_t crc_ = 0;
+    std::string aad_;
+    uint64_t chunk_count_ = 0;
+    uint64_t next_chunk_ = 0;
+    size_t plain_position_ = 0;
+    size_t plain_length_ = 0;
+};
+
+// Hands a PayloadReader's plaintext to extractEntry() through the chunk buffer.
+class DecryptedPayload : public PayloadSource {
+public:
+    DecryptedPayload(PayloadReader& reader, std::vector<char>& buffer) : reader_(reader), buffer_(buffer) {}
+
+    uint64_t remaining() const override { return reader_.remaining(); }
+
+    size_t next(const char*& data, size_t max) override {
+        size_t len = std::min<uint64_t>(std::min<uint64_t>(reader_.remaining(), max), buffer_.size());
+        reader_.read(buffer_.data(), len);
+        data = buffer_.data();
+        return len;
+    }
+
+private:
+    PayloadReader& reader_;
+    std::vector<char>& buffer_;
+};
+
+// Opens the first chunk of the first entry, then rewinds to it. Lets archives from
+// before the key check value (versions 4 to 6) reject a wrong password up front; an
+// empty archive has nothing to check.
+bool firstChunkOpens(std::ifstream& inFile, const PayloadCipher& cipher) {
+    const std::streampos first_entry = inFile.tellg();
+    if (inFile.peek() == EOF) {
+        return true;
+    }
+    EntryHeader entry = readEntryHeader(inFile, cipher.format_version);
+    size_t len = std::min<uint64_t>(entry.size, AEAD_CHUNK_SIZE);
+    std::vector<char> sealed(len + AEAD_TAG_SIZE);
+    std::vector<char> plain(len);
+    if (!inFile.read(sealed.data(), sealed.size())) {
+        throw std::runtime_error("Error reading binary data.");
     }
-    return hash;
+    bool authentic = aead_open_chunk(cipher.archive_key, 0, 0, entryHeaderBytes(entry), sealed.data(),
+                                     plain.data(), len);
+    inFile.seekg(first_entry);
+    return authentic;
 }
 
-// --- XOR Encryption/Decryption Function ---
-// Key is repeated if data is longer than key.
-std::vector<char> xor_cipher(const std::vector<char>& data, const std::vector<uint8_t>& key) {
-    if (key.empty()) {
-        // If key is empty, return data unchanged (or throw error, depending on desired behavior)
-        return data;
+// --- Random access (--extract, --cat) ---
+// A version 9 archive is read from the offsets in its index: reaching an entry costs one
+// seek, whatever its position. Older archives have their headers walked, seeking over the
+// payloads in between, so reaching an entry costs one header read per entry before it,
+// never their content. As every chunk has its own nonce and tag, a byte range of an entry
+// is decrypted by seeking straight to the chunks that hold it.
+
+// Seeks over an entry's payload without reading it.
+void skipPayload(std::ifstream& inFile, const EntryHeader& entry, uint8_t format_version) {
+    uint64_t stored = format_version >= 4 ? aeadStoredSize(entry.size) : entry.size;
+    inFile.seekg(static_cast<std::streamoff>(stored), std::ios::cur);
+    if (!inFile) {
+        throw std::runtime_error("Error seeking past '" + entry.name + "' in archive.");
     }
-    std::vector<char> output = data;
-    for (size_t i = 0; i < data.size(); ++i) {
-        output[i] = data[i] ^ key[i % key.size()];
+}
+
+// Throws unless a walk over the whole archive found as many entries as its index lists.
+void checkEntryCount(uint32_t entry_count, const std::vector<IndexedEntry>* index) {
+    if (index != nullptr && entry_count != index->size()) {
+        throw std::runtime_error("Archive has " + std::to_string(entry_count) + " entries, but its index lists " +
+                                 std::to_string(index->size()) + ".");
     }
-    return output;
 }
 
-// --- File I/O Helpers ---
-std::string readString(std::ifstream& inFile) {
-    uint32_t len;
-    inFile.read(reinterpret_cast<char*>(&len), sizeof(len));
-    if (!inFile) throw std::runtime_error("Error reading string length.");
-    std::vector<char> buffer(len);
-    inFile.read(buffer.data(), len);
-    if (!inFile) throw std::runtime_error("Error reading string data.");
-    return std::string(buffer.begin(), buffer.end());
+// Seeks to the entry at 'entry_index' in the index and reads its header, which has to
+// match the index's copy of it.
+EntryHeader readIndexedEntry(std::ifstream& inFile, const PayloadCipher& cipher,
+                             const std::vector<IndexedEntry>& index, uint32_t entry_index) {
+    const IndexedEntry& indexed = index[entry_index];
+    inFile.seekg(static_cast<std::streamoff>(indexed.offset));
+    if (!inFile) {
+        throw std::runtime_error("Error seeking to '" + indexed.header.name + "' in archive.");
+    }
+    EntryHeader entry = readEntryHeader(inFile, cipher.format_version);
+    if (entryHeaderBytes(entry) != entryHeaderBytes(indexed.header)) {
+        throw std::runtime_error("Entry '" + indexed.header.name + "' does not match the archive index.");
+    }
+    return entry;
 }
 
-std::vector<char> readBinaryData(std::ifstream& inFile, bool read_content = true) {
-    uint64_t size;
-    inFile.read(reinterpret_cast<char*>(&size), sizeof(size));
-    if (!inFile) throw std::runtime_error("Error reading binary data size.");
-    
-    std::vector<char> data;
-    if (read_content) {
-        data.resize(size);
-        if (size > 0) {
-            inFile.read(data.data(), size);
-            if (!inFile) throw std::runtime_error("Error reading binary data.");
+// Positions 'inFile' just after the header of the first entry called 'name', which is
+// returned in 'entry' with its position in the archive in 'entry_index'. Without an index
+// the headers are walked from 'first_entry'. Returns false if there is no such entry.
+bool findEntry(std::ifstream& inFile, const PayloadCipher& cipher, const std::vector<IndexedEntry>* index,
+               std::streampos first_entry, const std::string& name, EntryHeader& entry, uint32_t& entry_index) {
+    if (index != nullptr) {
+        for (entry_index = 0; entry_index < index->size(); ++entry_index) {
+            if ((*index)[entry_index].header.name == name) {
+                entry = readIndexedEntry(inFile, cipher, *index, entry_index);
+                return true;
+            }
         }
-    } else {
-        inFile.seekg(size, std::ios_base::cur);
-        if (!inFile) throw std::runtime_error("Error skipping binary data content.");
+        return false;
     }
-    return data;
+    inFile.seekg(first_entry);
+    for (entry_index = 0; moreEntries(inFile, cipher); ++entry_index) {
+        entry = readEntryHeader(inFile, cipher.format_version);
+        if (entry.name == name) {
+            return true;
+        }
+        skipPayload(inFile, entry, cipher.format_version);
+    }
+    return false;
 }
 
-void writeBinaryData(std::ofstream& outFile, const std::vector<char>& data) {
-    uint64_t size = data.size();
-    outFile.write(reinterpret_cast<const char*>(&size), sizeof(size));
-    outFile.write(data.data(), size);
+// Writes bytes [offset, offset + length) of the regular file 'name' to stdout; 'length'
+// is clipped to the end of the file. A whole file is also checked against its CRC. Hard
+// links are followed to the earlier entry holding the data.
+// Returns false if the entry does not exist or is not a regular file.
+bool catEntry(std::ifstream& inFile, PayloadCipher& cipher, const std::vector<IndexedEntry>* index,
+              std::string name, uint64_t offset, uint64_t length) {
+    std::vector<char> buffer(DECRYPT_CHUNK_SIZE);
+    const std::streampos first_entry = inFile.tellg();
+    EntryHeader entry;
+    uint32_t entry_index = 0;
+    for (int link_hops = 0;; ++link_hops) {
+        if (!findEntry(inFile, cipher, index, first_entry, name, entry, entry_index)) {
+            std::cerr << "Error: '" << name << "' not found in archive.\n";
+            return false;
+        }
+        if (entry.type != ENTRY_HARDLINK) {
+            break;
+        }
+        PayloadReader payload(inFile, entry, entry_index, cipher);
+        std::string target = payload.readAll();
+        payload.finish(buffer);
+        if (target == name || link_hops >= 40) { // Malformed link chain
+            std::cerr << "Error: '" << name << "' not found in archive.\n";
+            return false;
+        }
+        name = target;
+    }
+    if (entry.type != ENTRY_FILE) {
+        std::cerr << "Error: '" << name << "' is not a regular file.\n";
+        return false;
+    }
+    if (offset > entry.size) {
+        std::cerr << "Error: Offset " << offset << " is beyond the end of '" << name << "' ("
+                  << entry.size << " bytes).\n";
+        return false;
+    }
+    length = std::min(length, entry.size - offset);
+    bool whole = offset == 0 && length == entry.size;
+
+    PayloadReader payload(inFile, entry, entry_index, cipher);
+    if (!whole) {
+        payload.restrict(offset, length);
+    }
+    while (payload.remaining() > 0) {
+        size_t len = std::min<uint64_t>(payload.remaining(), buffer.size());
+        payload.read(buffer.data(), len);
+        std::cout.write(buffer.data(), len);
+    }
+    std::cout.flush();
+    if (!std::cout) {
+        throw std::runtime_error("Error writing to standard output.");
+    }
+    if (whole) {
+        payload.finish(buffer);
+        if (cipher.format_version >= 1 && payload.crc() != entry.crc) {
+            throw std::runtime_error("Checksum mismatch for '" + name + "' (wrong password or corrupted data).");
+        }
+    }
+    return true;
 }
 
+// --- Listing (--list) ---
+// A version 9 archive is listed from its index: one read at the end of the file and one
+// decryption, whatever the number of entries. Older archives have their headers walked.
 
-int main(int argc, char* argv[]) {
-    // Usage: ./tzar_decrypt <input_tzar2_file> [password]
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <input_tzar2_file> [password]\n";
-        std::cerr << "If password is not provided, it will be prompted.\n";
-        return 1;
+void listArchive(std::ifstream& inFile, const PayloadCipher& cipher, const std::vector<IndexedEntry>* index) {
+    std::vector<EntryHeader> entries;
+    if (index != nullptr) {
+        entries.reserve(index->size());
+        for (const IndexedEntry& entry : *index) {
+            entries.push_back(entry.header);
+        }
+    } else {
+        while (moreEntries(inFile, cipher)) {
+            entries.push_back(readEntryHeader(inFile, cipher.format_version));
+            skipPayload(inFile, entries.back(), cipher.format_version);
+        }
+    }
+    static const char TYPE_LETTERS[] = "-dlhs?";
+    uint64_t total_bytes = 0;
+    for (const EntryHeader& entry : entries) {
+        char type = TYPE_LETTERS[std::min<size_t>(entry.type, sizeof(TYPE_LETTERS) - 2)];
+        std::cout << type << std::setw(15) << entry.size << "  " << entry.name << "\n";
+        total_bytes += entry.size;
     }
+    std::cout << entries.size() << " entries, " << total_bytes << " bytes"
+              << (index != nullptr ? " (from the archive index).\n" : ".\n");
+}
 
-    std::string input_tzar2_path = argv[1];
-    std::string password;
+// --- Conversion to .tzar (--to-tzar) ---
+// Decrypts the whole archive straight into an unencrypted one: each entry header is
+// copied and its content streams through one buffer, so nothing is extracted to the
+// filesystem and the archive is read and written once each.
+
+// Writes the plaintext archive to 'output_path' and returns the number of entries, which
+// must match the archive's index if it has one.
+// Throws std::runtime_error (the caller removes the partial output).
+int convertToTzar(std::ifstream& inFile, PayloadCipher& cipher, const std::vector<IndexedEntry>* index,
+                  const std::string& output_path) {
+    std::ofstream outFile(output_path, std::ios::binary);
+    if (!outFile.is_open()) {
+        throw std::runtime_error("Could not open output .tzar file: " + output_path);
+    }
+    writeArchiveHeader(outFile);
+
+    std::vector<char> buffer(DECRYPT_CHUNK_SIZE); // Reused for every chunk of every entry
+    int entry_count = 0;
+    for (uint32_t entry_index = 0; moreEntries(inFile, cipher); ++entry_index) {
+        EntryHeader entry = readEntryHeader(inFile, cipher.format_version);
+        const std::streampos header_start = outFile.tellp();
+        std::string header = entryHeaderBytes(entry);
+        outFile.write(header.data(), header.size());
+
+        PayloadReader payload(inFile, entry, entry_index, cipher);
+        while (payload.remaining() > 0) {
+            size_t len = std::min<uint64_t>(payload.remaining(), buffer.size());
+            payload.read(buffer.data(), len);
+            outFile.write(buffer.data(), len);
+        }
+        payload.finish(buffer);
 
-    if (argc == 3) {
-        password = argv[2];
-    } else {
-        std::cout << "Enter password for decryption: ";
-        std::getline(std::cin, password);
+        if (cipher.format_version >= 1 && payload.crc() != entry.crc) {
+            throw std::runtime_error("Checksum mismatch for '" + entry.name + "' (wrong password or corrupted data).");
+        }
+        if (cipher.format_version < 1) {
+            // Version 0 stored no checksum: fill in the one of the decrypted content.
+            entry.crc = payload.crc();
+            header = entryHeaderBytes(entry);
+            outFile.seekp(header_start);
+            outFile.write(header.data(), header.size());
+            outFile.seekp(0, std::ios::end);
+        }
+        if (!outFile) {
+            throw std::runtime_error("Error writing output .tzar file: " + output_path);
+        }
+        entry_count++;
+    }
+    checkEntryCount(entry_count, index);
+    outFile.close();
+    if (!outFile) {
+        throw std::runtime_error("Error writing output .tzar file: " + output_path);
+    }
+    return entry_count;
+}
+
+// --- Integrity test mode (--test) ---
+// Versions 0-3 go through the shared --test pipeline (tzar_extract.h), whose workers undo
+// the XOR cipher on each chunk before checksumming it. Nothing is written to disk.
+
+// Opens and verifies every entry of a version 4 archive without writing anything. The
+// chunks of each batch are opened in parallel by the PayloadReader, so entries are simply
+// read in order; a failed tag skips the rest of that entry. The headers must match the
+// archive's index, if it has one.
+bool testSealedArchive(std::ifstream& inputArchive, unsigned worker_count, PayloadCipher& cipher,
+                       const std::vector<IndexedEntry>* index) {
+    auto start_time = std::chrono::steady_clock::now();
+
+    std::vector<std::string> failures;
+    std::vector<char> buffer(DECRYPT_CHUNK_SIZE);
+    uint32_t entry_index = 0;
+    uint64_t total_bytes = 0;
+    bool index_matches = true;
+    std::string read_error;
+    try {
+        for (; moreEntries(inputArchive, cipher); ++entry_index) {
+            EntryHeader entry = readEntryHeader(inputArchive, cipher.format_version);
+            if (index != nullptr && (entry_index >= index->size() ||
+                                     entryHeaderBytes((*index)[entry_index].header) != entryHeaderBytes(entry))) {
+                index_matches = false;
+            }
+            PayloadReader payload(inputArchive, entry, entry_index, cipher);
+            try {
+                payload.finish(buffer);
+                if (payload.crc() != entry.crc) {
+                    failures.push_back(entry.name);
+                }
+            } catch (const AuthenticationError&) {
+                failures.push_back(entry.name);
+                payload.discard();
+            }
+            total_bytes += entry.size;
+        }
+    } catch (const std::exception& e) {
+        read_error = e.what();
+    }
+    if (index != nullptr && entry_index != index->size()) {
+        index_matches = false;
     }
 
-    if (password.empty()) {
-        std::cerr << "Error: Password cannot be empty for decryption.\n";
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    double mb_per_sec = seconds > 0 ? (total_bytes / (1024.0 * 1024.0)) / seconds : 0.0;
+
+    for (const auto& name : failures) {
+        std::cerr << "FAILED: " << name << " (authentication failed: wrong password or tampered data)\n";
+    }
+    std::cout << "Tested " << entry_index << " entries, " << total_bytes << " bytes in "
+              << std::fixed << std::setprecision(2) << seconds << " s ("
+              << std::setprecision(1) << mb_per_sec << " MB/s, " << worker_count << " workers).\n";
+    if (!read_error.empty()) {
+        std::cerr << "Error during testing: " << read_error << std::endl;
+        std::cerr << "Archive might be corrupted or incomplete.\n";
+        return false;
+    }
+    if (!failures.empty()) {
+        std::cerr << failures.size() << " entries failed verification.\n";
+        return false;
+    }
+    if (!index_matches) {
+        std::cerr << "Error: The archive index does not match the entries.\n";
+        return false;
+    }
+    std::cout << "All entries OK.\n";
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    // Usage: ./tzar_decrypt [--test] [--threads=N] [--extract=NAME ...] <input_tzar2_file> [password]
+    //        ./tzar_decrypt --cat=NAME [--offset=N] [--length=N] <input_tzar2_file> [password]
+    //        ./tzar_decrypt --to-tzar [--threads=N] <input_tzar2_file> [password]
+    //        ./tzar_decrypt --list <input_tzar2_file> [password]
+    // Exits with DECRYPT_EXIT_WRONG_PASSWORD if the password is wrong.
+    bool test_mode = false;
+    bool to_tzar = false;
+    bool list_mode = false;
+    unsigned worker_count = std::max(1u, std::thread::hardware_concurrency());
+    std::set<std::string> files_to_extract;
+    std::string cat_name;
+    uint64_t cat_offset = 0;
+    uint64_t cat_length = UINT64_MAX;
+    bool has_range = false;
+    int argi = 1;
+    for (; argi < argc && std::string(argv[argi]).rfind("--", 0) == 0; ++argi) {
+        std::string option = argv[argi];
+        if (option == "--test") {
+            test_mode = true;
+        } else if (option == "--to-tzar") {
+            to_tzar = true;
+        } else if (option == "--list") {
+            list_mode = true;
+        } else if (option.rfind("--threads=", 0) == 0) {
+            worker_count = std::max(1, std::atoi(option.c_str() + 10));
+        } else if (option.rfind("--extract=", 0) == 0) {
+            files_to_extract.insert(option.substr(10));
+        } else if (option.rfind("--cat=", 0) == 0) {
+            cat_name = option.substr(6);
+        } else if (option.rfind("--offset=", 0) == 0) {
+            cat_offset = std::strtoull(option.c_str() + 9, nullptr, 10);
+            has_range = true;
+        } else if (option.rfind("--length=", 0) == 0) {
+            cat_length = std::strtoull(option.c_str() + 9, nullptr, 10);
+            has_range = true;
+        } else {
+            std::cerr << "Error: Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    if (argi >= argc) {
+        std::cerr << "Usage: " << argv[0] << " [--test] [--threads=N] [--extract=NAME ...] <input_tzar2_file> [password]\n";
+        std::cerr << "       " << argv[0] << " --cat=NAME [--offset=N] [--length=N] <input_tzar2_file> [password]\n";
+        std::cerr << "       " << argv[0] << " --to-tzar [--threads=N] <input_tzar2_file> [password]\n";
+        std::cerr << "       " << argv[0] << " --list <input_tzar2_file> [password]\n";
+        std::cerr << "If password is not provided, the key comes from the tzar_agent named by "
+                  << AGENT_SOCKET_ENV << ", or the password is prompted.\n";
+        std::cerr << "--test decrypts and verifies every entry without writing any files.\n";
+        std::cerr << "--extract restores only the named entries; --cat writes (a byte range of) one file to stdout.\n";
+        std::cerr << "--to-tzar writes the decrypted archive as <input_stem>.tzar instead of extracting it.\n";
+        std::cerr << "--list prints the type, size and name of every entry.\n";
+        return 1;
+    }
+    if (list_mode && (test_mode || to_tzar || !files_to_extract.empty() || !cat_name.empty())) {
+        std::cerr << "Error: --list cannot be combined with --test, --to-tzar, --extract or --cat.\n";
+        return 1;
+    }
+    if (to_tzar && (test_mode || !files_to_extract.empty() || !cat_name.empty())) {
+        std::cerr << "Error: --to-tzar cannot be combined with --test, --extract or --cat.\n";
+        return 1;
+    }
+    if (!cat_name.empty() && (test_mode || !files_to_extract.empty())) {
+        std::cerr << "Error: --cat cannot be combined with --test or --extract.\n";
+        return 1;
+    }
+    if (has_range && cat_name.empty()) {
+        std::cerr << "Error: --offset and --length require --cat.\n";
         return 1;
     }
 
-    std::vector<uint8_t> password_bytes(password.begin(), password.end());
-    std::vector<uint8_t> decryption_key = sha256(password_bytes);
+    std::string input_tzar2_path = argv[argi];
 
     std::ifstream inFile(input_tzar2_path, std::ios::binary);
     if (!inFile.is_open()) {
@@ -200,18 +622,148 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Read encryption flag
-    uint8_t encryption_flag = inFile.get();
-    if (inFile.eof()) {
-        std::cerr << "Error: Unexpected end of file while reading encryption flag.\n";
+    // Read encryption flag, magic, format version and (version 4 and later) cipher, KDF
+    // parameters, archive nonce and key check value
+    EncryptedArchiveHeader archive;
+    std::streamoff entries_start = 0;
+    try {
+        archive = readEncryptedArchiveHeader(inFile);
+        entries_start = inFile.tellg();
+        if (archive.cipher == CIPHER_AES_256_GCM && !aes_gcm_supported()) {
+            throw std::runtime_error("Archive uses AES-256-GCM, which needs a CPU with AES-NI and PCLMULQDQ.");
+        }
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
         inFile.close();
         return 1;
     }
-    if (encryption_flag != 0x01) {
-        std::cerr << "Error: Not an encrypted .tzar2 file or invalid format.\n";
+
+    std::vector<uint8_t> decryption_key;
+    const char* agent_socket = std::getenv(AGENT_SOCKET_ENV);
+    if (argc == argi + 1 && agent_socket != nullptr && *agent_socket != '\0') {
+        try {
+            decryption_key = agentDeriveKey(agent_socket, archive.kdf);
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            inFile.close();
+            return 1;
+        }
+    } else {
+        std::string password;
+
+        if (argc == argi + 2) {
+            password = argv[argi + 1];
+        } else {
+            // With --cat, stdout carries the file content
+            (cat_name.empty() ? std::cout : std::cerr) << "Enter password for decryption: ";
+            std::getline(std::cin, password);
+        }
+
+        if (password.empty()) {
+            std::cerr << "Error: Password cannot be empty for decryption.\n";
+            inFile.close();
+            return 1;
+        }
+
+        decryption_key = deriveMasterKey(password, archive.kdf);
+    }
+
+    // Reject a wrong password before anything is read or created. From version 8 the
+    // content key is a data key that only unwraps with the right password; version 7
+    // headers carry a key check value, versions 4 to 6 have the first chunk tried below.
+    bool password_ok = archive.hasWrappedKey() ? unwrapDataKey(decryption_key, archive, decryption_key)
+                                               : keyCheckMatches(archive, decryption_key);
+
+    ParallelFor workers(worker_count);
+    PayloadCipher cipher;
+    const uint8_t format_version = archive.version;
+    cipher.format_version = format_version;
+    if (cipher.authenticated()) {
+        cipher.archive_key = deriveArchiveKey(archive.cipher, decryption_key, archive.nonce, format_version);
+        cipher.workers = &workers;
+        cipher.sealed.resize(AEAD_BATCH_CHUNKS * (AEAD_CHUNK_SIZE + AEAD_TAG_SIZE));
+        cipher.plain.resize(AEAD_BATCH_CHUNKS * AEAD_CHUNK_SIZE);
+    } else {
+        cipher.xor_key = decryption_key;
+    }
+
+    if (password_ok && cipher.authenticated() && !archive.hasWrappedKey() && !archive.hasKeyCheck()) {
+        try {
+            password_ok = firstChunkOpens(inFile, cipher);
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error during decryption: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (!password_ok) {
+        std::cerr << "Error: Wrong password." << std::endl;
+        return DECRYPT_EXIT_WRONG_PASSWORD;
+    }
+
+    // The entries of a version 9 archive stop where its index starts. The index is opened
+    // in every mode: that authenticates the footer's entry count and end of the entries,
+    // and gives --cat and --extract the offsets to seek to.
+    std::vector<IndexedEntry> index;
+    if (archive.hasIndex()) {
+        try {
+            ArchiveIndexFooter footer = readArchiveIndexFooter(inFile, entries_start);
+            cipher.entries_end = static_cast<std::streamoff>(footer.entries_end);
+            if (!readArchiveIndex(inFile, cipher.archive_key, footer, entries_start, index)) {
+                throw std::runtime_error("Archive index failed authentication (tampered data).");
+            }
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    const std::vector<IndexedEntry>* archive_index = archive.hasIndex() ? &index : nullptr;
+
+    if (list_mode) {
+        try {
+            listArchive(inFile, cipher, archive_index);
+            return 0;
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (test_mode) {
+        const std::vector<uint8_t>& key = cipher.xor_key;
+        bool ok = cipher.authenticated()
+                      ? testSealedArchive(inFile, worker_count, cipher, archive_index)
+                      : testArchive(inFile, format_version, worker_count, {},
+                                    [&key](char* data, size_t length, uint64_t offset) {
+                                        xor_cipher_inplace(data, length, key, offset);
+                                    });
         inFile.close();
-        return 1;
+        return ok ? 0 : 1;
+    }
+    if (!cat_name.empty()) {
+        try {
+            return catEntry(inFile, cipher, archive_index, cat_name, cat_offset, cat_length) ? 0 : 1;
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error during decryption: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (to_tzar) {
+        std::string output_tzar_path = fs::path(input_tzar2_path).stem().string() + ".tzar";
+        std::error_code ec;
+        if (fs::equivalent(input_tzar2_path, output_tzar_path, ec)) {
+            std::cerr << "Error: Output " << output_tzar_path << " would overwrite the input archive.\n";
+            return 1;
+        }
+        try {
+            int entry_count = convertToTzar(inFile, cipher, archive_index, output_tzar_path);
+            std::cout << "Decryption complete. " << entry_count << " entries written to: " << output_tzar_path << std::endl;
+            return 0;
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error during decryption: " << e.what() << std::endl;
+            fs::remove(output_tzar_path, ec);
+            return 1;
+        }
     }
+    bool extract_all = files_to_extract.empty();
 
     // Determine output directory (e.g., same as archive name without extension)
     fs::path output_base_path = fs::path(input_tzar2_path).stem();
@@ -219,47 +771,61 @@ int main(int argc, char* argv[]) {
 
     try {
         int extracted_count = 0;
-        while (inFile.peek() != EOF) {
-            std::string filename = readString(inFile);
-            std::vector<char> encrypted_content = readBinaryData(inFile);
-
-            // Decrypt the file content
-            std::vector<char> decrypted_content = xor_cipher(encrypted_content, decryption_key);
-
-            fs::path outputPath = output_base_path / filename; // Path relative to new output directory
-
-            // Create parent directories if they don't exist
-            if (outputPath.has_parent_path()) {
-                fs::create_directories(outputPath.parent_path());
+        int checksum_failures = 0;
+        ExtractState extract_state;
+        std::vector<char> buffer(DECRYPT_CHUNK_SIZE); // Reused for every chunk of every entry
+        int skipped_count = 0;
+        // Decrypts the content while writing it; paths are relative to the new output directory.
+        // A version 4 chunk that fails authentication aborts the extraction.
+        auto extract_one = [&](const EntryHeader& entry, uint32_t entry_index) {
+            PayloadReader payload(inFile, entry, entry_index, cipher);
+            payload.authenticateAhead();
+            DecryptedPayload source(payload, buffer);
+            if (extractEntry(entry, source, output_base_path, extract_state)) {
+                extracted_count++;
             }
+            payload.finish(buffer);
 
-            // Handle directory entries (empty content)
-            if (decrypted_content.empty()) { // This entry represents a directory
-                if (fs::exists(outputPath)) {
-                    if (fs::is_directory(outputPath)) {
-                        std::cout << "Directory already exists: " << filename << "\n";
-                    } else {
-                        std::cerr << "Warning: Cannot create directory '" << filename << "' because a file with that name already exists. Skipping.\n";
-                        continue; 
-                    }
-                } else {
-                    fs::create_directories(outputPath);
-                    std::cout << "Extracted directory: " << filename << "\n";
+            if (format_version >= 1 && payload.crc() != entry.crc) {
+                std::cerr << "Warning: Checksum mismatch for '" << entry.name << "' (wrong password or corrupted data).\n";
+                checksum_failures++;
+            }
+        };
+        if (archive_index != nullptr && !extract_all) {
+            // Seek straight to the selected entries; the others are not even read.
+            for (uint32_t entry_index = 0; entry_index < index.size(); ++entry_index) {
+                if (!files_to_extract.count(index[entry_index].header.name)) {
+                    skipped_count++;
+                    continue;
                 }
-            } else { // This entry represents a file (non-empty content)
-                std::ofstream outFile(outputPath, std::ios::binary);
-                if (!outFile.is_open()) {
-                    std::cerr << "Warning: Could not create output file: " << outputPath << ". Skipping.\n";
-                    continue; 
+                extract_one(readIndexedEntry(inFile, cipher, index, entry_index), entry_index);
+            }
+        } else {
+            uint32_t entry_index = 0;
+            for (; moreEntries(inFile, cipher); ++entry_index) {
+                EntryHeader entry = readEntryHeader(inFile, format_version);
+                if (!extract_all && !files_to_extract.count(entry.name)) {
+                    skipPayload(inFile, entry, format_version);
+                    skipped_count++;
+                    continue;
                 }
-
-                outFile.write(decrypted_content.data(), decrypted_content.size());
-                outFile.close();
-                std::cout << "Extracted file: " << filename << " (" << decrypted_content.size() << " bytes)\n";
+                extract_one(entry, entry_index);
             }
-            extracted_count++;
+            checkEntryCount(entry_index, archive_index);
+        }
+        finishExtraction(output_base_path, extract_state);
+        if (!extract_all && extracted_count == 0) {
+            std::cerr << "Warning: No specified files were found in the archive to extract.\n";
+        } else if (!extract_all) {
+            std::cout << "Extracted " << extracted_count << " items, skipped " << skipped_count << " items.\n";
+        } else {
+            std::cout << "Extracted " << extracted_count << " items.\n";
+        }
+        if (checksum_failures > 0) {
+            std::cerr << "Error: " << checksum_failures << " entries failed checksum verification.\n";
+            inFile.close();
+            return 1;
         }
-        std::cout << "Extracted " << extracted_count << " items.\n";
 
     } catch (const std::runtime_error& e) {
         std::cerr << "Error during decryption: " << e.what() << std::endl;
@@ -4,199 +4,724 @@
 #include <vector>
 #include <string>
 #include <cstdint>
-#include <sstream>
 #include <iomanip>
 #include <stdexcept>
 #include <limits> // For std::numeric_limits
 #include <filesystem> // For fs::path
+#include <cstring> // For std::memcpy, std::memcmp
+#include <algorithm> // For std::min
+#include <chrono> // For --bench timing
+#include <thread> // For std::thread::hardware_concurrency
+#include <cstdlib> // For std::atoi, std::getenv
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional> // For std::function
+
+#include "libtzar/tzar_format.h"
+#include "libtzar/tzar_crypto.h"
+#include "libtzar/tzar_parallel.h"
+#include "libtzar/tzar_agent_protocol.h"
+#include "libtzar/tzar_seal.h"
+#include "libtzar/tzar_index.h"
+#include "libtzar/tzar_cpu.h"
 
 namespace fs = std::filesystem; // Alias for std::filesystem
 
-// --- Basic SHA256 Implementation (for password hashing) ---
-// This is a simplified, self-contained SHA256. NOT for production use.
-// Based on public domain implementations and FIPS 180-4.
-
-// Rotate right
-#define ROTR(x, n) ((x >> n) | (x << (32 - n)))
-
-// SHA256 functions
-#define CH(x, y, z) ((x & y) ^ (~x & z))
-#define MAJ(x, y, z) ((x & y) ^ (x & z) ^ (y & z))
-#define SIG0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
-#define SIG1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
-#define CAP_SIG0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ (x >> 3))
-#define CAP_SIG1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ (x >> 10))
-
-// SHA256 K constants
-static const uint32_t K[64] = {
-    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b94ca4f, 0x682e6ff3,
-    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+// --- Payload sealing ---
+// Computes the CRC-32C of the next 'size' bytes of 'inFile' and seeks back to where they
+// start. Only needed for input written before entries carried a checksum, since the
+// checksum is part of the header every chunk is authenticated against.
+uint32_t checksumPayload(std::ifstream& inFile, uint64_t size, std::vector<char>& buffer) {
+    std::streampos start = inFile.tellg();
+    uint32_t crc = 0;
+    for (uint64_t position = 0; position < size;) {
+        size_t len = std::min<uint64_t>(size - position, buffer.size());
+        inFile.read(buffer.data(), len);
+        if (!inFile) throw std::runtime_error("Error reading binary data.");
+        crc = crc32c_update(crc, buffer.data(), len);
+        position += len;
+    }
+    inFile.seekg(start);
+    return crc;
+}
+
+// --- Encryption pipeline ---
+// A reader thread parses the input and cuts every entry's content into AEAD chunks,
+// packing the chunks of many small entries into one batch. The main thread seals all
+// chunks of a batch across the workers, and a writer thread writes the batches in order.
+// The reader lays out each batch's output, and every nonce depends only on the entry and
+// chunk index, so the archive is byte-for-byte what sealing one entry at a time gives.
+// The reader also collects the entry headers for the index written after the last batch.
+
+const size_t ENCRYPT_BATCH_BYTES = 8 << 20; // Plaintext per batch
+const size_t ENCRYPT_BATCH_CHUNKS = 4096;   // Chunks per batch, however small their entries
+const size_t ENCRYPT_BATCHES = 4;           // Being read, sealed and written, plus a spare
+
+// An entry with chunks in a batch; one spanning several batches appears in each of them.
+struct BatchEntry {
+    uint32_t entry_index;
+    std::string name;
+    uint64_t size;
+    uint32_t crc;    // Expected CRC-32C of the whole content
+    std::string aad; // The entry header, authenticated with every chunk
 };
 
-// Initial hash values H0-H7
-static uint32_t H[8] = {
-    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
-    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+// One chunk: 'len' bytes of plaintext at plain_offset, sealed with its tag to out_offset.
+struct SealTask {
+    size_t entry; // Index into SealBatch::entries
+    uint32_t chunk_index;
+    size_t plain_offset;
+    size_t out_offset;
+    size_t len;
+    bool last; // Last chunk of its entry
 };
 
-// SHA256 compression function
-void sha256_transform(uint32_t state[8], const uint8_t block[64]) {
-    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
-    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
-    uint32_t W[64];
-
-    for (int i = 0; i < 16; ++i) {
-        W[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
-    }
-
-    for (int i = 16; i < 64; ++i) {
-        W[i] = CAP_SIG1(W[i - 2]) + W[i - 7] + CAP_SIG0(W[i - 15]) + W[i - 16];
-    }
-
-    for (int i = 0; i < 64; ++i) {
-        uint32_t T1 = h + SIG1(e) + CH(e, f, g) + K[i] + W[i];
-        uint32_t T2 = SIG0(a) + MAJ(a, b, c);
-        h = g;
-        g = f;
-        f = e;
-        e = d + T1;
-        d = c;
-        c = b;
-        b = a;
-        a = T1 + T2;
-    }
-
-    state[0] += a;
-    state[1] += b;
-    state[2] += c;
-    state[3] += d;
-    state[4] += e;
-    state[5] += f;
-    state[6] += g;
-    state[7] += h;
-}
+struct SealBatch {
+    std::vector<char> plain;
+    std::vector<char> out; // Entry headers and sealed chunks, in archive order
+    size_t plain_used = 0;
+    size_t out_used = 0;
+    std::vector<BatchEntry> entries;
+    std::vector<SealTask> tasks;
+    std::vector<uint32_t> chunk_crcs;
+
+    // Claims the next 'len' bytes of output and returns their offset.
+    size_t appendOutput(size_t len) {
+        size_t offset = out_used;
+        out_used += len;
+        if (out.size() < out_used) out.resize(out_used);
+        return offset;
+    }
+};
 
-// Computes SHA256 hash of a byte vector. Returns 32-byte hash.
-std::vector<uint8_t> sha256(const std::vector<uint8_t>& data) {
-    uint32_t state[8];
-    for(int i = 0; i < 8; ++i) state[i] = H[i]; // Reset state for each call
+class EncryptPipeline {
+public:
+    EncryptPipeline(std::ifstream& inFile, std::ofstream& outFile, uint8_t input_version,
+                    const ArchiveKey& key, ParallelFor& workers)
+        : inFile_(inFile), outFile_(outFile), input_version_(input_version), key_(key), workers_(workers),
+          batches_(ENCRYPT_BATCHES), free_(ENCRYPT_BATCHES), read_(ENCRYPT_BATCHES), sealed_(ENCRYPT_BATCHES) {}
+
+    // Encrypts every entry of the input. Throws std::runtime_error with the first error
+    // of any stage; the output is then incomplete.
+    void run() {
+        for (SealBatch& batch : batches_) {
+            batch.plain.resize(ENCRYPT_BATCH_BYTES);
+            free_.push(&batch);
+        }
+        std::thread reader([this] {
+            stage([this] { readEntries(); });
+            read_.close();
+        });
+        std::thread writer([this] { stage([this] { writeBatches(); }); });
+        stage([this] { sealBatches(); });
+        sealed_.close();
+        reader.join();
+        writer.join();
+        if (failed_) {
+            throw std::runtime_error(error_);
+        }
+    }
 
-    std::vector<uint8_t> padded_data = data;
-    uint64_t bit_len = data.size() * 8;
+    // Headers of every entry encrypted; complete once run() has returned.
+    const ArchiveIndexBuilder& index() const { return index_; }
+
+private:
+    // Runs a stage; an error in any of them stops all three.
+    void stage(const std::function<void()>& fn) {
+        try {
+            fn();
+        } catch (const std::exception& e) {
+            {
+                std::lock_guard<std::mutex> lock(error_mutex_);
+                if (!failed_) error_ = e.what();
+                failed_ = true;
+            }
+            free_.close();
+            read_.close();
+            sealed_.close();
+        }
+    }
 
-    // Pad with a '1' bit
-    padded_data.push_back(0x80);
+    // Returns an emptied batch, or nullptr once the pipeline has stopped.
+    SealBatch* freeBatch() {
+        SealBatch* batch;
+        if (!free_.pop(batch) || failed_) return nullptr;
+        batch->plain_used = batch->out_used = 0;
+        batch->entries.clear();
+        batch->tasks.clear();
+        return batch;
+    }
 
-    // Pad with zeros until length is 448 mod 512 bits (56 mod 64 bytes)
-    while ((padded_data.size() % 64) != 56) {
-        padded_data.push_back(0x00);
+    // Reader stage: fills batches with entry headers and chunks of plaintext.
+    void readEntries() {
+        std::vector<char> buffer; // For checksumPayload()
+        SealBatch* batch = freeBatch();
+        if (batch == nullptr) return;
+        for (uint64_t entry_index = 0; inFile_.peek() != EOF; ++entry_index) {
+            if (entry_index == UINT32_MAX) {
+                throw std::runtime_error("Too many entries to encrypt.");
+            }
+            EntryHeader entry = readEntryHeader(inFile_, input_version_);
+            if (input_version_ < 1) {
+                buffer.resize(ENCRYPT_BATCH_BYTES);
+                entry.crc = checksumPayload(inFile_, entry.size, buffer);
+            }
+            index_.add(entry);
+            const uint64_t chunk_count = aeadChunkCount(entry.size);
+            if (chunk_count > UINT32_MAX) {
+                throw std::runtime_error("Entry '" + entry.name + "' is too large to encrypt.");
+            }
+
+            // The header is stored in the clear but authenticated with every chunk.
+            std::string header = entryHeaderBytes(entry);
+            size_t header_offset = batch->appendOutput(header.size());
+            std::memcpy(batch->out.data() + header_offset, header.data(), header.size());
+            size_t batch_entry = SIZE_MAX;
+            for (uint64_t chunk = 0; chunk < chunk_count;) {
+                // Take as many chunks as fit and read them in one go; only the entry's last
+                // chunk can be short.
+                size_t space = batch->plain.size() - batch->plain_used;
+                uint64_t count = entry.size - chunk * AEAD_CHUNK_SIZE <= space ? chunk_count - chunk
+                                                                                : space / AEAD_CHUNK_SIZE;
+                count = std::min<uint64_t>(count, ENCRYPT_BATCH_CHUNKS - batch->tasks.size());
+                if (count == 0) {
+                    read_.push(batch);
+                    if ((batch = freeBatch()) == nullptr) return;
+                    batch_entry = SIZE_MAX;
+                    continue;
+                }
+                if (batch_entry == SIZE_MAX) {
+                    batch->entries.push_back({static_cast<uint32_t>(entry_index), entry.name, entry.size, entry.crc, header});
+                    batch_entry = batch->entries.size() - 1;
+                }
+                size_t len = std::min<uint64_t>(entry.size - chunk * AEAD_CHUNK_SIZE, count * AEAD_CHUNK_SIZE);
+                inFile_.read(batch->plain.data() + batch->plain_used, len);
+                if (!inFile_) throw std::runtime_error("Error reading binary data.");
+                for (size_t i = 0; i < count; ++i, ++chunk) {
+                    size_t chunk_len = std::min(len - i * AEAD_CHUNK_SIZE, AEAD_CHUNK_SIZE);
+                    SealTask task;
+                    task.entry = batch_entry;
+                    task.chunk_index = static_cast<uint32_t>(chunk);
+                    task.plain_offset = batch->plain_used + i * AEAD_CHUNK_SIZE;
+                    task.out_offset = batch->appendOutput(chunk_len + AEAD_TAG_SIZE);
+                    task.len = chunk_len;
+                    task.last = chunk + 1 == chunk_count;
+                    batch->tasks.push_back(task);
+                }
+                batch->plain_used += len;
+            }
+        }
+        read_.push(batch);
     }
 
-    // Append 64-bit message length
-    for (int i = 7; i >= 0; --i) {
-        padded_data.push_back((bit_len >> (8 * i)) & 0xFF);
+    // Sealing stage: seals and checksums every chunk of a batch across the workers, then
+    // checks each finished entry against the CRC in its header.
+    void sealBatches() {
+        uint32_t crc = 0; // Of the current entry so far
+        SealBatch* batch;
+        while (read_.pop(batch) && !failed_) {
+            batch->chunk_crcs.resize(batch->tasks.size());
+            workers_.run(batch->tasks.size(), [&](size_t i) {
+                const SealTask& task = batch->tasks[i];
+                const BatchEntry& entry = batch->entries[task.entry];
+                const char* plain = batch->plain.data() + task.plain_offset;
+                batch->chunk_crcs[i] = crc32c_update(0, plain, task.len);
+                aead_seal_chunk(key_, entry.entry_index, task.chunk_index, entry.aad, plain,
+                                batch->out.data() + task.out_offset, task.len);
+            });
+            for (size_t i = 0; i < batch->tasks.size(); ++i) {
+                const SealTask& task = batch->tasks[i];
+                if (task.chunk_index == 0) crc = 0;
+                crc = crc32c_combine(crc, batch->chunk_crcs[i], task.len);
+                if (task.last && crc != batch->entries[task.entry].crc) {
+                    throw std::runtime_error("Checksum mismatch for '" + batch->entries[task.entry].name +
+                                             "'. Input archive is corrupted.");
+                }
+            }
+            sealed_.push(batch);
+        }
     }
 
-    for (size_t i = 0; i < padded_data.size(); i += 64) {
-        sha256_transform(state, &padded_data[i]);
+    // Writer stage: writes the batches in the order they were read.
+    void writeBatches() {
+        SealBatch* batch;
+        while (sealed_.pop(batch) && !failed_) {
+            outFile_.write(batch->out.data(), batch->out_used);
+            if (!outFile_) throw std::runtime_error("Error writing encrypted archive.");
+            for (const SealTask& task : batch->tasks) {
+                if (task.last) {
+                    const BatchEntry& entry = batch->entries[task.entry];
+                    std::cout << "Encrypted: " << entry.name << " (" << entry.size << " bytes)\n";
+                }
+            }
+            free_.push(batch);
+        }
     }
 
-    std::vector<uint8_t> hash(32);
-    for (int i = 0; i < 8; ++i) {
-        hash[i * 4] = (state[i] >> 24) & 0xFF;
-        hash[i * 4 + 1] = (state[i] >> 16) & 0xFF;
-        hash[i * 4 + 2] = (state[i] >> 8) & 0xFF;
-        hash[i * 4 + 3] = state[i] & 0xFF;
+    std::ifstream& inFile_;
+    std::ofstream& outFile_;
+    uint8_t input_version_;
+    const ArchiveKey& key_;
+    ParallelFor& workers_;
+    ArchiveIndexBuilder index_; // Only touched by the reader until run() returns
+    std::vector<SealBatch> batches_;
+    BoundedQueue<SealBatch*> free_;   // Emptied batches, back from the writer
+    BoundedQueue<SealBatch*> read_;   // Filled by the reader
+    BoundedQueue<SealBatch*> sealed_; // Ready to be written
+    std::atomic<bool> failed_{false};
+    std::mutex error_mutex_;
+    std::string error_;
+};
+
+// --- XOR kernel benchmark (--bench) ---
+// Checks every kernel the CPU supports against the scalar one, then reports single-core
+// throughput on a cache-resident buffer and on one much larger than the caches.
+int benchmarkXorKernels() {
+    std::vector<uint8_t> key = sha256(std::vector<uint8_t>{'b', 'e', 'n', 'c', 'h'});
+    std::vector<char> reference(1 << 16);
+    for (size_t i = 0; i < reference.size(); ++i) {
+        reference[i] = static_cast<char>(i * 131 + (i >> 7));
     }
-    return hash;
-}
 
-// --- XOR Encryption/Decryption Function ---
-// Key is repeated if data is longer than key.
-std::vector<char> xor_cipher(const std::vector<char>& data, const std::vector<uint8_t>& key) {
-    if (key.empty()) {
-        // If key is empty, return data unchanged (or throw error, depending on desired behavior)
-        return data;
+    bool all_ok = true;
+    for (const XorKernelInfo& info : xorKernels()) {
+        if (!info.supported) {
+            std::cout << std::left << std::setw(8) << info.name << " not supported by this CPU\n";
+            continue;
+        }
+        // Odd lengths and key positions exercise the tails and the pattern rotation.
+        bool ok = true;
+        for (size_t len : {0, 1, 31, 33, 100, 257, 4099, 65536}) {
+            for (uint64_t offset : {0, 5, 31, 64 + 17}) {
+                uint8_t pattern[2 * XOR_KEY_PERIOD];
+                xor_pattern(pattern, key, offset);
+                std::vector<char> expected(reference.begin(), reference.begin() + len);
+                std::vector<char> actual = expected;
+                xor_kernel_scalar(expected.data(), len, pattern);
+                info.kernel(actual.data(), len, pattern);
+                ok = ok && expected == actual;
+            }
+        }
+        all_ok = all_ok && ok;
+
+        std::cout << std::left << std::setw(8) << info.name << (ok ? "" : " MISMATCH");
+        for (size_t size : {size_t(256) << 10, size_t(256) << 20}) {
+            std::vector<char> buffer(size, 1);
+            uint8_t pattern[2 * XOR_KEY_PERIOD];
+            xor_pattern(pattern, key, 0);
+            uint64_t bytes = 0;
+            auto start = std::chrono::steady_clock::now();
+            double seconds = 0;
+            while (seconds < 0.5) {
+                info.kernel(buffer.data(), size, pattern);
+                bytes += size;
+                seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            std::cout << std::right << std::setw(8) << std::fixed << std::setprecision(2)
+                      << bytes / seconds / 1e9 << " GB/s ("
+                      << (size >= (1 << 20) ? size >> 20 : size >> 10) << (size >= (1 << 20) ? " MiB" : " KiB") << ")";
+        }
+        std::cout << "\n";
     }
-    std::vector<char> output = data;
-    for (size_t i = 0; i < data.size(); ++i) {
-        output[i] = data[i] ^ key[i % key.size()];
+    std::cout << "Selected: ";
+    for (const XorKernelInfo& info : xorKernels()) {
+        if (info.kernel == selectXorKernel()) std::cout << info.name << "\n";
     }
-    return output;
+    return all_ok ? 0 : 1;
 }
 
-// --- File I/O Helpers ---
-void writeString(std::ofstream& outFile, const std::string& str) {
-    uint32_t len = str.length();
-    outFile.write(reinterpret_cast<const char*>(&len), sizeof(len));
-    outFile.write(str.c_str(), len);
+// --- Checksum and zero-block benchmark (--bench) ---
+// Checks every CRC-32C kernel and zero-block test the CPU supports against the scalar
+// one, then reports single-core throughput on a cache-resident buffer.
+int benchmarkChecksums() {
+    std::vector<char> data(1 << 20);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 131 + (i >> 7));
+    }
+    auto throughput = [](const std::function<void()>& run, size_t bytes) {
+        uint64_t total = 0;
+        auto start = std::chrono::steady_clock::now();
+        double seconds = 0;
+        while (seconds < 0.5) {
+            run();
+            total += bytes;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        return total / seconds / 1e9;
+    };
+
+    bool all_ok = true;
+    for (const Crc32cKernelInfo& info : crc32cKernels()) {
+        if (!info.supported) {
+            std::cout << std::left << std::setw(14) << ("crc32c-" + std::string(info.name)) << " not supported by this CPU\n";
+            continue;
+        }
+        // Lengths around the kernels' block sizes, odd alignments and a running CRC.
+        bool ok = true;
+        for (size_t len : {0, 1, 7, 8, 255, 768, 769, 4099, 24576, 24583, 65536, 1000000}) {
+            for (size_t align : {0, 3}) {
+                for (uint32_t crc : {0u, 0xDEADBEEFu}) {
+                    ok = ok && info.update(crc, data.data() + align, len) ==
+                                   crc32c_update_scalar(crc, data.data() + align, len);
+                }
+            }
+        }
+        all_ok = all_ok && ok;
+        uint32_t sink = 0;
+        double rate = throughput([&] { sink ^= info.update(sink, data.data(), 64 << 10); }, 64 << 10);
+        std::cout << std::left << std::setw(14) << ("crc32c-" + std::string(info.name)) << (ok ? "" : " MISMATCH")
+                  << std::right << std::setw(8) << std::fixed << std::setprecision(2) << rate << " GB/s (64 KiB)\n";
+    }
+
+    std::vector<char> block(ZERO_BLOCK_SIZE, 0);
+    for (const ZeroBlockTestInfo& info : zeroBlockTests()) {
+        if (!info.supported) {
+            std::cout << std::left << std::setw(14) << ("zero-" + std::string(info.name)) << " not supported by this CPU\n";
+            continue;
+        }
+        // A single set bit anywhere in the block must be seen.
+        bool ok = info.test(block.data());
+        for (size_t i = 0; i < ZERO_BLOCK_SIZE; i += 61) {
+            block[i] = static_cast<char>(0x80 >> (i % 8));
+            ok = ok && !info.test(block.data());
+            block[i] = 0;
+        }
+        all_ok = all_ok && ok;
+        volatile bool sink = false;
+        double rate = throughput([&] { sink = info.test(block.data()); }, ZERO_BLOCK_SIZE);
+        std::cout << std::left << std::setw(14) << ("zero-" + std::string(info.name)) << (ok ? "" : " MISMATCH")
+                  << std::right << std::setw(8) << std::fixed << std::setprecision(2) << rate << " GB/s (4 KiB)\n";
+    }
+    std::cout << "Selected: ";
+    for (const Crc32cKernelInfo& info : crc32cKernels()) {
+        if (info.update == selectCrc32cKernel()) std::cout << "crc32c-" << info.name;
+    }
+    for (const ZeroBlockTestInfo& info : zeroBlockTests()) {
+        if (info.test == selectZeroBlockTest()) std::cout << ", zero-" << info.name << "\n";
+    }
+    return all_ok ? 0 : 1;
 }
 
-void writeBinaryData(std::ofstream& outFile, const std::vector<char>& data) {
-    uint64_t size = data.size();
-    outFile.write(reinterpret_cast<const char*>(&size), sizeof(size));
-    outFile.write(data.data(), size);
+// --- SHA256 benchmark (--bench) ---
+// Checks the SHA-NI block function against the scalar one and every multi-message
+// backend against serial hashing, then reports single-core throughput: block functions
+// on one long stream, multi-message backends on 4 KiB messages.
+int benchmarkSha256() {
+    std::vector<uint8_t> data(64 << 20, 1);
+    for (size_t i = 0; i < (1 << 16); ++i) {
+        data[i] = static_cast<uint8_t>(i * 131 + (i >> 7));
+    }
+    auto report = [](const char* name, bool ok, double bytes, double seconds, const char* what) {
+        std::cout << std::left << std::setw(8) << name << (ok ? "" : " MISMATCH") << std::right << std::setw(8)
+                  << std::fixed << std::setprecision(2) << bytes / seconds / 1e9 << " GB/s (" << what << ")\n";
+    };
+
+    struct BlockFunction {
+        const char* name;
+        Sha256Blocks blocks;
+        bool supported;
+    };
+    std::vector<BlockFunction> block_functions = {{"scalar", sha256_blocks_scalar, true}};
+#if defined(__x86_64__) || defined(__i386__)
+    block_functions.push_back({"sha-ni", sha256_blocks_shani, sha256_shani_supported()});
+#endif
+    bool all_ok = true;
+    uint32_t expected[8];
+    std::memcpy(expected, SHA256_INIT, sizeof(expected));
+    sha256_blocks_scalar(expected, data.data(), 1024);
+    for (const BlockFunction& function : block_functions) {
+        if (!function.supported) {
+            std::cout << std::left << std::setw(8) << function.name << " not supported by this CPU\n";
+            continue;
+        }
+        uint32_t state[8];
+        std::memcpy(state, SHA256_INIT, sizeof(state));
+        function.blocks(state, data.data(), 1024);
+        bool ok = std::memcmp(state, expected, sizeof(state)) == 0;
+        all_ok = all_ok && ok;
+        auto start = std::chrono::steady_clock::now();
+        function.blocks(state, data.data(), data.size() / 64);
+        report(function.name, ok, data.size(),
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), "one stream");
+    }
+
+    // Every length from 0 to 299 bytes covers both padding cases and lane refills.
+    std::vector<const uint8_t*> messages;
+    std::vector<size_t> lengths;
+    for (size_t length = 0; length < 300; ++length) {
+        messages.push_back(data.data() + length);
+        lengths.push_back(length);
+    }
+    std::vector<uint8_t> reference(32 * messages.size());
+    sha256_many_serial(messages.data(), lengths.data(), messages.size(), reference.data());
+    const size_t message_size = 4096;
+    std::vector<const uint8_t*> small_messages;
+    for (size_t offset = 0; offset + message_size <= data.size(); offset += message_size) {
+        small_messages.push_back(data.data() + offset);
+    }
+    std::vector<size_t> small_lengths(small_messages.size(), message_size);
+    std::vector<uint8_t> digests(32 * small_messages.size());
+    for (const Sha256ManyInfo& info : sha256ManyBackends()) {
+        if (!info.supported) {
+            std::cout << std::left << std::setw(8) << info.name << " not supported by this CPU\n";
+            continue;
+        }
+        std::vector<uint8_t> actual(reference.size());
+        info.hash(messages.data(), lengths.data(), messages.size(), actual.data());
+        bool ok = actual == reference;
+        all_ok = all_ok && ok;
+        auto start = std::chrono::steady_clock::now();
+        info.hash(small_messages.data(), small_lengths.data(), small_messages.size(), digests.data());
+        report(info.name, ok, data.size(),
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), "4 KiB messages");
+    }
+    std::cout << "Selected: ";
+    for (const Sha256ManyInfo& info : sha256ManyBackends()) {
+        if (info.hash == selectSha256Many()) std::cout << info.name << "\n";
+    }
+    return all_ok ? 0 : 1;
 }
 
-std::string readString(std::ifstream& inFile) {
-    uint32_t len;
-    inFile.read(reinterpret_cast<char*>(&len), sizeof(len));
-    if (!inFile) throw std::runtime_error("Error reading string length.");
-    std::vector<char> buffer(len);
-    inFile.read(buffer.data(), len);
-    if (!inFile) throw std::runtime_error("Error reading string data.");
-    return std::string(buffer.begin(), buffer.end());
+// --- Key derivation benchmark (--bench) ---
+// Checks SHA256 ("abc" from FIPS 180-2), HMAC-SHA256 (RFC 4231 test case 2) and
+// PBKDF2-HMAC-SHA256 (RFC 7914 section 11, 4096 iterations) against known answers, then
+// times one derivation at the default cost.
+int benchmarkKdf() {
+    const uint8_t abc_digest[32] = {0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde,
+                                    0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+                                    0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+    const uint8_t pbkdf2_expected[32] = {0xc5, 0xe4, 0x78, 0xd5, 0x92, 0x88, 0xc8, 0x41, 0xaa, 0x53, 0x0d, 0xb6,
+                                         0x84, 0x5c, 0x4c, 0x8d, 0x96, 0x28, 0x93, 0xa0, 0x01, 0xce, 0x4e, 0x11,
+                                         0xa4, 0x96, 0x38, 0x73, 0xaa, 0x98, 0x13, 0x4a};
+    const uint8_t hmac_expected[32] = {0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26,
+                                       0x08, 0x95, 0x75, 0xc7, 0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83,
+                                       0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43};
+    const uint8_t salt[4] = {'s', 'a', 'l', 't'};
+    const uint8_t hmac_key[4] = {'J', 'e', 'f', 'e'};
+    const char hmac_data[] = "what do ya want for nothing?";
+    uint8_t mac[32];
+    hmac_sha256(hmac_key, sizeof(hmac_key), hmac_data, sizeof(hmac_data) - 1, mac);
+    bool ok = std::memcmp(sha256({'a', 'b', 'c'}).data(), abc_digest, sizeof(abc_digest)) == 0 &&
+              std::memcmp(mac, hmac_expected, sizeof(hmac_expected)) == 0 &&
+              std::memcmp(pbkdf2_hmac_sha256("password", salt, sizeof(salt), 4096).data(), pbkdf2_expected,
+                          sizeof(pbkdf2_expected)) == 0;
+
+    uint8_t bench_salt[KDF_SALT_SIZE] = {0};
+    auto start = std::chrono::steady_clock::now();
+    pbkdf2_hmac_sha256("bench", bench_salt, sizeof(bench_salt), KDF_DEFAULT_ITERATIONS);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << kdfName(KDF_PBKDF2_HMAC_SHA256) << (ok ? "" : " MISMATCH") << ": "
+              << KDF_DEFAULT_ITERATIONS << " iterations in " << std::fixed << std::setprecision(0)
+              << seconds * 1000 << " ms\n";
+    return ok ? 0 : 1;
 }
 
-std::vector<char> readBinaryData(std::ifstream& inFile) {
-    uint64_t size;
-    inFile.read(reinterpret_cast<char*>(&size), sizeof(size));
-    if (!inFile) throw std::runtime_error("Error reading binary data size.");
-    std::vector<char> data(size);
-    if (size > 0) {
-        inFile.read(data.data(), size);
-        if (!inFile) throw std::runtime_error("Error reading binary data.");
+// --- AEAD benchmark (--bench) ---
+// Checks both backends against known answers (RFC 8439 section 2.8.2 for ChaCha20-Poly1305,
+// test case 14 of the GCM specification for AES-256-GCM) and the AVX2 ChaCha20 keystream
+// against the scalar one. Then seals the same corpus with each backend, on one thread and
+// on all of them: the first BENCH_CORPUS_LIMIT bytes of 'corpus_path', or a synthetic
+// 4 MiB buffer if none is given.
+const size_t BENCH_CORPUS_LIMIT = 256 << 20;
+
+int benchmarkAead(const std::string& corpus_path) {
+    ChaChaKey chacha_key;
+    for (int i = 0; i < 32; ++i) reinterpret_cast<uint8_t*>(chacha_key.words)[i] = static_cast<uint8_t>(0x80 + i);
+    const uint32_t nonce[3] = {0x00000007, 0x43424140, 0x47464544};
+    const std::string aad = "\x50\x51\x52\x53\xc0\xc1\xc2\xc3\xc4\xc5\xc6\xc7";
+    const std::string plaintext = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip "
+                                  "for the future, sunscreen would be it.";
+    const uint8_t expected_start[8] = {0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb};
+    const uint8_t expected_tag[AEAD_TAG_SIZE] = {0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a,
+                                                 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91};
+    std::vector<char> ciphertext(plaintext.size());
+    uint8_t tag[AEAD_TAG_SIZE];
+    chacha20_xor(chacha_key, 1, nonce, plaintext.data(), ciphertext.data(), plaintext.size());
+    chacha20_poly1305_tag(chacha_key, nonce, aad, ciphertext.data(), ciphertext.size(), tag);
+    bool chacha_ok = std::memcmp(ciphertext.data(), expected_start, sizeof(expected_start)) == 0 &&
+                     std::memcmp(tag, expected_tag, sizeof(tag)) == 0;
+
+    std::vector<char> input(4099), vectorized(input.size()), scalar(input.size());
+    for (size_t i = 0; i < input.size(); ++i) input[i] = static_cast<char>(i * 131 + (i >> 7));
+    chacha20_xor(chacha_key, 7, nonce, input.data(), vectorized.data(), input.size());
+    uint32_t block[16];
+    for (size_t offset = 0; offset < input.size(); offset += 64) {
+        chacha20_block(chacha_key, static_cast<uint32_t>(7 + offset / 64), nonce, block);
+        for (size_t i = 0; i < 64 && offset + i < input.size(); ++i) {
+            scalar[offset + i] = input[offset + i] ^ reinterpret_cast<uint8_t*>(block)[i];
+        }
+    }
+    chacha_ok = chacha_ok && vectorized == scalar;
+
+    bool aes_ok = true;
+#if defined(__x86_64__) || defined(__i386__)
+    if (aes_gcm_supported()) {
+        // Zero key, zero IV (entry 0, chunk 0), one zero block, no associated data.
+        const uint8_t zero_key[32] = {0};
+        const uint8_t expected_block[16] = {0xce, 0xa7, 0x40, 0x3d, 0x4d, 0x60, 0x6b, 0x6e,
+                                            0x07, 0x4e, 0xc5, 0xd3, 0xba, 0xf3, 0x9d, 0x18};
+        const uint8_t expected_gcm_tag[AEAD_TAG_SIZE] = {0xd0, 0xd1, 0xc8, 0xa7, 0x99, 0x99, 0x6b, 0xf0,
+                                                         0x26, 0x5b, 0x98, 0xb5, 0xd4, 0x8a, 0xb9, 0x19};
+        ArchiveKey key;
+        key.cipher = CIPHER_AES_256_GCM;
+        aes_gcm_expand_key(zero_key, key.aes);
+        char zeros[16] = {0}, sealed[16 + AEAD_TAG_SIZE];
+        aead_seal_chunk(key, 0, 0, "", zeros, sealed, sizeof(zeros));
+        aes_ok = std::memcmp(sealed, expected_block, 16) == 0 &&
+                 std::memcmp(sealed + 16, expected_gcm_tag, AEAD_TAG_SIZE) == 0;
+    }
+#endif
+
+    std::vector<char> corpus;
+    if (corpus_path.empty()) {
+        corpus.assign(AEAD_BATCH_CHUNKS * AEAD_CHUNK_SIZE, 1);
+    } else {
+        std::ifstream corpusFile(corpus_path, std::ios::binary);
+        corpus.resize(BENCH_CORPUS_LIMIT);
+        corpusFile.read(corpus.data(), corpus.size());
+        corpus.resize(corpusFile.gcount());
+        if (corpus.empty()) {
+            std::cerr << "Error: Could not read benchmark corpus: " << corpus_path << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Corpus: " << (corpus_path.empty() ? "synthetic" : corpus_path) << ", "
+              << corpus.size() << " bytes\n";
+
+    std::vector<char> sealed(AEAD_BATCH_CHUNKS * (AEAD_CHUNK_SIZE + AEAD_TAG_SIZE));
+    const std::vector<uint8_t> bench_key = sha256(std::vector<uint8_t>{'b', 'e', 'n', 'c', 'h'});
+    const uint8_t bench_nonce[AEAD_NONCE_SIZE] = {0};
+    unsigned all = std::max(1u, std::thread::hardware_concurrency());
+    for (CipherId cipher : {CIPHER_AES_256_GCM, CIPHER_XCHACHA20_POLY1305}) {
+        bool supported = cipher != CIPHER_AES_256_GCM || aes_gcm_supported();
+        bool ok = cipher == CIPHER_AES_256_GCM ? aes_ok : chacha_ok;
+        std::cout << cipherName(cipher) << (!supported ? " not supported by this CPU" : ok ? "" : " MISMATCH") << "\n";
+        if (!supported) continue;
+
+        ArchiveKey key = deriveArchiveKey(cipher, bench_key, bench_nonce, TZAR2_FORMAT_VERSION);
+        for (unsigned threads : {1u, all}) {
+            ParallelFor workers(threads);
+            uint64_t total = 0;
+            uint32_t entry_index = 0;
+            auto start = std::chrono::steady_clock::now();
+            double seconds = 0;
+            while (seconds < 0.5) {
+                for (size_t offset = 0; offset < corpus.size(); offset += AEAD_BATCH_CHUNKS * AEAD_CHUNK_SIZE) {
+                    size_t len = std::min(corpus.size() - offset, AEAD_BATCH_CHUNKS * AEAD_CHUNK_SIZE);
+                    size_t count = (len + AEAD_CHUNK_SIZE - 1) / AEAD_CHUNK_SIZE;
+                    workers.run(count, [&](size_t i) {
+                        size_t chunk_len = std::min(len - i * AEAD_CHUNK_SIZE, AEAD_CHUNK_SIZE);
+                        aead_seal_chunk(key, entry_index, static_cast<uint32_t>(i),
+                                        aad, corpus.data() + offset + i * AEAD_CHUNK_SIZE,
+                                        sealed.data() + i * (AEAD_CHUNK_SIZE + AEAD_TAG_SIZE), chunk_len);
+                    });
+                    entry_index++;
+                }
+                total += corpus.size();
+                seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            std::cout << "  seal, " << threads << (threads == 1 ? " thread " : " threads") << std::right
+                      << std::setw(8) << std::fixed << std::setprecision(2) << total / seconds / 1e9 << " GB/s\n";
+            if (all == 1) break;
+        }
     }
-    return data;
+    return chacha_ok && aes_ok ? 0 : 1;
 }
 
 int main(int argc, char* argv[]) {
-    // Usage: ./tzar_encrypt <input_tzar_file> <output_base_name> [password]
+    // Usage: ./tzar_encrypt [--threads=N] [--cipher=NAME] [--kdf-iterations=N] <input_tzar_file> <output_base_name> [password]
+    //        ./tzar_encrypt --bench [corpus_file]
     // The output file will always have the .tzar2 extension.
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <input_tzar_file> <output_base_name> [password]\n";
-        std::cerr << "If password is not provided, it will be prompted.\n";
+    if ((argc == 2 || argc == 3) && std::string(argv[1]) == "--bench") {
+        const uint32_t features = cpuFeatures(); // May warn about CPU_DISABLE_ENV first
+        std::cout << "CPU features: " << cpuFeatureNames(features);
+        if (features != cpuDetectedFeatures()) {
+            std::cout << " (" << CPU_DISABLE_ENV << " hides " << cpuFeatureNames(cpuDetectedFeatures() & ~features)
+                      << ")";
+        }
+        std::cout << "\n";
+        int status = benchmarkXorKernels();
+        status |= benchmarkChecksums();
+        status |= benchmarkSha256();
+        status |= benchmarkKdf();
+        return benchmarkAead(argc == 3 ? argv[2] : "") | status;
+    }
+    unsigned thread_count = std::max(1u, std::thread::hardware_concurrency());
+    // AES-256-GCM is the faster of the two wherever the CPU accelerates it.
+    CipherId cipher = aes_gcm_supported() ? CIPHER_AES_256_GCM : CIPHER_XCHACHA20_POLY1305;
+    uint32_t kdf_iterations = 0; // 0: KDF_DEFAULT_ITERATIONS, or the agent's setting
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--threads=", 0) == 0) {
+            thread_count = std::max(1, std::atoi(arg.c_str() + 10));
+        } else if (arg == "--cipher=aes-256-gcm") {
+            if (!aes_gcm_supported()) {
+                std::cerr << "Error: AES-256-GCM needs a CPU with AES-NI and PCLMULQDQ.\n";
+                return 1;
+            }
+            cipher = CIPHER_AES_256_GCM;
+        } else if (arg == "--cipher=xchacha20-poly1305") {
+            cipher = CIPHER_XCHACHA20_POLY1305;
+        } else if (arg.rfind("--kdf-iterations=", 0) == 0) {
+            kdf_iterations = static_cast<uint32_t>(std::strtoul(arg.c_str() + 17, nullptr, 10));
+            if (kdf_iterations < KDF_MIN_ITERATIONS) {
+                std::cerr << "Error: --kdf-iterations must be at least " << KDF_MIN_ITERATIONS << ".\n";
+                return 1;
+            }
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "Error: Unknown option: " << arg << std::endl;
+            return 1;
+        } else {
+            args.push_back(arg);
+        }
+    }
+    if (args.size() < 2 || args.size() > 3) {
+        std::cerr << "Usage: " << argv[0] << " [--threads=N] [--cipher=aes-256-gcm|xchacha20-poly1305]"
+                  << " [--kdf-iterations=N] <input_tzar_file> <output_base_name> [password]\n";
+        std::cerr << "       " << argv[0] << " --bench [corpus_file]\n";
+        std::cerr << "If password is not provided, the key comes from the tzar_agent named by "
+                  << AGENT_SOCKET_ENV << ", or the password is prompted.\n";
         return 1;
     }
 
-    std::string input_tzar_path = argv[1];
-    
+    std::string input_tzar_path = args[0];
+
     // Get the base name from the second argument and hard-set .tzar2 extension
-    fs::path provided_output_path(argv[2]);
+    fs::path provided_output_path(args[1]);
     std::string output_tzar2_path = provided_output_path.stem().string() + ".tzar2";
 
+    const char* agent_socket = std::getenv(AGENT_SOCKET_ENV);
+    bool use_agent = args.size() == 2 && agent_socket != nullptr && *agent_socket != '\0';
+    if (use_agent && kdf_iterations != 0) {
+        std::cerr << "Error: --kdf-iterations has no effect with the key agent; pass it to tzar_agent instead.\n";
+        return 1;
+    }
+
     std::string password;
+    if (!use_agent) {
+        if (args.size() == 3) {
+            password = args[2];
+        } else {
+            std::cout << "Enter password for encryption: ";
+            std::getline(std::cin, password);
+        }
 
-    if (argc == 4) {
-        password = argv[3];
-    } else {
-        std::cout << "Enter password for encryption: ";
-        std::getline(std::cin, password);
+        if (password.empty()) {
+            std::cerr << "Error: Password cannot be empty for encryption.\n";
+            return 1;
+        }
     }
-
-    if (password.empty()) {
-        std::cerr << "Error: Password cannot be empty for encryption.\n";
+    NewArchiveKey new_key;
+    try {
+        new_key = newArchiveKey(cipher, password, kdf_iterations, use_agent ? agent_socket : "");
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
-
-    std::vector<uint8_t> password_bytes(password.begin(), password.end());
-    std::vector<uint8_t> encryption_key = sha256(password_bytes);
+    const ArchiveKey& archive_key = new_key.key;
+    const KdfParams& kdf = new_key.header.kdf;
 
     std::ifstream inFile(input_tzar_path, std::ios::binary);
     if (!inFile.is_open()) {
@@ -211,23 +736,23 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Write encryption flag (0x01 for encrypted)
-    outFile.put(0x01); 
+    writeEncryptedArchiveHeader(outFile, new_key.header);
 
     try {
-        while (inFile.peek() != EOF) {
-            std::string filename = readString(inFile);
-            std::vector<char> file_content = readBinaryData(inFile);
-
-            // Encrypt the file content
-            std::vector<char> encrypted_content = xor_cipher(file_content, encryption_key);
-
-            // Write filename and its size (unencrypted)
-            writeString(outFile, filename);
-            // Write encrypted content and its size
-            writeBinaryData(outFile, encrypted_content);
+        uint8_t input_flag = 0x00;
+        uint8_t input_version = readArchiveHeader(inFile, input_flag);
+        if (input_flag != 0x00) {
+            throw std::runtime_error("Input archive is already encrypted.");
+        }
 
-            std::cout << "Encrypted: " << filename << " (" << file_content.size() << " bytes)\n";
+        std::cout << "Cipher: " << cipherName(cipher) << ", key derivation: " << kdfName(kdf.kdf) << " ("
+                  << kdf.iterations << " iterations" << (use_agent ? ", from key agent" : "") << ")\n";
+        ParallelFor workers(thread_count);
+        EncryptPipeline pipeline(inFile, outFile, input_version, archive_key, workers);
+        pipeline.run();
+        writeArchiveIndex(outFile, archive_key, outFile.tellp(), pipeline.index());
+        if (!outFile) {
+            throw std::runtime_error("Error writing encrypted archive.");
         }
     } catch (const std::runtime_error& e) {
         std::cerr << "Error during encryption: " << e.what() << std::endl;
@@ -8,6 +8,12 @@
 #include <fstream>   // For file stream operations (ifstream)
 #include <cstdint>   // For fixed-width integer types (uint32_t, uint64_t)
 #include <filesystem> // For path manipulation
+#include <sys/wait.h> // For WIFEXITED, WEXITSTATUS
+
+#include "libtzar/tzar_format.h" // For reading archive headers and entries
+#include "libtzar/tzar_crypto.h" // For DECRYPT_EXIT_WRONG_PASSWORD and the archive key
+#include "libtzar/tzar_index.h"  // For listing .tzar2 archives from their index
+#include "libtzar/tzar_agent_protocol.h" // For keys from tzar_agent
 
 namespace fs = std::filesystem; // Alias for std::filesystem
 
@@ -33,9 +39,7 @@ enum {
 GtkWidget* create_menu_item(const gchar* label, GCallback callback, gpointer data);
 void push_status_message(const std::string& message);
 void append_to_log(const std::string& text);
-std::string gui_readString(std::ifstream& inFile);
-uint64_t gui_readBinaryDataSizeAndSkip(std::ifstream& inFile);
-void load_archive_contents(const std::string& archive_path);
+void load_archive_contents(const std::string& archive_path, GtkWindow* parent_window, std::string password = "");
 std::string get_password_from_dialog(GtkWindow* parent_window, const std::string& title);
 
 
@@ -55,37 +59,55 @@ void append_to_log(const std::string& text) {
     gtk_text_view_scroll_to_mark(log_text_view, gtk_text_buffer_get_insert(buffer), 0.0, TRUE, 0.0, 0.0);
 }
 
-// Helper function to read a string from an input file stream (for archive parsing)
-std::string gui_readString(std::ifstream& inFile) {
-    uint32_t len;
-    inFile.read(reinterpret_cast<char*>(&len), sizeof(len));
-    if (!inFile) {
-        throw std::runtime_error("Error reading string length from archive.");
-    }
-    std::vector<char> buffer(len);
-    inFile.read(buffer.data(), len);
-    if (!inFile) {
-        throw std::runtime_error("Error reading string data from archive.");
-    }
-    return std::string(buffer.begin(), buffer.end());
+// Function to tell whether a tzar_decrypt command (result of std::system) stopped because
+// the password was wrong. It checks the password before extracting anything.
+bool decrypt_rejected_password(int result) {
+    return result != -1 && WIFEXITED(result) && WEXITSTATUS(result) == DECRYPT_EXIT_WRONG_PASSWORD;
 }
 
-// Helper function to read binary data size from an input file stream (for archive parsing)
-uint64_t gui_readBinaryDataSizeAndSkip(std::ifstream& inFile) {
-    uint64_t size;
-    inFile.read(reinterpret_cast<char*>(&size), sizeof(size));
-    if (!inFile) {
-        throw std::runtime_error("Error reading binary data size from archive.");
+// Function to open the sealed index of a .tzar2 archive (format version 9) with the key
+// from 'password', or from tzar_agent if it is empty. Returns false, having logged why,
+// if there is no key (including an agent that cannot be reached) or it does not open
+// the index; the stream is then back at 'entries_start' for walking the headers.
+bool read_archive_index(std::ifstream& archiveFile, const EncryptedArchiveHeader& header, uint64_t entries_start,
+                        const ArchiveIndexFooter& footer, const std::string& password,
+                        std::vector<IndexedEntry>& entries) {
+    if (header.cipher == CIPHER_AES_256_GCM && !aes_gcm_supported()) {
+        append_to_log("Archive uses AES-256-GCM, which this CPU cannot decrypt.\n");
+        return false;
     }
-    inFile.seekg(size, std::ios_base::cur);
-    if (!inFile) {
-        throw std::runtime_error("Error skipping binary data content in archive.");
+    try {
+        std::vector<uint8_t> key;
+        const char* agent_socket = std::getenv(AGENT_SOCKET_ENV);
+        if (!password.empty()) {
+            key = deriveMasterKey(password, header.kdf);
+        } else if (agent_socket != nullptr && *agent_socket != '\0') {
+            key = agentDeriveKey(agent_socket, header.kdf);
+        } else {
+            return false;
+        }
+        if (!unwrapDataKey(key, header, key)) {
+            append_to_log("Wrong password: the archive index could not be opened.\n");
+            return false;
+        }
+        ArchiveKey archive_key = deriveArchiveKey(header.cipher, key, header.nonce, header.version);
+        if (!readArchiveIndex(archiveFile, archive_key, footer, entries_start, entries)) {
+            append_to_log("The archive index failed authentication (tampered data).\n");
+            return false;
+        }
+    } catch (const std::runtime_error& e) {
+        append_to_log("Could not read the archive index: " + std::string(e.what()) + "\n");
+        archiveFile.clear();
+        archiveFile.seekg(static_cast<std::streamoff>(entries_start));
+        return false;
     }
-    return size;
+    return true;
 }
 
-// Function to load and display archive contents
-void load_archive_contents(const std::string& archive_path) {
+// Function to load and display archive contents. Archives with an index are listed from
+// it, which asks for the password (unless given or tzar_agent has it); without one, or
+// if that fails, the entry headers are walked.
+void load_archive_contents(const std::string& archive_path, GtkWindow* parent_window, std::string password) {
     append_to_log("Viewing contents of: " + archive_path + "\n");
     gtk_list_store_clear(file_list_store); // Clear previous contents
     current_archive_is_encrypted = false; // Reset encryption status
@@ -97,49 +119,86 @@ void load_archive_contents(const std::string& archive_path) {
         return;
     }
 
-    // Read the encryption flag (first byte)
-    uint8_t encryption_flag = archiveFile.get();
-    if (archiveFile.eof()) {
-        append_to_log("Error: Archive is empty or corrupted (missing encryption flag).\n");
+    // Read the header: encryption flag, magic, format version and, for .tzar2, the cipher,
+    // KDF parameters and nonce. Archives written before the header existed are either a
+    // bare .tzar (no flag) or a .tzar2 consisting of the 0x01 flag followed by entries.
+    if (archiveFile.peek() == EOF) {
+        append_to_log("Error: Archive is empty or corrupted (missing header).\n");
         push_status_message("Error: Empty or corrupted archive.");
         archiveFile.close();
         return;
     }
 
-    if (encryption_flag == 0x01) {
-        current_archive_is_encrypted = true;
+    uint8_t format_version = 0;
+    EncryptedArchiveHeader encrypted_header;
+    uint64_t entries_start = 0;
+    std::streamoff entries_end = -1; // Start of the index, if the archive has one
+    ArchiveIndexFooter index_footer;
+    try {
+        uint8_t encryption_flag = 0x00;
+        format_version = readArchiveHeader(archiveFile, encryption_flag);
+        current_archive_is_encrypted =
+            encryption_flag == 0x01 ||
+            (format_version == 0 && archiveFile.peek() == 0x01 && fs::path(archive_path).extension() == ".tzar2");
+        if (current_archive_is_encrypted) {
+            archiveFile.seekg(0, std::ios::beg);
+            encrypted_header = readEncryptedArchiveHeader(archiveFile);
+            format_version = encrypted_header.version;
+            entries_start = archiveFile.tellg();
+            if (encrypted_header.hasIndex()) {
+                index_footer = readArchiveIndexFooter(archiveFile, entries_start);
+                entries_end = static_cast<std::streamoff>(index_footer.entries_end);
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        append_to_log("Error: " + std::string(e.what()) + "\n");
+        push_status_message("Error: Unsupported archive format.");
+        archiveFile.close();
+        return;
+    }
+
+    if (current_archive_is_encrypted) {
         append_to_log("Archive detected as encrypted (.tzar2 format).\n");
         push_status_message("Encrypted archive loaded.");
-    } else if (encryption_flag == 0x00) {
-        current_archive_is_encrypted = false;
+    } else {
         append_to_log("Archive detected as unencrypted (.tzar format).\n");
         push_status_message("Unencrypted archive loaded.");
-    } else {
-        append_to_log("Warning: Unknown archive format flag (0x" + std::to_string(encryption_flag) + "). Assuming unencrypted.\n");
-        push_status_message("Warning: Unknown archive format.");
-        // Seek back to beginning to re-read if it's an old .tzar without flag, or just malformed
-        archiveFile.seekg(0, std::ios::beg);
     }
 
     try {
-        // Skip the flag byte if it was read and valid, otherwise seek to beginning for old format
-        if (encryption_flag == 0x00 || encryption_flag == 0x01) {
-            // Already read the flag, so we are at the correct position to read metadata
-        } else {
-            // For unknown flag, assume it's an old .tzar file that doesn't have the flag.
-            // Seek to the beginning to parse it as a standard .tzar.
-            archiveFile.seekg(0, std::ios::beg);
+        std::vector<IndexedEntry> index;
+        if (entries_end >= 0) {
+            if (password.empty() && std::getenv(AGENT_SOCKET_ENV) == nullptr) {
+                password = get_password_from_dialog(parent_window, "Enter Password to List Contents");
+            }
+            if (read_archive_index(archiveFile, encrypted_header, entries_start, index_footer, password, index)) {
+                for (const IndexedEntry& entry : index) {
+                    GtkTreeIter iter;
+                    gtk_list_store_append(file_list_store, &iter);
+                    gtk_list_store_set(file_list_store, &iter,
+                                       COL_FILENAME, entry.header.name.c_str(),
+                                       COL_FILESIZE, (gint64)entry.header.size,
+                                       -1);
+                }
+                append_to_log("Contents read from the archive index (" + std::to_string(index.size()) + " entries).\n");
+                current_archive_path = archive_path;
+                archiveFile.close();
+                return;
+            }
+            append_to_log("Listing the entry headers instead.\n");
         }
-
-        while (archiveFile.peek() != EOF) {
-            std::string filePath = gui_readString(archiveFile);
-            uint64_t fileSize = gui_readBinaryDataSizeAndSkip(archiveFile);
+        while (entries_end >= 0 ? archiveFile.tellg() < entries_end : archiveFile.peek() != EOF) {
+            EntryHeader entry = readEntryHeader(archiveFile, format_version);
+            archiveFile.seekg(format_version >= 4 ? aeadStoredSize(entry.size) : entry.size, std::ios_base::cur);
+            if (!archiveFile) {
+                throw std::runtime_error("Error skipping binary data content in archive.");
+            }
 
             GtkTreeIter iter;
             gtk_list_store_append(file_list_store, &iter);
             gtk_list_store_set(file_list_store, &iter,
-                               COL_FILENAME, filePath.c_str(),
-                               COL_FILESIZE, (gint64)fileSize,
+                               COL_FILENAME, entry.name.c_str(),
+                               COL_FILESIZE, (gint64)entry.size,
                                -1);
         }
         append_to_log("Contents metadata parsed successfully.\n");
@@ -206,7 +265,7 @@ static void on_open_archive_menu_item_activated(GtkMenuItem *menuitem, gpointer
     if (res == GTK_RESPONSE_ACCEPT) {
         GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
         char *filename = gtk_file_chooser_get_filename(chooser);
-        load_archive_contents(filename);
+        load_archive_contents(filename, GTK_WINDOW(user_data));
         g_free(filename);
     }
     gtk_widget_destroy(dialog);
@@ -281,7 +340,7 @@ static void on_create_archive_menu_item_activated(GtkMenuItem *menuitem, gpointe
             append_to_log("Archiving process completed successfully.\n");
             push_status_message("Archive created successfully.");
             // Optionally, load the new archive's contents after creation
-            load_archive_contents(output_base_name + ".tzar"); 
+            load_archive_contents(output_base_name + ".tzar", GTK_WINDOW(user_data));
         } else {
             append_to_log("Archiving process failed with exit code: " + std::to_string(result) + "\n");
             push_status_message("Archiving failed.");
@@ -339,7 +398,7 @@ static void on_encrypt_archive_menu_item_activated(GtkMenuItem *menuitem, gpoint
             append_to_log("Encryption process completed successfully.\n");
             push_status_message("Archive encrypted successfully.");
             // Optionally, load the new encrypted archive's contents
-            load_archive_contents(output_base_name + ".tzar2"); 
+            load_archive_contents(output_base_name + ".tzar2", GTK_WINDOW(user_data), password);
         } else {
             append_to_log("Encryption process failed with exit code: " + std::to_string(result) + "\n");
             push_status_message("Encryption failed.");
@@ -390,7 +449,10 @@ static void on_decrypt_archive_menu_item_activated(GtkMenuItem *menuitem, gpoint
 
         int result = std::system(command.c_str());
 
-        if (result == 0) {
+        if (decrypt_rejected_password(result)) {
+            append_to_log("Decryption failed: Wrong password.\n");
+            push_status_message("Wrong password.");
+        } else if (result == 0) {
             append_to_log("Decryption process completed successfully.\n");
             push_status_message("Archive decrypted successfully.");
             // Optionally, load the original unencrypted archive's contents after decryption
@@ -416,25 +478,35 @@ static void on_extract_all_menu_item_activated(GtkMenuItem *menuitem, gpointer u
         return;
     }
 
-    std::ostringstream command_stream;
-
-    if (current_archive_is_encrypted) {
-        std::string password = get_password_from_dialog(GTK_WINDOW(user_data), "Enter Decryption Password");
-        if (password.empty()) {
-            append_to_log("Extraction cancelled: No password entered.\n");
-            push_status_message("Extraction cancelled.");
-            return;
+    std::string password_title = "Enter Decryption Password";
+    int result;
+    for (;;) {
+        std::ostringstream command_stream;
+        if (current_archive_is_encrypted) {
+            std::string password = get_password_from_dialog(GTK_WINDOW(user_data), password_title);
+            if (password.empty()) {
+                append_to_log("Extraction cancelled: No password entered.\n");
+                push_status_message("Extraction cancelled.");
+                return;
+            }
+            command_stream << "./tzar_decrypt \"" << current_archive_path << "\" \"" << password << "\"";
+        } else {
+            command_stream << "./simple_unarchiver \"" << current_archive_path << "\"";
         }
-        command_stream << "./tzar_decrypt \"" << current_archive_path << "\" \"" << password << "\"";
-    } else {
-        command_stream << "./simple_unarchiver \"" << current_archive_path << "\"";
-    }
 
-    std::string command = command_stream.str();
-    append_to_log("Executing: " + command + "\n");
-    push_status_message("Extracting all contents...");
+        std::string command = command_stream.str();
+        append_to_log("Executing: " + command + "\n");
+        push_status_message("Extracting all contents...");
 
-    int result = std::system(command.c_str());
+        result = std::system(command.c_str());
+        // A wrong password is caught before anything is extracted, so just ask again.
+        if (!current_archive_is_encrypted || !decrypt_rejected_password(result)) {
+            break;
+        }
+        append_to_log("Wrong password.\n");
+        push_status_message("Wrong password.");
+        password_title = "Wrong Password - Enter Decryption Password";
+    }
 
     if (result == 0) {
         append_to_log("Unarchiving process completed successfully.\n");
@@ -464,15 +536,25 @@ static void on_extract_selected_menu_item_activated(GtkMenuItem *menuitem, gpoin
         return;
     }
 
+    // Encrypted archives: tzar_decrypt seeks straight to the selected entries at the
+    // offsets in the archive index, so only their content is read and decrypted.
+    std::string password;
     if (current_archive_is_encrypted) {
-        append_to_log("Selective extraction from encrypted archives (.tzar2) is not yet supported.\n");
-        push_status_message("Selective extract (encrypted) not supported.");
-        g_list_free_full(rows, (GDestroyNotify)gtk_tree_path_free); 
-        return;
+        password = get_password_from_dialog(GTK_WINDOW(user_data), "Enter Decryption Password");
+        if (password.empty()) {
+            append_to_log("Extraction cancelled: No password entered.\n");
+            push_status_message("Extraction cancelled.");
+            g_list_free_full(rows, (GDestroyNotify)gtk_tree_path_free); 
+            return;
+        }
     }
 
     std::ostringstream command_stream;
-    command_stream << "./simple_unarchiver \"" << current_archive_path << "\"";
+    if (current_archive_is_encrypted) {
+        command_stream << "./tzar_decrypt";
+    } else {
+        command_stream << "./simple_unarchiver \"" << current_archive_path << "\"";
+    }
 
     // Iterate through selected rows and append each filename to the command
     for (GList *l = rows; l != NULL; l = g_list_next(l)) { 
@@ -481,11 +563,18 @@ static void on_extract_selected_menu_item_activated(GtkMenuItem *menuitem, gpoin
         if (gtk_tree_model_get_iter(model, &iter, path)) {
             gchar *filename_gstr;
             gtk_tree_model_get(model, &iter, COL_FILENAME, &filename_gstr, -1);
-            command_stream << " \"" << filename_gstr << "\"";
+            if (current_archive_is_encrypted) {
+                command_stream << " \"--extract=" << filename_gstr << "\"";
+            } else {
+                command_stream << " \"" << filename_gstr << "\"";
+            }
             g_free(filename_gstr);
         }
     }
     g_list_free_full(rows, (GDestroyNotify)gtk_tree_path_free); 
+    if (current_archive_is_encrypted) {
+        command_stream << " \"" << current_archive_path << "\" \"" << password << "\"";
+    }
 
     std::string command = command_stream.str();
     append_to_log("Executing: " + command + "\n");
@@ -493,7 +582,10 @@ static void on_extract_selected_menu_item_activated(GtkMenuItem *menuitem, gpoin
 
     int result = std::system(command.c_str());
 
-    if (result == 0) {
+    if (current_archive_is_encrypted && decrypt_rejected_password(result)) {
+        append_to_log("Failed to extract selected file(s): Wrong password.\n");
+        push_status_message("Wrong password.");
+    } else if (result == 0) {
         append_to_log("Selected file(s) extracted successfully.\n");
         push_status_message("Selected item(s) extracted.");
     } else {
@@ -514,7 +606,8 @@ static gboolean on_tree_view_button_press_event(GtkWidget *tree_view, GdkEventBu
                                           &path, &column, &cell_x, &cell_y)) {
             // A row was clicked, show the context menu
             GtkWidget *menu = gtk_menu_new();
-            GtkWidget *extract_selected_item = create_menu_item("Extract Selected...", G_CALLBACK(on_extract_selected_menu_item_activated), NULL);
+            GtkWidget *extract_selected_item = create_menu_item("Extract Selected...", G_CALLBACK(on_extract_selected_menu_item_activated),
+                                                                 gtk_widget_get_toplevel(tree_view)); // Parent for the password dialog
             gtk_menu_shell_append(GTK_MENU_SHELL(menu), extract_selected_item);
             
             gtk_widget_show_all(menu);
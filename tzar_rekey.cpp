@@ -0,0 +1,153 @@
+// === tzar_rekey.cpp ===
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <cstdint>
+#include <stdexcept>
+#include <cstring> // For std::memcpy, std::strerror
+#include <cstdlib> // For std::strtoul
+#include <cerrno> // For errno
+#include <sys/random.h> // For getrandom()
+#include <fcntl.h> // For open()
+#include <unistd.h> // For pwrite(), fsync(), close()
+
+#include "libtzar/tzar_format.h"
+#include "libtzar/tzar_crypto.h"
+
+// Changes the password of .tzar2 archives (format version 8 and later) in place. Their
+// content is encrypted under a random data key that the header stores wrapped by the
+// password key, so only the header is rewritten: the cost is one key derivation per
+// archive, whatever its size.
+
+// Master keys of the current password, by KDF parameters. Archives written through
+// tzar_agent share a salt, so a whole store of them needs only a few derivations.
+class MasterKeyCache {
+public:
+    explicit MasterKeyCache(const std::string& password) : password_(password) {}
+
+    const std::vector<uint8_t>& get(const KdfParams& kdf) {
+        std::string id(1, static_cast<char>(kdf.kdf));
+        id.append(reinterpret_cast<const char*>(&kdf.iterations), sizeof(kdf.iterations));
+        id.append(reinterpret_cast<const char*>(kdf.salt), sizeof(kdf.salt));
+        auto it = keys_.find(id);
+        if (it == keys_.end()) {
+            it = keys_.emplace(id, deriveMasterKey(password_, kdf)).first;
+        }
+        return it->second;
+    }
+
+private:
+    std::string password_;
+    std::map<std::string, std::vector<uint8_t>> keys_;
+};
+
+// Rewraps the data key of 'path' under 'new_master_key' and writes the new header over
+// the old one with a single pwrite(), followed by fsync(). Throws std::runtime_error.
+void rekeyArchive(const std::string& path, MasterKeyCache& old_keys, const KdfParams& new_kdf,
+                  const std::vector<uint8_t>& new_master_key) {
+    EncryptedArchiveHeader header;
+    std::streamoff header_size;
+    {
+        std::ifstream inFile(path, std::ios::binary);
+        if (!inFile.is_open()) {
+            throw std::runtime_error("Could not open archive.");
+        }
+        header = readEncryptedArchiveHeader(inFile);
+        header_size = inFile.tellg();
+    }
+    if (!header.hasWrappedKey()) {
+        throw std::runtime_error("Format version " + std::to_string(header.version) +
+                                 " predates envelope encryption; convert it with tzar_decrypt --to-tzar"
+                                 " and tzar_encrypt instead.");
+    }
+
+    std::vector<uint8_t> data_key;
+    if (!unwrapDataKey(old_keys.get(header.kdf), header, data_key)) {
+        throw std::runtime_error("Wrong password.");
+    }
+    header.kdf = new_kdf;
+    wrapDataKey(new_master_key, header, data_key, header.wrapped_key);
+
+    std::ostringstream out;
+    writeEncryptedArchiveHeader(out, header);
+    const std::string bytes = out.str();
+    if (static_cast<std::streamoff>(bytes.size()) != header_size) {
+        throw std::runtime_error("Rewritten header does not match the old one in size.");
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Could not open archive for writing: ") + std::strerror(errno));
+    }
+    bool ok = pwrite(fd, bytes.data(), bytes.size(), 0) == static_cast<ssize_t>(bytes.size()) && fsync(fd) == 0;
+    int saved_errno = errno;
+    close(fd);
+    if (!ok) {
+        throw std::runtime_error(std::string("Could not write header: ") + std::strerror(saved_errno));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    // Usage: ./tzar_rekey [--kdf-iterations=N] <archive.tzar2> [archive2.tzar2 ...]
+    // Reads the current and the new password from standard input.
+    uint32_t kdf_iterations = KDF_DEFAULT_ITERATIONS;
+    std::vector<std::string> archives;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--kdf-iterations=", 0) == 0) {
+            kdf_iterations = static_cast<uint32_t>(std::strtoul(arg.c_str() + 17, nullptr, 10));
+            if (kdf_iterations < KDF_MIN_ITERATIONS) {
+                std::cerr << "Error: --kdf-iterations must be at least " << KDF_MIN_ITERATIONS << ".\n";
+                return 1;
+            }
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "Error: Unknown option: " << arg << std::endl;
+            return 1;
+        } else {
+            archives.push_back(arg);
+        }
+    }
+    if (archives.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--kdf-iterations=N] <archive.tzar2> [archive2.tzar2 ...]\n";
+        std::cerr << "Changes the password of the archives in place; the content is not re-encrypted.\n";
+        return 1;
+    }
+
+    std::string old_password;
+    std::string new_password;
+    std::cout << "Enter current password: ";
+    std::getline(std::cin, old_password);
+    std::cout << "Enter new password: ";
+    std::getline(std::cin, new_password);
+    if (old_password.empty() || new_password.empty()) {
+        std::cerr << "Error: Password cannot be empty.\n";
+        return 1;
+    }
+
+    // One new salt for the whole run, so the new password is derived only once.
+    KdfParams new_kdf;
+    new_kdf.kdf = KDF_PBKDF2_HMAC_SHA256;
+    new_kdf.iterations = kdf_iterations;
+    if (getrandom(new_kdf.salt, sizeof(new_kdf.salt), 0) != static_cast<ssize_t>(sizeof(new_kdf.salt))) {
+        std::cerr << "Error: Could not obtain random bytes: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    const std::vector<uint8_t> new_master_key = deriveMasterKey(new_password, new_kdf);
+    MasterKeyCache old_keys(old_password);
+
+    int failures = 0;
+    for (const std::string& path : archives) {
+        try {
+            rekeyArchive(path, old_keys, new_kdf, new_master_key);
+            std::cout << "Rekeyed: " << path << "\n";
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: " << path << ": " << e.what() << std::endl;
+            failures++;
+        }
+    }
+    std::cout << "Rekeyed " << archives.size() - failures << " of " << archives.size() << " archives ("
+              << kdfName(new_kdf.kdf) << ", " << new_kdf.iterations << " iterations).\n";
+    return failures == 0 ? 0 : 1;
+}